@@ -0,0 +1,201 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// binlog.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Reading and writing the binary data logs. See binlog.h for the format.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "binlog.h"
+
+
+int IsBinLog(const char *name)
+{
+  FILE *file;
+  char magic[8];
+  int result;
+
+  file = fopen(name, "rb");
+  if (file == NULL)
+    return 0;
+  result = ((fread(magic, 1, 8, file) == 8) && (memcmp(magic, BINLOG_MAGIC, 8) == 0));
+  fclose(file);
+  return result;
+}
+
+
+int OpenBinLog(TBinLog *log, const char *name)
+{
+  struct stat status;
+  long long i, end;
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Unable to open the binary log %s\n", name);
+    return -1;
+  }
+  if ((fstat(fd, &status) < 0) || (status.st_size < (long long) sizeof(TBinLogHeader))) {
+    fprintf(stderr, "%s is too short to be a binary log\n", name);
+    close(fd);
+    return -1;
+  }
+  log->size = status.st_size;
+  log->base = (unsigned char *) mmap(NULL, log->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays good after the file is closed.
+  close(fd);
+  if (log->base == MAP_FAILED) {
+    fprintf(stderr, "Unable to map the binary log %s into memory\n", name);
+    return -1;
+  }
+  madvise(log->base, log->size, MADV_SEQUENTIAL);
+
+  log->header = (const TBinLogHeader *) log->base;
+  log->index = (const long long *) (log->base + log->header->indexOffset);
+  log->next = 0;
+  if ((memcmp(log->header->magic, BINLOG_MAGIC, 8) != 0) || (log->header->version != BINLOG_VERSION) ||
+      (log->header->records < 0) || (log->header->indexOffset < (long long) sizeof(TBinLogHeader)) ||
+      (log->header->indexOffset + log->header->records*(long long) sizeof(long long) > log->size)) {
+    fprintf(stderr, "%s is not a binary log, or was not finished\n", name);
+    CloseBinLog(log);
+    return -1;
+  }
+
+  // Make sure that every record lies inside the file, so that they can be read without checking again.
+  for (i = 0; i < log->header->records; i++) {
+    end = log->index[i] + (long long) sizeof(TBinRecord);
+    if ((log->index[i] < (long long) sizeof(TBinLogHeader)) || (log->index[i] % 8 != 0) || (end > log->header->indexOffset) ||
+	(log->index[i] + BinRecordSize(((const TBinRecord *) (log->base + log->index[i]))->kind, 
+				       ((const TBinRecord *) (log->base + log->index[i]))->count) > log->header->indexOffset)) {
+      fprintf(stderr, "%s: record %lld is damaged\n", name, i);
+      CloseBinLog(log);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+void CloseBinLog(TBinLog *log)
+{
+  munmap(log->base, log->size);
+  log->base = NULL;
+}
+
+
+int SeekBinLog(TBinLog *log, long long record)
+{
+  if ((record < 0) || (record > log->header->records))
+    return -1;
+  log->next = record;
+  return 0;
+}
+
+
+const TBinRecord *NextBinRecord(TBinLog *log)
+{
+  if (log->next >= log->header->records)
+    return NULL;
+  log->next++;
+  return (const TBinRecord *) (log->base + log->index[log->next-1]);
+}
+
+
+int BeginBinLog(TBinLogWriter *writer, const char *name, int senseNumber)
+{
+  writer->file = fopen(name, "wb");
+  if (writer->file == NULL) {
+    fprintf(stderr, "Unable to open %s for writing\n", name);
+    return -1;
+  }
+  memset(&(writer->header), 0, sizeof(TBinLogHeader));
+  memcpy(writer->header.magic, BINLOG_MAGIC, 8);
+  writer->header.version = BINLOG_VERSION;
+  writer->header.senseNumber = senseNumber;
+  writer->room = 1024;
+  writer->offset = (long long *) malloc(writer->room * sizeof(long long));
+  writer->position = sizeof(TBinLogHeader);
+  // The header is written again once the number of records and the position of the index are known.
+  if ((writer->offset == NULL) || (fwrite(&(writer->header), sizeof(TBinLogHeader), 1, writer->file) != 1)) {
+    fprintf(stderr, "Unable to write the binary log %s\n", name);
+    return -1;
+  }
+  return 0;
+}
+
+
+int AddBinRecord(TBinLogWriter *writer, int kind, int count, const void *data)
+{
+  static const char padding[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  TBinRecord record;
+  long long size, length, pad;
+
+  if (writer->header.records == writer->room) {
+    writer->room = writer->room*2;
+    writer->offset = (long long *) realloc(writer->offset, writer->room * sizeof(long long));
+    if (writer->offset == NULL) {
+      fprintf(stderr, "Unable to grow the index of the binary log to %lld records\n", writer->room);
+      return -1;
+    }
+  }
+
+  record.kind = kind;
+  record.count = count;
+  size = BinRecordSize(kind, count);
+  if (kind == BINLOG_ODOMETRY)
+    length = 3*sizeof(double);
+  else if (kind == BINLOG_LASER)
+    length = count*sizeof(float);
+  else
+    length = 0;
+  pad = size - sizeof(TBinRecord) - length;
+  if ((fwrite(&record, sizeof(TBinRecord), 1, writer->file) != 1) ||
+      ((length > 0) && (fwrite(data, length, 1, writer->file) != 1)) ||
+      ((pad > 0) && (fwrite(padding, pad, 1, writer->file) != 1))) {
+    fprintf(stderr, "Unable to write record %lld of the binary log\n", writer->header.records);
+    return -1;
+  }
+
+  writer->offset[writer->header.records] = writer->position;
+  writer->header.records++;
+  writer->position = writer->position + size;
+  return 0;
+}
+
+
+int EndBinLog(TBinLogWriter *writer)
+{
+  int result;
+
+  result = 0;
+  writer->header.indexOffset = writer->position;
+  if (((writer->header.records > 0) && 
+       (fwrite(writer->offset, sizeof(long long), writer->header.records, writer->file) != (size_t) writer->header.records)) ||
+      (fseek(writer->file, 0, SEEK_SET) != 0) || 
+      (fwrite(&(writer->header), sizeof(TBinLogHeader), 1, writer->file) != 1)) {
+    fprintf(stderr, "Unable to finish writing the binary log\n");
+    result = -1;
+  }
+  if (fclose(writer->file) != 0)
+    result = -1;
+  free(writer->offset);
+  return result;
+}
@@ -0,0 +1,113 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// binlog.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// A compact binary form of the data logs, which can be played back without any parsing. The text
+// logs (.log and .rec) are converted by ConvertLog in low.c (-b option in slam.cpp), and the result
+// is read straight out of memory with mmap.
+//
+// The file starts with a TBinLogHeader, followed by the records, one for each line of the text log,
+// in the same order. Each record starts with a TBinRecord, and is padded out to a multiple of 8 bytes:
+//  - BINLOG_ODOMETRY is followed by the x, y and theta of the odometry (3 doubles), exactly as
+//    ReadLog would leave them.
+//  - BINLOG_LASER is followed by count ranges (floats), in grid squares, already clipped to the
+//    maximum range where the text log format called for it.
+//  - BINLOG_SKIP has nothing after it. These stand in for the lines of the text log that don't
+//    change anything, so that the records still pair up into steps the same way that the lines did.
+// After the records comes the index: the offset from the start of the file of each record (long longs),
+// so that any record can be found directly.
+//
+
+#define BINLOG_MAGIC "DPSLAMBL"
+#define BINLOG_VERSION 1
+
+// The kinds of record.
+#define BINLOG_SKIP 0
+#define BINLOG_ODOMETRY 1
+#define BINLOG_LASER 2
+
+struct TBinLogHeader_struct {
+  char magic[8];
+  int version;
+  // The number of ranges in a full laser scan for the robot which the log was converted for
+  int senseNumber;
+  long long records;
+  long long indexOffset;
+};
+typedef struct TBinLogHeader_struct TBinLogHeader;
+
+struct TBinRecord_struct {
+  int kind;
+  int count;
+};
+typedef struct TBinRecord_struct TBinRecord;
+
+// A binary log which is open for playback.
+struct TBinLog_struct {
+  unsigned char *base;
+  long long size;
+  const TBinLogHeader *header;
+  const long long *index;
+  // The record which NextBinRecord will return
+  long long next;
+};
+typedef struct TBinLog_struct TBinLog;
+
+// The number of bytes taken by a record of the given kind and count, including the padding.
+static inline long long BinRecordSize(int kind, int count)
+{
+  if (kind == BINLOG_ODOMETRY)
+    return sizeof(TBinRecord) + 3*sizeof(double);
+  if (kind == BINLOG_LASER)
+    return sizeof(TBinRecord) + ((count*sizeof(float) + 7) & ~7);
+  return sizeof(TBinRecord);
+}
+
+// The odometry or the ranges which follow a record.
+static inline const double *BinOdometry(const TBinRecord *record)
+{
+  return (const double *) (record + 1);
+}
+
+static inline const float *BinRanges(const TBinRecord *record)
+{
+  return (const float *) (record + 1);
+}
+
+// Returns 1 if the named file starts out like a binary log, and 0 otherwise.
+int IsBinLog(const char *name);
+// Maps the named binary log into memory, and checks that it is whole. Returns -1 (with a message)
+// if it can't be used.
+int OpenBinLog(TBinLog *log, const char *name);
+void CloseBinLog(TBinLog *log);
+// Makes the given record the next one to be read. Returns -1 if there is no such record.
+int SeekBinLog(TBinLog *log, long long record);
+// Returns the next record, in place in the mapped file, or NULL at the end of the log.
+const TBinRecord *NextBinRecord(TBinLog *log);
+
+// For writing a binary log. BeginBinLog writes a placeholder header, AddBinRecord writes one record
+// and keeps track of where it went, and EndBinLog writes the index and the finished header.
+// Each returns -1 if the file couldn't be written.
+struct TBinLogWriter_struct {
+  FILE *file;
+  TBinLogHeader header;
+  long long *offset;
+  long long room, position;
+};
+typedef struct TBinLogWriter_struct TBinLogWriter;
+
+int BeginBinLog(TBinLogWriter *writer, const char *name, int senseNumber);
+int AddBinRecord(TBinLogWriter *writer, int kind, int count, const void *data);
+int EndBinLog(TBinLogWriter *writer);
@@ -0,0 +1,393 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// check.cpp
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Checks of the pieces of SLAM which can go wrong without making the runs look any different. Built
+// and run by "make check". Reports every failure it finds, and returns non-zero if there were any.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "mt-rand.h"
+#include "resample.h"
+#include "map.h"
+#include "rays.h"
+#include "binlog.h"
+#include "reader.h"
+
+#define SEED 1
+
+// The number of samples in the fixed weight vectors.
+#define CHECK_SAMPLES 40
+
+static const char *strategies[RESAMPLE_STRATEGIES] = {"multinomial", "systematic", "stratified", "residual", "alias"};
+
+
+//
+// CheckResample
+//
+// Runs the resampler once on the given weights, and checks that the children handed out add up to
+// the number of draws that Resample reports, that this is all of the draws when the parents aren't
+// limited, that no more than parents samples get children, and that no sample with a weight of 0
+// gets any. Returns the number of failures.
+//
+static int CheckResample(TResampler *resampler, const char *name, const double weight[], int draws, int parents)
+{
+  int children[CHECK_SAMPLES];
+  int i, handed, total, picked, failures;
+
+  memset(children, 0, CHECK_SAMPLES*sizeof(int));
+  for (i = 0; i < CHECK_SAMPLES; i++)
+    resampler->weight[i] = weight[i];
+  OpenStream(&resampler->stream, STREAM_LOW_RESAMPLE, draws, parents);
+  handed = Resample(resampler, CHECK_SAMPLES, draws, parents, children);
+
+  total = 0;
+  picked = 0;
+  failures = 0;
+  for (i = 0; i < CHECK_SAMPLES; i++) {
+    if ((children[i] < 0) || ((weight[i] == 0.0) && (children[i] != 0))) {
+      fprintf(stderr, "%s: sample %d (weight %f) got %d children\n", name, i, weight[i], children[i]);
+      failures++;
+    }
+    total = total + children[i];
+    if (children[i] > 0)
+      picked++;
+  }
+
+  if (total != handed) {
+    fprintf(stderr, "%s: %d draws, %d parents: handed out %d children, but reported %d\n", name, draws, parents, total, handed);
+    failures++;
+  }
+  if ((parents == 0) && (handed != draws)) {
+    fprintf(stderr, "%s: %d draws with no limit on parents, but only %d children handed out\n", name, draws, handed);
+    failures++;
+  }
+  if ((handed > draws) || ((parents > 0) && (picked > parents))) {
+    fprintf(stderr, "%s: %d draws, %d parents: %d children among %d samples\n", name, draws, parents, handed, picked);
+    failures++;
+  }
+  return failures;
+}
+
+
+
+//
+// CheckResamplers
+//
+// Runs every resampling strategy (the choices for -e and -E in slam.cpp) on a fixed, uneven weight
+// vector with some zero weights, and on an even one, for a range of draw counts, with and without a
+// limit on the parents, and with and without the effective sample size test. Both random number
+// generators are used. Returns the number of failures.
+//
+static int CheckResamplers()
+{
+  TResampler resampler;
+  double uneven[CHECK_SAMPLES], even[CHECK_SAMPLES];
+  int draws[4] = {1, CHECK_SAMPLES, 137, 1000};
+  int parents[3] = {0, 1, 10};
+  double ess[2] = {0.0, 0.5};
+  int generator, s, d, p, e, i, failures, runs;
+
+  for (i = 0; i < CHECK_SAMPLES; i++) {
+    uneven[i] = ((i % 7 == 3) ? 0.0 : (1.0 + (i % 5)) / (1.0 + i));
+    even[i] = 1.0/CHECK_SAMPLES;
+  }
+
+  failures = 0;
+  runs = 0;
+  for (generator = NOISE_MT; generator <= NOISE_XOSHIRO; generator++) {
+    seedMT(SEED);
+    InitNoise(generator, SEED);
+    for (s = 0; s < RESAMPLE_STRATEGIES; s++)
+      for (e = 0; e < 2; e++) {
+	if (InitResampler(&resampler, ResamplerStrategy(strategies[s]), ess[e], CHECK_SAMPLES) == -1)
+	  exit(-1);
+	for (d = 0; d < 4; d++)
+	  for (p = 0; p < 3; p++) {
+	    failures = failures + CheckResample(&resampler, strategies[s], uneven, draws[d], parents[p]);
+	    failures = failures + CheckResample(&resampler, strategies[s], even, draws[d], parents[p]);
+	    runs = runs + 2;
+	  }
+	free(resampler.weight);
+	free(resampler.cumulative);
+	free(resampler.keep);
+	free(resampler.alias);
+	free(resampler.work);
+	free(resampler.count);
+      }
+  }
+
+  fprintf(stderr, "Resampling: %d runs of %d strategies, %d failures\n", runs, RESAMPLE_STRATEGIES, failures);
+  return failures;
+}
+
+
+
+//
+// CheckBinLog
+//
+// Reads the text log (.log or .rec) with the text reader, and the binary log that "slam -b" made from it,
+// and checks that they hold the same records: the same odometry poses, exactly, and the same laser ranges,
+// up to the rounding to floats that the binary log does. Also checks that seeking to each record finds the
+// same one as reading the log through. Returns the number of failures.
+//
+static int CheckBinLog(char *textName, char *binaryName)
+{
+  TBinLog binLog;
+  TLogRecord text;
+  const TBinRecord *binary;
+  const TBinRecord **found;
+  FILE *textFile;
+  char line[4096];
+  int format, i, failures;
+  long long records;
+
+  textFile = fopen(textName, "r");
+  if (textFile == NULL) {
+    fprintf(stderr, "Unable to open the data log %s\n", textName);
+    return 1;
+  }
+  if (OpenBinLog(&binLog, binaryName) == -1) {
+    fclose(textFile);
+    return 1;
+  }
+  if ((strlen(textName) >= 3) && (strncmp(&textName[strlen(textName)-3], "rec", 3) == 0))
+    format = REC;
+  else
+    format = LOG;
+
+  found = (const TBinRecord **) malloc((binLog.header->records+1) * sizeof(TBinRecord *));
+  if (found == NULL) {
+    fprintf(stderr, "Unable to allocate room for checking %lld records.\n", binLog.header->records);
+    exit(-1);
+  }
+
+  failures = 0;
+  if (binLog.header->senseNumber != SENSE_NUMBER) {
+    fprintf(stderr, "%s was made for %d laser readings, not %d\n", binaryName, binLog.header->senseNumber, SENSE_NUMBER);
+    failures++;
+  }
+
+  records = 0;
+  while ((failures < 10) && (fgets(line, 4096, textFile) != NULL)) {
+    ParseLogLine(line, format, &text);
+    binary = NextBinRecord(&binLog);
+    if (binary == NULL) {
+      fprintf(stderr, "%s ends after %lld records, before the text log does\n", binaryName, records);
+      failures++;
+      break;
+    }
+    found[records] = binary;
+
+    if ((binary->kind != text.kind) || ((text.kind == BINLOG_LASER) && (binary->count != text.count))) {
+      fprintf(stderr, "Record %lld is a %d with %d readings in the binary log, and a %d with %d in the text log\n",
+	      records, binary->kind, binary->count, text.kind, text.count);
+      failures++;
+    }
+    else if (text.kind == BINLOG_ODOMETRY) {
+      for (i = 0; i < 3; i++)
+	if (BinOdometry(binary)[i] != text.pose[i]) {
+	  fprintf(stderr, "Record %lld: odometry %d is %.17g in the binary log, and %.17g in the text log\n",
+		  records, i, BinOdometry(binary)[i], text.pose[i]);
+	  failures++;
+	}
+    }
+    else if (text.kind == BINLOG_LASER) {
+      for (i = 0; i < text.count; i++)
+	if (BinRanges(binary)[i] != (float) text.range[i]) {
+	  fprintf(stderr, "Record %lld: range %d is %.9g in the binary log, and %.9g in the text log\n",
+		  records, i, BinRanges(binary)[i], text.range[i]);
+	  failures++;
+	}
+    }
+    records++;
+  }
+  fclose(textFile);
+
+  if ((failures == 0) && (NextBinRecord(&binLog) != NULL)) {
+    fprintf(stderr, "%s has more records than the text log's %lld\n", binaryName, records);
+    failures++;
+  }
+
+  // Seek to the records in an order which jumps around the log.
+  for (i = 0; (failures == 0) && (i < records); i++) {
+    if ((SeekBinLog(&binLog, (i * 7919LL) % records) == -1) || (NextBinRecord(&binLog) != found[(i * 7919LL) % records])) {
+      fprintf(stderr, "Seeking to record %lld of %s finds the wrong record\n", (i * 7919LL) % records, binaryName);
+      failures++;
+    }
+  }
+  if ((failures == 0) && ((SeekBinLog(&binLog, records) == -1) || (NextBinRecord(&binLog) != NULL) ||
+			  (SeekBinLog(&binLog, records+1) != -1))) {
+    fprintf(stderr, "Seeking to the end of %s, or past it, goes wrong\n", binaryName);
+    failures++;
+  }
+
+  free(found);
+  CloseBinLog(&binLog);
+  fprintf(stderr, "Binary log: %lld records of %s checked against %s, %d failures\n", records, textName, binaryName, failures);
+  return failures;
+}
+
+
+
+//
+// For sorting the grid squares in CheckCoalesce.
+//
+static int CompareSquares(const void *a, const void *b)
+{
+  long long x = *((const long long *) a), y = *((const long long *) b);
+
+  return (x < y) ? -1 : (x > y);
+}
+
+
+
+//
+// CheckCoalesce
+//
+// Traces every laser scan in the text log, the way that InsertScans does for one particle (from the middle
+// of the grid, at the heading of the odometry), and links the updates together with CoalesceUpdates. Then 
+// checks that each grid square heads exactly one chain of updates, that every update is on the chain for 
+// its own square, and that each chain runs in the order of the trace. AddSquare then sums up the same 
+// distances and hits in the same order as adding the updates one at a time, so the map comes out the same.
+// Returns the number of failures.
+//
+static int CheckCoalesce(char *textName)
+{
+  TSquareTable table;
+  TMapUpdate *update;
+  TLogRecord text;
+  FILE *textFile;
+  long long *square;
+  char *seen;
+  char line[4096];
+  double theta, startx, starty;
+  int format, i, j, n, squares, scans, failures;
+  long long updates, total;
+
+  textFile = fopen(textName, "r");
+  if (textFile == NULL) {
+    fprintf(stderr, "Unable to open the data log %s\n", textName);
+    return 1;
+  }
+  if ((strlen(textName) >= 3) && (strncmp(&textName[strlen(textName)-3], "rec", 3) == 0))
+    format = REC;
+  else
+    format = LOG;
+
+  update = (TMapUpdate *) malloc(SENSE_NUMBER * MAX_TRACE_UPDATES * sizeof(TMapUpdate));
+  square = (long long *) malloc(SENSE_NUMBER * MAX_TRACE_UPDATES * sizeof(long long));
+  seen = (char *) malloc(SENSE_NUMBER * MAX_TRACE_UPDATES);
+  if ((update == NULL) || (square == NULL) || (seen == NULL)) {
+    fprintf(stderr, "Unable to allocate room for checking the coalesced updates.\n");
+    exit(-1);
+  }
+  table.key = NULL;
+  table.stamp = NULL;
+  table.last = NULL;
+  table.mask = 0;
+  table.epoch = 0;
+
+  theta = 0.0;
+  scans = 0;
+  updates = 0;
+  total = 0;
+  failures = 0;
+  while ((failures < 10) && (fgets(line, 4096, textFile) != NULL)) {
+    if (ParseLogLine(line, format, &text) == BINLOG_ODOMETRY)
+      theta = text.pose[2];
+    if (text.kind != BINLOG_LASER)
+      continue;
+
+    // Move the start around inside the grid square, so that the traces don't all line up the same way.
+    startx = 1000.0 + fmod(scans * 0.377, 1.0);
+    starty = 1000.0 + fmod(scans * 0.613, 1.0);
+    n = 0;
+    for (j = 0; j < text.count; j++)
+      n = n + TraceUpdates(startx, starty, text.range[j], theta + (j*M_PI/180.0) - M_PI/2, 
+			   (text.range[j] < MAX_SENSE_RANGE), update + n);
+    CoalesceUpdates(&table, update, n);
+
+    memset(seen, 0, n);
+    squares = 0;
+    for (i = 0; i < n; i++) {
+      if (update[i].repeat)
+	continue;
+      square[squares] = ((long long) update[i].x << 32) | (unsigned int) update[i].y;
+      squares++;
+      for (j = i; j >= 0; j = update[j].next) {
+	if (seen[j] || (update[j].x != update[i].x) || (update[j].y != update[i].y) || (update[j].repeat != (j != i)) ||
+	    ((update[j].next >= 0) && (update[j].next <= j))) {
+	  fprintf(stderr, "Scan %d: update %d is out of place on the chain for square %d,%d\n", scans, j, update[i].x, update[i].y);
+	  failures++;
+	  break;
+	}
+	seen[j] = 1;
+      }
+    }
+    for (i = 0; i < n; i++)
+      if (!seen[i]) {
+	fprintf(stderr, "Scan %d: update %d to square %d,%d is not on any chain\n", scans, i, update[i].x, update[i].y);
+	failures++;
+      }
+    qsort(square, squares, sizeof(long long), CompareSquares);
+    for (i = 1; i < squares; i++)
+      if (square[i] == square[i-1]) {
+	fprintf(stderr, "Scan %d: more than one chain for square %d,%d\n", scans, (int) (square[i] >> 32), (int) square[i]);
+	failures++;
+      }
+
+    scans++;
+    updates = updates + n;
+    total = total + squares;
+  }
+  fclose(textFile);
+
+  free(update);
+  free(square);
+  free(seen);
+  free(table.key);
+  free(table.stamp);
+  free(table.last);
+  fprintf(stderr, "Coalescing: %d scans of %s, %lld updates to %lld grid squares, %d failures\n", 
+	  scans, textName, updates, total, failures);
+  return failures;
+}
+
+
+
+//
+// Always checks the resamplers. If it is given a text log and the binary log made from it, those are
+// checked against each other, and the scans of the text log are used to check the coalescing of updates.
+//
+int main(int argc, char *argv[])
+{
+  int failures;
+
+  failures = CheckResamplers();
+  if (argc == 3) {
+    failures = failures + CheckBinLog(argv[1], argv[2]);
+    failures = failures + CheckCoalesce(argv[1]);
+  }
+  if (failures > 0) {
+    fprintf(stderr, "FAILED\n");
+    return -1;
+  }
+  fprintf(stderr, "All checks passed\n");
+  return 0;
+}
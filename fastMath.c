@@ -0,0 +1,44 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// fastMath.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Tables for the fast exp and log. See fastMath.h for the functions themselves.
+//
+
+#include "fastMath.h"
+
+int FAST_MATH = 0;
+
+double fastExpTable[FAST_EXP_SIZE];
+double fastLogTable[FAST_LOG_SIZE], fastInvTable[FAST_LOG_SIZE];
+
+
+void InitFastMath(int fast)
+{
+  int j;
+  double center;
+
+  for (j = 0; j < FAST_EXP_SIZE; j++)
+    fastExpTable[j] = exp2((double) j / FAST_EXP_SIZE);
+
+  // Each entry covers mantissas from 1+j/128 to 1+(j+1)/128, and is centered in that range.
+  for (j = 0; j < FAST_LOG_SIZE; j++) {
+    center = 1.0 + (j + 0.5) / FAST_LOG_SIZE;
+    fastLogTable[j] = log(center);
+    fastInvTable[j] = 1.0 / center;
+  }
+
+  FAST_MATH = fast;
+}
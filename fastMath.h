@@ -0,0 +1,112 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// fastMath.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Faster, slightly less accurate versions of exp and log for the observation model. Every
+// grid square visited by a line trace needs an exponential for the chance of the laser
+// stopping there, and another for the chance of the observed error, and every laser cast
+// adds a log to the sample's score. None of these need anything close to full precision.
+//
+// FastExp splits x into a multiple of ln(2)/64 and a small remainder r (|r| <= ln(2)/128).
+// The multiple comes from a table of 2^(j/64) and the exponent bits, and exp(r) from a cubic.
+// Maximum relative error: 4e-11 (for -708 < x < 709; outside of that, exp is used).
+//
+// FastLog splits x into 2^e * m (1 <= m < 2), and m into one of 128 table entries c and a
+// small remainder t = m/c - 1 (|t| <= 1/257). log(1+t) comes from a cubic.
+// Maximum absolute error: 6e-11 (for normal, positive x; anything else goes to log).
+// Note that this is an absolute error, since log is near zero for x near 1.
+//
+// When FAST_MATH is set, the vector kernels in simd.c also drop to a shorter series for exp,
+// with a maximum relative error of 3e-10.
+//
+
+#include <math.h>
+#include <string.h>
+
+#define FAST_EXP_BITS 6
+#define FAST_EXP_SIZE (1 << FAST_EXP_BITS)
+#define FAST_LOG_BITS 7
+#define FAST_LOG_SIZE (1 << FAST_LOG_BITS)
+
+// Set to 1 to use the fast versions of exp and log in the observation model, or 0 for the
+// standard math library.
+extern int FAST_MATH;
+
+// 2^(j/64), and the log and inverse of the center of each of the 128 ranges of the mantissa.
+extern double fastExpTable[FAST_EXP_SIZE];
+extern double fastLogTable[FAST_LOG_SIZE], fastInvTable[FAST_LOG_SIZE];
+
+// Fills in the tables, and sets FAST_MATH.
+void InitFastMath(int fast);
+
+
+static inline double FastExp(double x)
+{
+  double kd, r, p;
+  long long bits;
+  int k;
+
+  if ((x < -708.0) || (x > 709.0) || (x != x))
+    return exp(x);
+
+  // Round x*64/ln(2) to the nearest integer, by way of the 1.5*2^52 trick.
+  kd = x * (FAST_EXP_SIZE * M_LOG2E) + 6755399441055744.0;
+  memcpy(&bits, &kd, sizeof(bits));
+  k = (int) bits;
+  kd = kd - 6755399441055744.0;
+
+  r = (x - kd * (6.93147180369123816490e-01/FAST_EXP_SIZE)) - kd * (1.90821492927058770002e-10/FAST_EXP_SIZE);
+  p = 1.0 + r*(1.0 + r*(0.5 + r*(1.0/6.0)));
+
+  bits = ((long long) ((k >> FAST_EXP_BITS) + 1023)) << 52;
+  memcpy(&kd, &bits, sizeof(kd));
+  return fastExpTable[k & (FAST_EXP_SIZE-1)] * p * kd;
+}
+
+
+static inline double FastLog(double x)
+{
+  long long bits;
+  double m, t;
+  int e, j;
+
+  memcpy(&bits, &x, sizeof(bits));
+  e = (int) ((bits >> 52) & 0x7ff);
+  if ((x <= 0) || (e == 0) || (e == 0x7ff))
+    return log(x);
+
+  j = (int) ((bits >> (52-FAST_LOG_BITS)) & (FAST_LOG_SIZE-1));
+  bits = (bits & 0x000fffffffffffffLL) | 0x3ff0000000000000LL;
+  memcpy(&m, &bits, sizeof(m));
+
+  t = m*fastInvTable[j] - 1.0;
+  return ((e - 1023) * M_LN2) + fastLogTable[j] + t*(1.0 + t*(-0.5 + t*(1.0/3.0)));
+}
+
+
+// The exp and log used by the observation model, according to FAST_MATH.
+static inline double ModelExp(double x)
+{
+  if (FAST_MATH)
+    return FastExp(x);
+  return exp(x);
+}
+
+static inline double ModelLog(double x)
+{
+  if (FAST_MATH)
+    return FastLog(x);
+  return log(x);
+}
@@ -21,6 +21,14 @@
 
 #include "high.h"
 #include "mt-rand.h"
+#include "threads.h"
+#include "simd.h"
+#include "rays.h"
+#include "fastMath.h"
+#include "levelMap.h"
+#include "level.h"
+#include "resample.h"
+#include "image.h"
 
 // Threshold for culling particles.  x means that particles with prob. e^x worse
 // then the best in the current round are culled
@@ -34,7 +42,9 @@
 #define WORST_POSSIBLE -10000000
 
 struct TSample_struct {
-  float x, y, theta, xG, yG, tG;
+  // The position is a double for the same reason as in TParticle (see map.h). The scatter is small enough for floats.
+  double x, y;
+  float theta, xG, yG, tG;
   double probability;
   int    parent;
 };
@@ -44,16 +54,28 @@ typedef struct TSample_struct TSample;
 // The number of iterations between writing out the map for video. 0 is off.
 int H_VIDEO = 1;
 
-int h_cleanID;
-int h_availableID[H_ID_NUMBER];
 // No. of children each particle gets
-int h_children[H_PARTICLE_NUMBER];
-
-TParticle h_savedParticle[H_PARTICLE_NUMBER];
+int *h_children;
+// The samples generated in each iteration of HighLocalize, the scatter (x, y and theta) that each was
+// given, and how many children each gets when they are resampled.
+TSample *h_sample;
+double *h_scatter;
+int *h_newchildren;
+TResampler highResampler;
+
+TParticle *h_savedParticle;
 int h_cur_saved_particles_used;
 
 int h_curGeneration;
-unsigned char h_map[H_MAP_WIDTH][H_MAP_HEIGHT];
+// What the map is drawn on when it is written out (see TMapCanvas in map.h).
+TMapCanvas h_map;
+
+// Whether the maps are written out in tiles (see TTileExport in image.h), into TILE_DIRECTORY, rather than
+// each as a whole new image.
+int TILED_MAPS = 0;
+TTileExport h_tiles;
+// The serial number of the ancestor whose map the tiles were last written from.
+int h_tilesSerial;
 
 
 
@@ -65,137 +87,125 @@ double LogScorePosition(double x, double y, double theta, int parent, TSense sen
   total = 0.0;
   for (i=0; i < SENSE_NUMBER; i++) {
     a = HighLineTrace(x, y, (sense[i].theta + theta), sense[i].distance, parent);
-    total = total + log(MAX(MAX_TRACE_ERROR, a));
+    total = total + ModelLog(MAX(MAX_TRACE_ERROR, a));
   }
   return total;
 }
 
 
 
-void HighLocalize(TPath *path, TSenseLog *obs)
+void HighLocalize(TSegmentLog *log)
 {
-  int i, j, k;
+  int i, j, k, step;
   int best, keepers, worst;
-  int newchildren[H_SAMPLE_NUMBER];
   double moveAngle, threshold;
-  double ftemp, total;
-  TSample sample[H_SAMPLE_NUMBER];
-  TPath *holdPath;
-  TSenseLog *holdObs;
-
-  holdPath = path;
-  holdObs = obs;
-  obs = obs->next;
+  double total;
+  static const double deviation[3] = {0.8, 0.8, 0.025};
+  TPath *path;
  
  // Make particles
+  GaussianBatch(h_scatter, 3*H_SAMPLE_NUMBER, deviation, 3, STREAM_HIGH_MOTION, h_curGeneration);
   j = 0;
   for (i=0; i < h_cur_particles_used; i++) {
     while (h_children[i] > 0) {
       h_children[i]--;
-      sample[j].parent = i;
-      sample[j].probability = 0.0;
+      h_sample[j].parent = i;
+      h_sample[j].probability = 0.0;
       
       // Scatter them
-      sample[j].xG = GAUSSIAN(0.8);
-      sample[j].yG = GAUSSIAN(0.8);
-      sample[j].tG = GAUSSIAN(0.025);
-      sample[j].x = h_particle[i].x + sample[j].xG;
-      sample[j].y = h_particle[i].y + sample[j].yG;
-      sample[j].theta = h_particle[i].theta + sample[j].tG;
+      h_sample[j].xG = h_scatter[3*j];
+      h_sample[j].yG = h_scatter[3*j+1];
+      h_sample[j].tG = h_scatter[3*j+2];
+      h_sample[j].x = h_particle[i].x + h_sample[j].xG;
+      h_sample[j].y = h_particle[i].y + h_sample[j].yG;
+      h_sample[j].theta = h_particle[i].theta + h_sample[j].tG;
       j++;
     }
   }
 
   threshold = WORST_POSSIBLE;
   j = 0;
-  while (path != NULL) {
+  for (step = 0; step < log->steps; step++) {
+    path = &(log->path[step]);
     HighInitializeFlags();
     keepers = 0;
     best = 0;
     worst = 0;
     for (i=0; i < H_SAMPLE_NUMBER; i++) {
-      if (sample[i].probability > threshold) {
+      if (h_sample[i].probability > threshold) {
 	keepers++;
 	// Move the particles one step
-	moveAngle = sample[i].theta + path->T/2.0;
-	sample[i].x = sample[i].x + (TURN_RADIUS * (cos(sample[i].theta + path->T) - cos(sample[i].theta))) +
+	moveAngle = h_sample[i].theta + path->T/2.0;
+	h_sample[i].x = h_sample[i].x + (TURN_RADIUS * (cos(h_sample[i].theta + path->T) - cos(h_sample[i].theta))) +
 	  (path->D * cos(moveAngle)) + (path->C * cos(moveAngle + M_PI/2));
-	sample[i].y = sample[i].y + (TURN_RADIUS * (sin(sample[i].theta + path->T) - sin(sample[i].theta))) +
+	h_sample[i].y = h_sample[i].y + (TURN_RADIUS * (sin(h_sample[i].theta + path->T) - sin(h_sample[i].theta))) +
 	  (path->D * sin(moveAngle)) + (path->C * sin(moveAngle + M_PI/2));
-	sample[i].theta = sample[i].theta + path->T;
+	h_sample[i].theta = h_sample[i].theta + path->T;
 	
 	// Score this step of the obs
-	sample[i].probability = sample[i].probability + 
-	                        LogScorePosition(sample[i].x, sample[i].y, sample[i].theta, 
-						 h_particle[ sample[i].parent ].ancestryNode->ID, obs->sense);
-	if (sample[i].probability > sample[best].probability)
+	h_sample[i].probability = h_sample[i].probability + 
+	                        LogScorePosition(h_sample[i].x, h_sample[i].y, h_sample[i].theta, 
+						 h_particle[ h_sample[i].parent ].ancestryNode->ID, log->sense[step+1]);
+	if (h_sample[i].probability > h_sample[best].probability)
 	  best = i;
       }
       // Cull bad ones
       else 
-	sample[i].probability = WORST_POSSIBLE;
+	h_sample[i].probability = WORST_POSSIBLE;
     }
 
-    fprintf(stderr, " ** %d  %.4f     %d\n", best, sample[best].probability, keepers);
-    threshold = sample[best].probability - H_THRESH;
+    fprintf(stderr, " ** %d  %.4f     %d\n", best, h_sample[best].probability, keepers);
+    threshold = h_sample[best].probability - H_THRESH;
     j++;
-
-    // Advance the path & observation
-    path = path->next;
-    obs = obs->next;
   }
 
   fprintf(stderr, "High level- Best of %d ", keepers);
 
   // Normalize
   total = 0.0;
-  threshold = sample[best].probability;
+  threshold = h_sample[best].probability;
   for (i=0; i < H_SAMPLE_NUMBER; i++) {
-    if (sample[i].probability == WORST_POSSIBLE)
-      sample[i].probability = 0.0;
+    if (h_sample[i].probability == WORST_POSSIBLE)
+      h_sample[i].probability = 0.0;
     else {
-      sample[i].probability = exp(sample[i].probability-threshold);
-      total = total + sample[i].probability;
+      h_sample[i].probability = exp(h_sample[i].probability-threshold);
+      total = total + h_sample[i].probability;
     }
   }
 
   for (i=0; i < H_SAMPLE_NUMBER; i++)
-    sample[i].probability = sample[i].probability/total;
+    h_sample[i].probability = h_sample[i].probability/total;
 
   // Count how many children each particle will get in next generation
-  for (i = 0; i < H_SAMPLE_NUMBER; i++) 
-    newchildren[i] = 0;
-
-  i = j = 0;  // i = no. of survivors, j = no. of new samples
-  while ((j < H_SAMPLE_NUMBER) && (i < H_PARTICLE_NUMBER)) {
-    k = 0;
-    ftemp = MTrandDec();
-    while (ftemp > sample[k].probability) {
-      ftemp = ftemp - sample[k].probability;
-      k++;
-    }
-    if (newchildren[k] == 0)
-      i++;
-    newchildren[k]++;
-    j++;
+  for (i = 0; i < H_SAMPLE_NUMBER; i++) {
+    h_newchildren[i] = 0;
+    highResampler.weight[i] = h_sample[i].probability;
   }
 
+  // j = no. of new samples, i = no. of survivors
+  OpenStream(&highResampler.stream, STREAM_HIGH_RESAMPLE, h_curGeneration, 0);
+  j = Resample(&highResampler, H_SAMPLE_NUMBER, H_SAMPLE_NUMBER, H_PARTICLE_NUMBER, h_newchildren);
+  i = 0;
+  for (k = 0; k < H_SAMPLE_NUMBER; k++)
+    if (h_newchildren[k] > 0)
+      i++;
+
   fprintf(stderr, "(%d kept ", i);
 
   // Now copy over new particles to savedParticles
   best = 0;
   k = 0; // pointer into saved particles
   for (i = 0; i < H_SAMPLE_NUMBER; i++)
-    if (newchildren[i] > 0) {
+    if (h_newchildren[i] > 0) {
       // We use the parent's x/y/t here because when we update the map, we want to go through 
       // each movement step again
-      h_savedParticle[k].x =      h_particle[ sample[i].parent ].x + sample[i].xG;
-      h_savedParticle[k].y =      h_particle[ sample[i].parent ].y + sample[i].yG;
-      h_savedParticle[k].theta =  h_particle[ sample[i].parent ].theta + sample[i].tG;
-      h_savedParticle[k].ancestryNode = h_particle[ sample[i].parent ].ancestryNode;
-      h_savedParticle[k].probability = sample[i].probability;
+      h_savedParticle[k].x =      h_particle[ h_sample[i].parent ].x + h_sample[i].xG;
+      h_savedParticle[k].y =      h_particle[ h_sample[i].parent ].y + h_sample[i].yG;
+      h_savedParticle[k].theta =  h_particle[ h_sample[i].parent ].theta + h_sample[i].tG;
+      h_savedParticle[k].ancestryNode = h_particle[ h_sample[i].parent ].ancestryNode;
+      h_savedParticle[k].probability = h_sample[i].probability;
       h_savedParticle[k].ancestryNode->numChildren++;
-      h_children[k] = newchildren[i];
+      h_children[k] = h_newchildren[i];
 
       if (h_savedParticle[k].probability > h_savedParticle[best].probability) 
 	best = k;
@@ -217,37 +227,24 @@ void HighLocalize(TPath *path, TSenseLog *obs)
     for (i=0; i < h_cur_saved_particles_used; i++)
       h_savedParticle[i].probability = h_savedParticle[i].probability/total;
 
-    total = 0.0;
     for (i = 0; i < h_cur_saved_particles_used; i++) 
-      total = total + h_savedParticle[i].probability;
-
-    while (j < H_SAMPLE_NUMBER) {
-      k = 0;
-      ftemp = MTrandDec()*total;
-      while (ftemp > (h_savedParticle[k].probability)) {
-	ftemp = ftemp - h_savedParticle[k].probability;
-	k++;
-      }
-      h_children[k]++;
-
-      j++;
-    }
+      highResampler.weight[i] = h_savedParticle[i].probability;
+    Resample(&highResampler, h_cur_saved_particles_used, H_SAMPLE_NUMBER - j, 0, h_children);
   }
 }
 
 
 
-void HighAddToWorldModel(TPath *sourcePath, TSenseLog *sourceObs, int maxID)
+void HighAddToWorldModel(TSegmentLog *log, int maxID)
 {
-  int i, ID;
+  int ID, step;
   double moveAngle;
   TPath *path;
-  TSenseLog *obs;
-
-  path = sourcePath;
-  obs = sourceObs->next;
+  TSenseSample *obs;
 
-  while (path != NULL) {
+  for (step = 0; step < log->steps; step++) {
+    path = &(log->path[step]);
+    obs = log->sense[step+1];
     HighInitializeFlags();
     for (ID=0; ID < maxID; ID++) {
       // Move the particle one step
@@ -257,27 +254,16 @@ void HighAddToWorldModel(TPath *sourcePath, TSenseLog *sourceObs, int maxID)
       h_particle[ID].y = h_particle[ID].y + (TURN_RADIUS * (sin(h_particle[ID].theta + path->T) - sin(h_particle[ID].theta))) +
 			 (path->D * sin(moveAngle)) + (path->C * sin(moveAngle + M_PI/2));
       h_particle[ID].theta = h_particle[ID].theta + path->T;
-
-      for (i=0; i < SENSE_NUMBER; i++) {
-	// normalize readings relative to the pose of current assumed position
-	HighAddTrace(h_particle[ID].x, h_particle[ID].y, obs->sense[i].distance, (obs->sense[i].theta + h_particle[ID].theta), 
-		     h_particle[ID].ancestryNode, (obs->sense[i].distance < MAX_SENSE_RANGE));
-      }
     }
 
-    path = path->next;
-    obs = obs->next;
+    // Then add what they all saw from there
+    HighInsertScans(obs, maxID);
   }
 
+  // Any observation past the end of the path is added from where the particles ended up.
   HighInitializeFlags();
-  if (obs != NULL) 
-    for (ID=0; ID < maxID; ID++) {
-      for (i=0; i < SENSE_NUMBER; i++) {
-	// normalize readings relative to the pose of current assumed position
-	HighAddTrace(h_particle[ID].x, h_particle[ID].y, obs->sense[i].distance, (obs->sense[i].theta + h_particle[ID].theta), 
-		     h_particle[ID].ancestryNode, (obs->sense[i].distance < MAX_SENSE_RANGE));
-      }
-    }
+  if (log->senses > log->steps+1)
+    HighInsertScans(log->sense[log->steps+1], maxID);
 }
 
 
@@ -293,212 +279,19 @@ void HighAddToWorldModel(TPath *sourcePath, TSenseLog *sourceObs, int maxID)
 //   d) add the particle's data to the map
 //   e) prune 'dead' ancestry
 //
-void HighUpdateAncestry(TPath *path, TSenseLog *obs)
+void HighUpdateAncestry(TSegmentLog *log)
 {
-  int i, j;
-  TAncestor *temp, *hold;
-  TEntryList *entry, *workArray;
-  TMapStarter *node;
-
-  // Go through the current particle array, and prune out all particles that did not spawn any particles. We know that the particle
-  // had to spawn samples, but those samples may not have become particles themselves, through not generating any samples for the 
-  // next generation. Recurse up through there.
-  for (i=0; i < h_cur_particles_used; i++) {
-    temp = h_particle[i].ancestryNode;
-
-    while (temp->numChildren == 0) {
-      // Free up memory
-      for (j=0; j < temp->total; j++)
-	HighDeleteObservation(temp->mapEntries[j].x, temp->mapEntries[j].y, temp->mapEntries[j].node);
-
-      free(temp->mapEntries);
-      temp->mapEntries = NULL;
-
-      // Recover the ID. 
-      h_cleanID++;
-      h_availableID[h_cleanID] = temp->ID;
-      temp->generation = h_curGeneration;
-      temp->ID = -42;
-
-      hold = temp;
-      temp = temp->parent;
-      hold->parent = NULL;
-
-      // Note the disappearance of this particle (may cause telescoping of particles, or outright deletion)
-      temp->numChildren--;
-    }
-  }
-
-  // Run through the particle IDs, checking for those that are in use. Of those, look at their parent.
-  // Should the parent have only one child, give all of the altered map squares of the parent to the child, 
-  // and dispose of the parent. 
-  for (i = 0; i < H_ID_NUMBER-1; i++) {
-    // These booleans mean (in order) the ID is in use, it has a parent (ie is not the root of the ancestry tree),
-    // and that its parent has only one child (this ID) 
-    if ((h_particleID[i].ID == i) && (h_particleID[i].parent != NULL) && (h_particleID[i].parent->numChildren == 1)) {
-      while (h_particleID[i].parent->generation == -111)
-	h_particleID[i].parent = h_particleID[i].parent->parent;
-
-      // We need to collapse one of the branches on our ancestry tree. 
-      // This entails moving all of the observed squares from the child up to the parent
-      temp = h_particleID[i].parent;
-
-      // We need to collapse one of the branches on our ancestry tree.
-      // This entails moving all of the observed squares from the child up to the parent
-
-      // Check to make sure that the parent's array is large enough to accomadate all of the entries of the child as well.
-      if (temp->size < (temp->total + h_particleID[i].total)) {
-	temp->size = (int)(ceil((temp->size + h_particleID[i].size)*1.75));
-	workArray = (TEntryList *)malloc(sizeof(TEntryList)*temp->size);
-	if (workArray == NULL) fprintf(stderr, "Malloc failed for workArray\n");
-
-
-	for (j=0; j < temp->total; j++) {
-	  workArray[j].x = temp->mapEntries[j].x;
-	  workArray[j].y = temp->mapEntries[j].y;
-	  workArray[j].node = temp->mapEntries[j].node;
-	}
-	// Note that temp->total hasn't changed- that will grow as the child's entries are added in
-	free(temp->mapEntries);
-	temp->mapEntries = workArray;
-      }
+  // Prune out the dead ancestry, and collapse branches with only one child (see level.h)
+  PruneAncestry<THighLevel>(h_curGeneration);
+  CollapseAncestry<THighLevel>();
 
-      // Change all map entries of the child to have the ID of the parent
-      // Also check to see if this entry supercedes an entry currently attributed to the parent.
-      // Since collapses can merge all of the entries between the parent and the current child into the parent, this check is performed 
-      // by comparing to see if the generation of the last observation (before the child's update) is at least as recent as parent's 
-      // generation. If so, note that there is another "dead" entry in the observation array. It will be cleaned up later. If this puts 
-      // the total number of used slot, minus the number of "dead", below the threshold, shrink the array (which cleans up the dead)
-      entry = h_particleID[i].mapEntries;
-      for (j=0; j < h_particleID[i].total; j++) {
-	// Change the ID
-	node = highMap[entry[j].x][entry[j].y];
-	node->array[entry[j].node].ID = temp->ID;
-	node->array[entry[j].node].source = temp->total;
-
-	temp->mapEntries[temp->total].x = entry[j].x;
-	temp->mapEntries[temp->total].y = entry[j].y;
-	temp->mapEntries[temp->total].node = entry[j].node;
-	temp->total++;
-
-	// Check for pre-existing observation in the parent's list
-	if (node->array[entry[j].node].parentGen >= temp->generation) {
-	  node->array[entry[j].node].parentGen = -1;
-	  node->dead++;
-	}
-      }
-
-      // We do this in a second pass for a good reason. If there are more than one update for a given grid square which uses the child's
-      // ID (as a consequence of an earlier collapse), then we want to make certain that the resizing doesn't take place until after all
-      // entries have changed their ID appropriately.
-      for (j=0; j < h_particleID[i].total; j++) {
-	node = highMap[entry[j].x][entry[j].y];
-	if ((int)((node->total - node->dead)*2.5) < node->size) 
-	  HighResizeArray(node, -7);
-      }
-
-      // We're done with it- remove the array of updates from the child.
-      free(entry);
-      h_particleID[i].mapEntries = NULL;
-
-      // Inherit the number of children
-      temp->numChildren = h_particleID[i].numChildren;
-
-      // Subtlety of the ancestry tree: since we only keep pointers up to the parent, we can't exactly change all of the
-      // descendents of the child to now point to the parent. What we can do, however, is mark the change for later, and
-      // update all of the ancestor particles in a single go, later. That will take a single O(P) pass
-      h_particleID[i].generation = -111;
-    }
-  }
-
-  // This is the step where we correct for redirections that arise from the collapse of a branch of the ancestry tree
-  for (i=0; i < H_ID_NUMBER-1; i++) 
-    if (h_particleID[i].ID == i) 
-      while (h_particleID[i].parent->generation == -111) 
-	h_particleID[i].parent = h_particleID[i].parent->parent;
-
-  // Wipe the slate clean, so that we don't get confused by the mechinations of the previous changes
-  // from deletes and merges. Updates can make thier own tables, as needed.
-  //
-  // When deleting, we could have a chain of two ancestors removed, such that the child relied on the 
-  // entry of the parent in the ObsArray. However, as it stands, only the parent would be able to change
-  // it's ObsArray entry to NULL. Then, when a new particle gets the ID of that dead child, we wouldn't 
-  // know when the ObsArray entry came from a valid observation, or from the phantom of the dead child
-  // -- We could get around this by realizing that the only way a child would ever look to a grid square, 
-  // -- and thus would have the entry filled in, at this point would be for that particle having updated 
-  // -- the square on a previous pass. That is, if the ObsArray entry points to a node with ID equal to 
-  // -- this particle's ID, we know its safe (because the phantom only could point to a parent). If the 
-  // -- node has any other ID, we could scrub it, and start as if it were NULL.
-  //
-  // -- So basically, the argument of above is able to extended into a general proof. Implement this later
-  //
-
-  j = 0;
   // Add the current savedParticles into the ancestry tree, and copy them over into the 'real' particle array
-  for (i = 0; i < h_cur_saved_particles_used; i++) {
-    while (h_savedParticle[i].ancestryNode->generation == -111) 
-      h_savedParticle[i].ancestryNode = h_savedParticle[i].ancestryNode->parent;
-
-    if (h_savedParticle[i].ancestryNode->numChildren == 1) {
-      h_savedParticle[i].ancestryNode->generation = h_curGeneration;
-      h_savedParticle[i].ancestryNode->numChildren = 0;
-      h_particle[j].ancestryNode = h_savedParticle[i].ancestryNode;
-
-      h_particle[j].x = h_savedParticle[i].x;
-      h_particle[j].y = h_savedParticle[i].y;
-      h_particle[j].theta = h_savedParticle[i].theta;
-      h_particle[j].probability = h_savedParticle[i].probability;
-      j++;
-    }
-    else if (h_savedParticle[i].ancestryNode->numChildren > 0) {
-      temp = &(h_particleID[ h_availableID[h_cleanID] ]);
-      temp->ID = h_availableID[h_cleanID];
-      h_cleanID--;
-
-      temp->parent = h_savedParticle[i].ancestryNode;
-      temp->mapEntries = NULL;
-      temp->total = 0;
-      temp->size = 0;
-      temp->generation = h_curGeneration;
-      temp->numChildren = 0;
-      temp->path = NULL;
-      temp->seen = 0;
-
-      if (h_cleanID < 0) {
-	fprintf(stderr, " !!! Insufficient Number of Particle IDs : Abandon Ship !!!\n");
-	h_cleanID = 0;
-      }
-
-      h_particle[i].ancestryNode = temp;
-      h_particle[j].x = h_savedParticle[i].x;
-      h_particle[j].y = h_savedParticle[i].y;
-      h_particle[j].theta = h_savedParticle[i].theta;
-      h_particle[j].probability = h_savedParticle[i].probability;
-      j++;
-    }
-  }
+  AddSavedParticles<THighLevel>(h_savedParticle, h_cur_saved_particles_used, h_curGeneration);
 
-  h_cur_particles_used = h_cur_saved_particles_used;
-
-  HighAddToWorldModel(path, obs, h_cur_particles_used);
+  HighAddToWorldModel(log, h_cur_particles_used);
 
   // Clean up the ancestry particles which disappeared in branch collapses. Also, recover their IDs.
-  for (i=0; i < H_ID_NUMBER-1; i++) 
-    if (h_particleID[i].generation == -111) {
-      h_particleID[i].generation = -1;
-      h_particleID[i].numChildren = 0;
-      h_particleID[i].parent = NULL;
-      h_particleID[i].mapEntries = NULL;
-      h_particleID[i].path = NULL;
-      h_particleID[i].seen = 0;
-      h_particleID[i].total = 0;
-      h_particleID[i].size = 0;
-
-      // Recover the ID. 
-      h_cleanID++;
-      h_availableID[h_cleanID] = i;
-      h_particleID[i].ID = -3;
-    }
+  RecoverCollapsed<THighLevel>();
 }
 
 
@@ -511,115 +304,105 @@ void HighUpdateAncestry(TPath *path, TSenseLog *obs)
 //
 void HighPrintMap(char *name, TAncestor *parent)
 {
-  FILE *printFile;
   int x, y;
-  int width, height;
-  int startx, starty, lastx, lasty;
-  char sysCall[128];
-  double hit;
-
-  width = H_MAP_WIDTH;
-  height = H_MAP_HEIGHT;
-
-  for(x=0; x < width; x++)
-    for(y=0; y < height; y++)
-      h_map[x][y] = 0;
-
-  lastx = 0;
-  lasty = 0;
-  startx = width-1;
-  starty = height-1;
-
-  for (x = 0; x < width; x++) {
-    for (y = 0; y < height; y++) {
-      hit = HighComputeProb(x, y, 1.4, parent->ID);
-      if (hit == UNKNOWN) 
-	h_map[x][y] = 255;
-      else {
-	h_map[x][y] = (int) (230 - (hit * 230));
-	if (x > lastx)
-	  lastx = x;
-	if (y > lasty)
-	  lasty = y;
-	if (x < startx)
-	  startx = x;
-	if (y < starty)
-	  starty = y;
-      }
-    }
-  }  
-
-  sprintf(sysCall, "%s.ppm", name);
-  printFile = fopen(sysCall, "w");
-  fprintf(printFile, "P6\n # particles.ppm \n %d %d\n",
-	  lastx-startx+1, lasty-starty+1);
-  fprintf(printFile, "255\n");
-
-  for (y = lasty; y >= starty; y--) 
-    for (x = startx; x <= lastx; x++) {
-      if (h_map[x][y] == 254) 
-	fprintf(printFile, "%c%c%c", 255, 0, 0);
-      else if (h_map[x][y] == 253) 
-	fprintf(printFile, "%c%c%c", 0, 255, 200);
-      else if (h_map[x][y] == 252) 
-	fprintf(printFile, "%c%c%c", 255, 55, 55);
-      else if (h_map[x][y] == 251) 
-	fprintf(printFile, "%c%c%c", 50, 150, 255);
+  unsigned char **shade;
+  unsigned char *image, *pixel;
+
+  HighRenderMap(parent, 1.4, &h_map);
+  shade = h_map.shade;
+
+  image = NewImage(h_map.width, h_map.height);
+  pixel = image;
+  for (y = h_map.height-1; y >= 0; y--) 
+    for (x = 0; x < h_map.width; x++, pixel += 3) {
+      if (shade[x][y] == 254) 
+	SetPixel(pixel, 255, 0, 0);
+      else if (shade[x][y] == 253) 
+	SetPixel(pixel, 0, 255, 200);
+      else if (shade[x][y] == 252) 
+	SetPixel(pixel, 255, 55, 55);
+      else if (shade[x][y] == 251) 
+	SetPixel(pixel, 50, 150, 255);
       else
-	fprintf(printFile, "%c%c%c", h_map[x][y], h_map[x][y], h_map[x][y]);
+	SetPixel(pixel, shade[x][y], shade[x][y], shade[x][y]);
     }
       
-  fclose(printFile);
-  sprintf(sysCall, "convert %s.ppm %s.png", name, name);
-  system(sysCall);
-  sprintf(sysCall, "chmod 666 %s.ppm", name);
-  system(sysCall);
-  sprintf(sysCall, "chmod 666 %s.png", name);
-  system(sysCall);
+  SaveImage(name, image, h_map.width, h_map.height);
   fprintf(stderr, "High map dumped to file\n");
 }
 
 
 
+//
+// Writes out the tiles of the map of the given particle which have changed since the last frame. When this
+// particle is descended from the one that the last frame was drawn from (or is the same one), its map can
+// only differ from that one where observations have been changed since then, which the map's own tiles
+// keep track of (see MarkGridChange in map.h). Otherwise, every tile is checked.
+//
+void HighExportTiles(TAncestor *parent, int frame)
+{
+  TGrid *grid = THighLevel::Map();
+  TAncestor *node;
+  int i, index, continued;
+
+  // The tiles are laid out over the whole grid, so that they stay put however the map grows.
+  if (h_tiles.directory == NULL)
+    InitTileExport(&h_tiles, (char *) TILE_DIRECTORY, GRID_LIMIT, GRID_LIMIT);
+
+  continued = 0;
+  for (node = parent; node != NULL; node = node->parent)
+    if (node->serial == h_tilesSerial)
+      continued = 1;
+
+  for (i = 0; i < grid->tiles; i++)
+    if (grid->touched[i]->changed) {
+      index = grid->touched[i]->index;
+      MarkTileChanged(&h_tiles, (index / GRID_TILES) << TILE_BITS, (index % GRID_TILES) << TILE_BITS);
+      grid->touched[i]->changed = 0;
+    }
+  if (!continued)
+    MarkAllTiles(&h_tiles);
+
+  HighRenderMap(parent, 1.4, &h_map);
+  i = ExportTiles(&h_tiles, h_map.shade, h_map.x, h_map.y, h_map.width, h_map.height, frame);
+  h_tilesSerial = parent->serial;
+  fprintf(stderr, "High map tiles dumped to file (%d changed)\n", i);
+}
+
+
+
 void InitHighSlam()
 {
   int i;
+  TAncestor *root;
+
+  HighAllocateMap();
+  h_availableID = (int *) malloc(H_ID_NUMBER * sizeof(int));
+  h_children = (int *) malloc(H_PARTICLE_NUMBER * sizeof(int));
+  h_savedParticle = (TParticle *) malloc(H_PARTICLE_NUMBER * sizeof(TParticle));
+  InitMapCanvas(&h_map, H_MAP_WIDTH, H_MAP_HEIGHT);
+  h_sample = (TSample *) malloc(H_SAMPLE_NUMBER * sizeof(TSample));
+  h_scatter = (double *) malloc(3 * H_SAMPLE_NUMBER * sizeof(double));
+  h_newchildren = (int *) malloc(H_SAMPLE_NUMBER * sizeof(int));
+  if ((h_availableID == NULL) || (h_children == NULL) || (h_savedParticle == NULL) ||
+      (h_sample == NULL) || (h_scatter == NULL) || (h_newchildren == NULL)) {
+    fprintf(stderr, "Unable to allocate the particles for the high level.\n");
+    exit(-1);
+  }
+  if (InitResampler(&highResampler, H_RESAMPLER, H_RESAMPLE_ESS, H_SAMPLE_NUMBER) < 0)
+    exit(-1);
 
   // Initialize the worldMap
   HighInitializeWorldMap();
 
   // Initialize the ancestry and particles
-  h_cleanID = H_ID_NUMBER - 2;    // ID_NUMBER-1 is being used as the root of the ancestry tree.
-
-  // Initialize all of our unused ancestor particles to look unused.
-  for (i = 0; i < H_ID_NUMBER; i++) {
-    h_availableID[i] = i;
-
-    h_particleID[i].total = 0;
-    h_particleID[i].size = 0;
-    h_particleID[i].generation = -1;;
-    h_particleID[i].numChildren = 0;
-    h_particleID[i].ID = -1;
-    h_particleID[i].parent = NULL;
-    h_particleID[i].mapEntries = NULL;
-    h_particleID[i].path = NULL;
-    h_particleID[i].seen = 0;
-  }
-
-  // Initialize the root of our ancestry tree.
-  h_particleID[H_ID_NUMBER-1].generation = 0;
-  h_particleID[H_ID_NUMBER-1].numChildren = 1;
-  h_particleID[H_ID_NUMBER-1].ID = H_ID_NUMBER-1;
-  h_particleID[H_ID_NUMBER-1].parent = NULL;
-  h_particleID[H_ID_NUMBER-1].mapEntries = NULL;
-  h_particleID[H_ID_NUMBER-1].size = 0;
-  h_particleID[H_ID_NUMBER-1].total = 0;
+  root = InitAncestry<THighLevel>();
 
   // Create all of our starting particles at the center of the map.
   for (i = 0; i < H_PARTICLE_NUMBER; i++) {
-    h_particle[i].ancestryNode = &(h_particleID[H_ID_NUMBER-1]);
-    h_particle[i].x = H_MAP_WIDTH / 2;
-    h_particle[i].y = (H_MAP_HEIGHT / 2) + 100;
+    h_particle[i].ancestryNode = root;
+    h_particle[i].x = GRID_START;
+    h_particle[i].y = GRID_START + 100;
     h_particle[i].theta = 0.001;
     h_particle[i].probability = 0;
     h_children[i] = 0;
@@ -645,7 +428,7 @@ void CloseHighSlam()
 
 
 
-void HighSlam(TPath *path, TSenseLog *obs)
+void HighSlam(TSegmentLog *log)
 {
   int i, j;
   char name[16];
@@ -653,18 +436,19 @@ void HighSlam(TPath *path, TSenseLog *obs)
   HighInitializeFlags();
 
   if (h_curGeneration == 0) {
-    HighAddToWorldModel(path, obs, 1);
+    HighAddToWorldModel(log, 1);
 
     sprintf(name, "hmap00");
-    HighPrintMap(name, h_particle[0].ancestryNode);
-    sprintf(name, "rm hmap00.ppm");
-    system(name);
+    if (TILED_MAPS)
+      HighExportTiles(h_particle[0].ancestryNode, 0);
+    else
+      HighPrintMap(name, h_particle[0].ancestryNode);
   }
   else {
     // Localize off of the path
-    HighLocalize(path, obs);
+    HighLocalize(log);
 
-    HighUpdateAncestry(path, obs);
+    HighUpdateAncestry(log);
 
     if ((H_VIDEO) && (h_curGeneration % H_VIDEO == 0)) {
       sprintf(name, "hmap%.2d", (int) (h_curGeneration/H_VIDEO));
@@ -673,9 +457,10 @@ void HighSlam(TPath *path, TSenseLog *obs)
 	if (h_particle[i].probability > h_particle[j].probability)
 	  j = i;
 
-      HighPrintMap(name, h_particle[j].ancestryNode);
-      sprintf(name, "rm hmap%.2d.ppm", (int) (h_curGeneration/H_VIDEO));
-      system(name);
+      if (TILED_MAPS)
+	HighExportTiles(h_particle[j].ancestryNode, (int) (h_curGeneration/H_VIDEO));
+      else
+	HighPrintMap(name, h_particle[j].ancestryNode);
     }
   }
 
@@ -18,6 +18,12 @@
 
 #include "highMap.h"
 
+// The directory that the tiles of the high level map go into, when it is written out in tiles.
+#define TILE_DIRECTORY "htiles"
+
+// Whether to write the high level map out in tiles, only rewriting those that change (see HighExportTiles in high.c).
+extern int TILED_MAPS;
+
 void InitHighSlam();
 void CloseHighSlam();
-void HighSlam(TPath *path, TSenseLog *obs);
+void HighSlam(TSegmentLog *log);
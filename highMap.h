@@ -14,29 +14,66 @@
 // Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
 //
 // Header file for mapping code
-// See lowMap.h for details (it is nearly identical)
+// The map for the high level of the hierarchy. See lowMap.h for details (it is nearly identical)
 //
 
 #include "low.h"
 
-extern PMapStarter highMap[H_MAP_WIDTH][H_MAP_HEIGHT];
+extern TGrid highMap;
+// The observation cache for highMap. See TObservationCache in map.h
+extern TObservationCache highCache;
+// The pool for the observations in highMap and the ancestors' lists of altered squares.
+extern TPool highPool;
+// Room for adding the scans to highMap by stripes. See TInsertion in map.h
+extern TInsertion highInsertion;
 
 // The nodes of the ancestry tree are stored here. Since each particle has a unique ID, we can quickly access the particles via their ID
 // in this array. See the structure TAncestor for more details.
-extern TAncestor h_particleID[H_ID_NUMBER];
+extern TAncestor *h_particleID;
+// The stack of unused IDs.
+extern int h_cleanID;
+extern int *h_availableID;
 
 // Our current set of particles being processed by the particle filter
-extern TParticle h_particle[H_PARTICLE_NUMBER];
+extern TParticle *h_particle;
 // We like to keep track of exactly how many particles we are currently using.
 extern int h_cur_particles_used;
 
 
+// The level type for the high level (see levelMap.h). The same as TLowLevel, except for its own map,
+// the larger variance of the laser, and that its ancestors don't keep the robot's path.
+struct THighLevel {
+  static constexpr double PRIOR = -1.0/(MAP_SCALE*8.0);
+  static constexpr double PRIOR_DIST = 4.0;
+  static constexpr double VARIANCE = HIGH_VARIANCE;
+  static constexpr double ENTRY_GROWTH = 1.75;
+  static const bool PATHS = false;
+
+  static TGrid *Map() { return &highMap; }
+  static TObservationCache *Cache() { return &highCache; }
+  static TPool *Pool() { return &highPool; }
+  static TInsertion *Insertion() { return &highInsertion; }
+  static TAncestor *Ancestors() { return h_particleID; }
+  static int &IDs() { return H_ID_NUMBER; }
+  static int *&AvailableID() { return h_availableID; }
+  static int &CleanID() { return h_cleanID; }
+  static TParticle *Particles() { return h_particle; }
+  static int &ParticlesUsed() { return h_cur_particles_used; }
+  static int ParticleNumber() { return H_PARTICLE_NUMBER; }
+};
+
+
+void HighAllocateMap();
 void HighInitializeFlags();
 void HighInitializeWorldMap();
 
 void HighResizeArray(TMapStarter *node, int deadID);
 void HighDeleteObservation(short int x, short int y, short int node);
 double HighComputeProb(int x, int y, double distance, int ID);
+// Draws the particle's map onto the canvas, which is fitted to the area that it has observed (see RenderMap in levelMap.h).
+void HighRenderMap(TAncestor *particle, double distance, TMapCanvas *canvas);
 
 void HighAddTrace(double startx, double starty, double MeasuredDist, double theta, TAncestor *parent,  int addEnd);
+// Adds the scan to the map from each of the first count particles (see InsertScans in levelMap.h).
+void HighInsertScans(TSense sense, int count);
 double HighLineTrace(double startx, double starty, double theta, double MeasuredDist, int parentID);
@@ -0,0 +1,758 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// image.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// The image writer thread, and the PNG and PPM encoders. See image.h for the interface.
+//
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "basic.h"
+#include "image.h"
+
+int IMAGE_FORMAT = IMAGE_PNG;
+
+// An image (or text, if image is NULL) waiting to be written out to the file name.
+struct TImageJob_struct {
+  char *name;
+  unsigned char *image;
+  char *text;
+  int width, height;
+  struct TImageJob_struct *next;
+};
+typedef struct TImageJob_struct TImageJob;
+
+// The queue of images for the writer thread, oldest first.
+static TImageJob *firstJob, *lastJob;
+static pthread_mutex_t imageLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t imageReady = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static int writerStarted, writerStopping;
+
+// A growing buffer of bytes, into which the PNG file is built before it is written out in one go.
+struct TByteBuffer_struct {
+  unsigned char *data;
+  int size, room;
+};
+typedef struct TByteBuffer_struct TByteBuffer;
+
+// Writes the bits of the deflate stream into a byte buffer, least significant bit first.
+struct TBitWriter_struct {
+  TByteBuffer *out;
+  unsigned int bits;
+  int count;
+};
+typedef struct TBitWriter_struct TBitWriter;
+
+// How far back the compression looks for a repeat of the upcoming bytes, and how many earlier places
+// with the same first three bytes it tries, at most. Deflate allows up to 32K back.
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_CHAIN 32
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
+// The base values and numbers of extra bits for the length codes (257 to 285) and the distance codes.
+static const int lengthBase[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59,
+				   67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const int lengthExtra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+				    4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const int distanceBase[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+				     1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const int distanceExtra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+				      9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+static unsigned int crcTable[256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+
+
+//
+// Makes certain that there is room for count more bytes in the buffer.
+//
+static void BufferRoom(TByteBuffer *buffer, int count)
+{
+  if (buffer->size + count <= buffer->room)
+    return;
+
+  buffer->room = 2*buffer->room + count + 1024;
+  buffer->data = (unsigned char *) realloc(buffer->data, buffer->room);
+  if (buffer->data == NULL) {
+    fprintf(stderr, "Unable to make room for encoding an image of %d bytes.\n", buffer->room);
+    exit(-1);
+  }
+}
+
+
+static void PutByte(TByteBuffer *buffer, int value)
+{
+  BufferRoom(buffer, 1);
+  buffer->data[buffer->size++] = (unsigned char) value;
+}
+
+
+// Four bytes, most significant first, as PNG wants all of its numbers.
+static void PutLong(TByteBuffer *buffer, unsigned int value)
+{
+  PutByte(buffer, value >> 24);
+  PutByte(buffer, value >> 16);
+  PutByte(buffer, value >> 8);
+  PutByte(buffer, value);
+}
+
+
+static void PutBits(TBitWriter *writer, unsigned int value, int count)
+{
+  writer->bits = writer->bits | (value << writer->count);
+  writer->count = writer->count + count;
+  while (writer->count >= 8) {
+    PutByte(writer->out, writer->bits & 0xFF);
+    writer->bits = writer->bits >> 8;
+    writer->count = writer->count - 8;
+  }
+}
+
+
+// Huffman codes are packed starting from their most significant bit, unlike everything else in deflate.
+static void PutCode(TBitWriter *writer, unsigned int code, int length)
+{
+  unsigned int reversed;
+  int i;
+
+  reversed = 0;
+  for (i = 0; i < length; i++)
+    reversed = (reversed << 1) | ((code >> i) & 1);
+  PutBits(writer, reversed, length);
+}
+
+
+//
+// Writes out a literal byte, or one of the length codes (257 and up, 256 being the end of the block),
+// using the fixed Huffman codes of deflate.
+//
+static void PutSymbol(TBitWriter *writer, int symbol)
+{
+  if (symbol < 144)
+    PutCode(writer, 0x30 + symbol, 8);
+  else if (symbol < 256)
+    PutCode(writer, 0x190 + (symbol - 144), 9);
+  else if (symbol < 280)
+    PutCode(writer, symbol - 256, 7);
+  else
+    PutCode(writer, 0xC0 + (symbol - 280), 8);
+}
+
+
+//
+// Writes out a repeat of the length bytes which came distance bytes earlier.
+//
+static void PutMatch(TBitWriter *writer, int length, int distance)
+{
+  int code;
+
+  code = 28;
+  while (lengthBase[code] > length)
+    code--;
+  PutSymbol(writer, 257 + code);
+  PutBits(writer, length - lengthBase[code], lengthExtra[code]);
+
+  code = 29;
+  while (distanceBase[code] > distance)
+    code--;
+  PutCode(writer, code, 5);
+  PutBits(writer, distance - distanceBase[code], distanceExtra[code]);
+}
+
+
+//
+// Compresses size bytes of data into a zlib stream at the end of out. This is a single deflate block
+// using the fixed Huffman codes, with each repeat found by a greedy search over recent places which
+// start with the same three bytes. That is far from the best that deflate can do, but the maps are mostly
+// long runs of the same few colors, which this catches easily, and it is quick.
+//
+static void Deflate(TByteBuffer *out, unsigned char *data, int size)
+{
+  TBitWriter writer;
+  int *head, *prev;
+  int i, j, k, hash, chain, length, bestLength, bestDistance, limit;
+  unsigned int a, b;
+
+  head = (int *) malloc((1 << DEFLATE_HASH_BITS) * sizeof(int));
+  prev = (int *) malloc(DEFLATE_WINDOW * sizeof(int));
+  if ((head == NULL) || (prev == NULL)) {
+    fprintf(stderr, "Unable to make room for compressing an image.\n");
+    exit(-1);
+  }
+  for (i = 0; i < (1 << DEFLATE_HASH_BITS); i++)
+    head[i] = -1;
+
+  // The zlib header: deflate with a 32K window, and no preset dictionary.
+  PutByte(out, 0x78);
+  PutByte(out, 0x01);
+
+  writer.out = out;
+  writer.bits = 0;
+  writer.count = 0;
+  // The one and only block, using the fixed codes.
+  PutBits(&writer, 1, 1);
+  PutBits(&writer, 1, 2);
+
+  i = 0;
+  while (i < size) {
+    bestLength = 0;
+    bestDistance = 0;
+    if (i + DEFLATE_MIN_MATCH <= size) {
+      limit = size - i;
+      if (limit > DEFLATE_MAX_MATCH)
+	limit = DEFLATE_MAX_MATCH;
+      hash = ((data[i] << 16) | (data[i+1] << 8) | data[i+2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+      for (j = head[hash], chain = 0; (j >= 0) && (i - j < DEFLATE_WINDOW) && (chain < DEFLATE_CHAIN); j = prev[j % DEFLATE_WINDOW], chain++) {
+	for (length = 0; (length < limit) && (data[j + length] == data[i + length]); length++)
+	  ;
+	if (length > bestLength) {
+	  bestLength = length;
+	  bestDistance = i - j;
+	  if (length == limit)
+	    break;
+	}
+      }
+    }
+
+    if (bestLength < DEFLATE_MIN_MATCH) {
+      PutSymbol(&writer, data[i]);
+      bestLength = 1;
+    }
+    else
+      PutMatch(&writer, bestLength, bestDistance);
+
+    // Every place that we pass over is remembered for later searches.
+    for (k = i; (k < i + bestLength) && (k + DEFLATE_MIN_MATCH <= size); k++) {
+      hash = ((data[k] << 16) | (data[k+1] << 8) | data[k+2]) * 2654435761u >> (32 - DEFLATE_HASH_BITS);
+      prev[k % DEFLATE_WINDOW] = head[hash];
+      head[hash] = k;
+    }
+    i = i + bestLength;
+  }
+
+  PutSymbol(&writer, 256);
+  if (writer.count > 0)
+    PutBits(&writer, 0, 8 - writer.count);
+
+  // The zlib trailer is the Adler-32 checksum of the uncompressed data.
+  a = 1;
+  b = 0;
+  for (i = 0; i < size; i++) {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  PutLong(out, (b << 16) | a);
+
+  free(head);
+  free(prev);
+}
+
+
+static void InitCRC()
+{
+  unsigned int c;
+  int n, k;
+
+  for (n = 0; n < 256; n++) {
+    c = (unsigned int) n;
+    for (k = 0; k < 8; k++)
+      c = (c & 1) ? (0xEDB88320u ^ (c >> 1)) : (c >> 1);
+    crcTable[n] = c;
+  }
+}
+
+
+//
+// Wraps the last length bytes of the buffer, which should be preceded by 8 bytes of room, into a
+// PNG chunk of the given type.
+//
+static void CloseChunk(TByteBuffer *png, const char *type, int start)
+{
+  unsigned int crc;
+  int i, length;
+
+  length = png->size - start - 8;
+  png->data[start] = length >> 24;
+  png->data[start+1] = length >> 16;
+  png->data[start+2] = length >> 8;
+  png->data[start+3] = length;
+  memcpy(png->data + start + 4, type, 4);
+
+  // The checksum covers the type and the data, but not the length.
+  crc = 0xFFFFFFFFu;
+  for (i = start + 4; i < png->size; i++)
+    crc = crcTable[(crc ^ png->data[i]) & 0xFF] ^ (crc >> 8);
+  PutLong(png, crc ^ 0xFFFFFFFFu);
+}
+
+
+static int OpenChunk(TByteBuffer *png)
+{
+  BufferRoom(png, 8);
+  png->size = png->size + 8;
+  return png->size - 8;
+}
+
+
+static inline int Paeth(int a, int b, int c)
+{
+  int p, pa, pb, pc;
+
+  p = a + b - c;
+  pa = abs(p - a);
+  pb = abs(p - b);
+  pc = abs(p - c);
+  if ((pa <= pb) && (pa <= pc))
+    return a;
+  if (pb <= pc)
+    return b;
+  return c;
+}
+
+
+//
+// Filters each row of the image in whichever of the five PNG ways leaves the smallest differences
+// (the usual rule of thumb for which will compress best), with the filter type in front of each row.
+//
+static unsigned char *FilterImage(unsigned char *image, int width, int height)
+{
+  unsigned char *filtered, *row, *up, *out;
+  unsigned char *candidate[5];
+  int x, y, f, stride, best, bestSum, sum, a, b, c;
+
+  stride = 3*width;
+  filtered = (unsigned char *) malloc(height * (stride + 1));
+  candidate[0] = (unsigned char *) malloc(5 * stride + 1);
+  if ((filtered == NULL) || (candidate[0] == NULL)) {
+    fprintf(stderr, "Unable to make room for filtering an image of %d by %d.\n", width, height);
+    exit(-1);
+  }
+  for (f = 1; f < 5; f++)
+    candidate[f] = candidate[0] + f*stride;
+
+  for (y = 0; y < height; y++) {
+    row = image + y*stride;
+    up = (y > 0) ? row - stride : NULL;
+    for (x = 0; x < stride; x++) {
+      a = (x >= 3) ? row[x-3] : 0;
+      b = (up != NULL) ? up[x] : 0;
+      c = ((x >= 3) && (up != NULL)) ? up[x-3] : 0;
+      candidate[0][x] = row[x];
+      candidate[1][x] = row[x] - a;
+      candidate[2][x] = row[x] - b;
+      candidate[3][x] = row[x] - ((a + b) >> 1);
+      candidate[4][x] = row[x] - Paeth(a, b, c);
+    }
+
+    best = 0;
+    bestSum = -1;
+    for (f = 0; f < 5; f++) {
+      sum = 0;
+      for (x = 0; x < stride; x++)
+	sum = sum + abs((signed char) candidate[f][x]);
+      if ((bestSum < 0) || (sum < bestSum)) {
+	bestSum = sum;
+	best = f;
+      }
+    }
+
+    out = filtered + y*(stride + 1);
+    out[0] = best;
+    memcpy(out + 1, candidate[best], stride);
+  }
+
+  free(candidate[0]);
+  return filtered;
+}
+
+
+int WritePNG(char *fileName, unsigned char *image, int width, int height)
+{
+  static const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  TByteBuffer png;
+  unsigned char *filtered;
+  FILE *file;
+  int i, start, written;
+
+  pthread_once(&crcOnce, InitCRC);
+  png.data = NULL;
+  png.size = 0;
+  png.room = 0;
+
+  for (i = 0; i < 8; i++)
+    PutByte(&png, signature[i]);
+
+  // The header: 8 bits for each of red, green and blue, and no interlacing.
+  start = OpenChunk(&png);
+  PutLong(&png, width);
+  PutLong(&png, height);
+  PutByte(&png, 8);
+  PutByte(&png, 2);
+  PutByte(&png, 0);
+  PutByte(&png, 0);
+  PutByte(&png, 0);
+  CloseChunk(&png, "IHDR", start);
+
+  filtered = FilterImage(image, width, height);
+  start = OpenChunk(&png);
+  Deflate(&png, filtered, height * (3*width + 1));
+  CloseChunk(&png, "IDAT", start);
+  free(filtered);
+
+  start = OpenChunk(&png);
+  CloseChunk(&png, "IEND", start);
+
+  file = fopen(fileName, "wb");
+  if (file == NULL) {
+    free(png.data);
+    return -1;
+  }
+  written = fwrite(png.data, 1, png.size, file);
+  free(png.data);
+  if ((fclose(file) != 0) || (written != png.size))
+    return -1;
+  chmod(fileName, 0666);
+  return 0;
+}
+
+
+int WritePPM(char *fileName, unsigned char *image, int width, int height)
+{
+  FILE *file;
+  int written;
+
+  file = fopen(fileName, "wb");
+  if (file == NULL)
+    return -1;
+  fprintf(file, "P6\n # particles.ppm \n %d %d\n", width, height);
+  fprintf(file, "255\n");
+  written = fwrite(image, 3, width*height, file);
+  if ((fclose(file) != 0) || (written != width*height))
+    return -1;
+  chmod(fileName, 0666);
+  return 0;
+}
+
+
+unsigned char *NewImage(int width, int height)
+{
+  unsigned char *image;
+
+  image = (unsigned char *) malloc(3 * width * height + 1);
+  if (image == NULL) {
+    fprintf(stderr, "Unable to make room for an image of %d by %d.\n", width, height);
+    exit(-1);
+  }
+  return image;
+}
+
+
+//
+// The writer thread. Takes the images off of the queue in the order that they were saved, until told
+// to stop and there are none left. Each file is written under a temporary name first, and then renamed,
+// so that anyone watching the files never sees one half written.
+//
+static void *ImageWriter(void *arg)
+{
+  TImageJob *job;
+  char *temporary;
+  FILE *file;
+  int result;
+
+  pthread_mutex_lock(&imageLock);
+  while (1) {
+    while ((firstJob == NULL) && !writerStopping)
+      pthread_cond_wait(&imageReady, &imageLock);
+    if (firstJob == NULL)
+      break;
+    job = firstJob;
+    firstJob = job->next;
+    if (firstJob == NULL)
+      lastJob = NULL;
+    pthread_mutex_unlock(&imageLock);
+
+    temporary = (char *) malloc(strlen(job->name) + 5);
+    if (temporary == NULL) {
+      fprintf(stderr, "Unable to write the map to %s.\n", job->name);
+      exit(-1);
+    }
+    sprintf(temporary, "%s.tmp", job->name);
+    if (job->image == NULL) {
+      result = -1;
+      file = fopen(temporary, "w");
+      if (file != NULL) {
+	result = (fputs(job->text, file) < 0) ? -1 : 0;
+	if (fclose(file) != 0)
+	  result = -1;
+      }
+    }
+    else if (IMAGE_FORMAT == IMAGE_PPM)
+      result = WritePPM(temporary, job->image, job->width, job->height);
+    else
+      result = WritePNG(temporary, job->image, job->width, job->height);
+    if ((result == -1) || (rename(temporary, job->name) != 0)) {
+      fprintf(stderr, "Unable to write the map to %s.\n", job->name);
+      remove(temporary);
+    }
+    free(temporary);
+    free(job->image);
+    free(job->text);
+    free(job->name);
+    free(job);
+
+    pthread_mutex_lock(&imageLock);
+  }
+  pthread_mutex_unlock(&imageLock);
+  return NULL;
+}
+
+
+//
+// Puts the job at the end of the queue, starting up the writer thread if it hasn't been yet.
+//
+static void QueueJob(TImageJob *job)
+{
+  pthread_mutex_lock(&imageLock);
+  if (!writerStarted) {
+    if (pthread_create(&writer, NULL, ImageWriter, NULL) != 0) {
+      fprintf(stderr, "Unable to start the image writer thread.\n");
+      exit(-1);
+    }
+    writerStarted = 1;
+  }
+  if (lastJob == NULL)
+    firstJob = job;
+  else
+    lastJob->next = job;
+  lastJob = job;
+  pthread_cond_signal(&imageReady);
+  pthread_mutex_unlock(&imageLock);
+}
+
+
+void SaveImage(char *name, unsigned char *image, int width, int height)
+{
+  TImageJob *job;
+
+  job = (TImageJob *) malloc(sizeof(TImageJob));
+  if (job != NULL)
+    job->name = (char *) malloc(strlen(name) + 5);
+  if ((job == NULL) || (job->name == NULL)) {
+    fprintf(stderr, "Unable to queue the map %s to be written.\n", name);
+    exit(-1);
+  }
+  sprintf(job->name, "%s.%s", name, (IMAGE_FORMAT == IMAGE_PPM) ? "ppm" : "png");
+  job->image = image;
+  job->text = NULL;
+  job->width = width;
+  job->height = height;
+  job->next = NULL;
+  QueueJob(job);
+}
+
+
+void SaveText(char *fileName, char *text)
+{
+  TImageJob *job;
+
+  job = (TImageJob *) malloc(sizeof(TImageJob));
+  if (job != NULL)
+    job->name = strdup(fileName);
+  if ((job == NULL) || (job->name == NULL)) {
+    fprintf(stderr, "Unable to queue %s to be written.\n", fileName);
+    exit(-1);
+  }
+  job->image = NULL;
+  job->text = text;
+  job->width = 0;
+  job->height = 0;
+  job->next = NULL;
+  QueueJob(job);
+}
+
+
+void CloseImages()
+{
+  pthread_mutex_lock(&imageLock);
+  if (!writerStarted) {
+    pthread_mutex_unlock(&imageLock);
+    return;
+  }
+  writerStopping = 1;
+  pthread_cond_signal(&imageReady);
+  pthread_mutex_unlock(&imageLock);
+
+  pthread_join(writer, NULL);
+  writerStarted = 0;
+  writerStopping = 0;
+}
+
+
+
+void InitTileExport(TTileExport *tiles, char *directory, int width, int height)
+{
+  int i;
+
+  if ((mkdir(directory, 0777) != 0) && (errno != EEXIST)) {
+    fprintf(stderr, "Unable to make the directory %s for the map tiles.\n", directory);
+    exit(-1);
+  }
+
+  tiles->directory = directory;
+  tiles->width = width;
+  tiles->height = height;
+  tiles->tilesWide = (width + EXPORT_TILE - 1) >> EXPORT_TILE_BITS;
+  tiles->tilesHigh = (height + EXPORT_TILE - 1) >> EXPORT_TILE_BITS;
+  tiles->shown = (unsigned char **) calloc(tiles->tilesWide * tiles->tilesHigh, sizeof(unsigned char *));
+  tiles->dirty = (char *) calloc(tiles->tilesWide * tiles->tilesHigh, sizeof(char));
+  tiles->written = (int *) malloc(tiles->tilesWide * tiles->tilesHigh * sizeof(int));
+  if ((tiles->shown == NULL) || (tiles->dirty == NULL) || (tiles->written == NULL)) {
+    fprintf(stderr, "Unable to allocate the tiles for a %d x %d map.\n", width, height);
+    exit(-1);
+  }
+  for (i = 0; i < tiles->tilesWide * tiles->tilesHigh; i++)
+    tiles->written[i] = -1;
+}
+
+
+void MarkTileChanged(TTileExport *tiles, int x, int y)
+{
+  if ((x < 0) || (y < 0) || (x >= tiles->width) || (y >= tiles->height))
+    return;
+  tiles->dirty[(x >> EXPORT_TILE_BITS)*tiles->tilesHigh + (y >> EXPORT_TILE_BITS)] = 1;
+}
+
+
+void MarkAllTiles(TTileExport *tiles)
+{
+  memset(tiles->dirty, 1, tiles->tilesWide * tiles->tilesHigh);
+}
+
+
+int ExportTiles(TTileExport *tiles, unsigned char **shade, int shadeX, int shadeY, int shadeWidth, int shadeHeight, int frame)
+{
+  unsigned char look[EXPORT_TILE*EXPORT_TILE], *image, *pixel, *shown;
+  char *manifest, name[256];
+  int tx, ty, t, i, x, y, startx, starty, width, height, low, high, count, listed, length;
+  int areaX, areaY, areaLastX, areaLastY;
+
+  count = 0;
+  for (tx = 0; tx < tiles->tilesWide; tx++)
+    for (ty = 0; ty < tiles->tilesHigh; ty++) {
+      t = tx*tiles->tilesHigh + ty;
+      if (!tiles->dirty[t])
+	continue;
+      tiles->dirty[t] = 0;
+
+      startx = tx << EXPORT_TILE_BITS;
+      starty = ty << EXPORT_TILE_BITS;
+      width = (startx + EXPORT_TILE <= tiles->width) ? EXPORT_TILE : tiles->width - startx;
+      height = (starty + EXPORT_TILE <= tiles->height) ? EXPORT_TILE : tiles->height - starty;
+      shown = tiles->shown[t];
+
+      // A tile which has never been written, and is off the part of the map that was drawn, is still unknown.
+      if ((shown == NULL) && ((startx + width <= shadeX) || (startx >= shadeX + shadeWidth) ||
+			      (starty + height <= shadeY) || (starty >= shadeY + shadeHeight)))
+	continue;
+
+      // How the tile looks now, column by column.
+      memset(look, 255, sizeof(look));
+      low = MAX(starty, shadeY);
+      high = MIN(starty + height, shadeY + shadeHeight);
+      if (low < high)
+	for (x = MAX(startx, shadeX); x < MIN(startx + width, shadeX + shadeWidth); x++)
+	  memcpy(look + (x - startx)*EXPORT_TILE + (low - starty), shade[x - shadeX] + (low - shadeY), high - low);
+
+      // A tile that was marked may well look the same as it did, if the changes were to the maps of 
+      // other particles.
+      if (shown == NULL) {
+	for (i = 0; (i < EXPORT_TILE*EXPORT_TILE) && (look[i] == 255); i++)
+	  ;
+	if (i == EXPORT_TILE*EXPORT_TILE)
+	  continue;
+	shown = (unsigned char *) malloc(EXPORT_TILE*EXPORT_TILE);
+	if (shown == NULL) {
+	  fprintf(stderr, "Unable to keep track of another map tile.\n");
+	  exit(-1);
+	}
+	tiles->shown[t] = shown;
+      }
+      else if (!memcmp(look, shown, EXPORT_TILE*EXPORT_TILE))
+	continue;
+      memcpy(shown, look, EXPORT_TILE*EXPORT_TILE);
+
+      image = NewImage(width, height);
+      pixel = image;
+      for (y = height - 1; y >= 0; y--)
+	for (x = 0; x < width; x++, pixel += 3)
+	  SetPixel(pixel, look[x*EXPORT_TILE + y], look[x*EXPORT_TILE + y], look[x*EXPORT_TILE + y]);
+
+      snprintf(name, sizeof(name), "%s/t%03d_%03d", tiles->directory, tx, ty);
+      SaveImage(name, image, width, height);
+      tiles->written[t] = frame;
+      count++;
+    }
+
+  // The manifest is written last, so that every tile that it lists is already there. The area that the
+  // tiles cover goes at the top, so the tiles are gone through once to find it.
+  listed = 0;
+  areaX = tiles->width;
+  areaY = tiles->height;
+  areaLastX = 0;
+  areaLastY = 0;
+  for (tx = 0; tx < tiles->tilesWide; tx++)
+    for (ty = 0; ty < tiles->tilesHigh; ty++)
+      if (tiles->written[tx*tiles->tilesHigh + ty] >= 0) {
+	listed++;
+	areaX = MIN(areaX, tx << EXPORT_TILE_BITS);
+	areaY = MIN(areaY, ty << EXPORT_TILE_BITS);
+	areaLastX = MAX(areaLastX, MIN((tx + 1) << EXPORT_TILE_BITS, tiles->width));
+	areaLastY = MAX(areaLastY, MIN((ty + 1) << EXPORT_TILE_BITS, tiles->height));
+      }
+  if (listed == 0)
+    areaX = areaY = 0;
+
+  manifest = (char *) malloc(256 + (size_t) listed * 64);
+  if (manifest == NULL) {
+    fprintf(stderr, "Unable to make room for the manifest of the map tiles.\n");
+    exit(-1);
+  }
+  length = sprintf(manifest, "# DP-SLAM map tiles\nframe %d\narea %d %d %d %d\ntile %d\n# x y width height frame file\n", 
+		   frame, areaX, areaY, areaLastX - areaX, areaLastY - areaY, EXPORT_TILE);
+  for (tx = 0; tx < tiles->tilesWide; tx++)
+    for (ty = 0; ty < tiles->tilesHigh; ty++) {
+      t = tx*tiles->tilesHigh + ty;
+      if (tiles->written[t] < 0)
+	continue;
+      startx = tx << EXPORT_TILE_BITS;
+      starty = ty << EXPORT_TILE_BITS;
+      width = (startx + EXPORT_TILE <= tiles->width) ? EXPORT_TILE : tiles->width - startx;
+      height = (starty + EXPORT_TILE <= tiles->height) ? EXPORT_TILE : tiles->height - starty;
+      length += sprintf(manifest + length, "%d %d %d %d %d t%03d_%03d.%s\n", startx, starty, width, height, 
+			tiles->written[t], tx, ty, (IMAGE_FORMAT == IMAGE_PPM) ? "ppm" : "png");
+    }
+  snprintf(name, sizeof(name), "%s/%s", tiles->directory, TILE_MANIFEST);
+  SaveText(name, manifest);
+  return count;
+}
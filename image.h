@@ -0,0 +1,91 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// image.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Writing out pictures of the maps. The maps are drawn by PrintMap (low.c) and HighPrintMap (high.c)
+// into an RGB buffer, which is then handed to SaveImage. A thread of its own encodes the buffer and
+// writes it to disk, so that SLAM never has to wait on the disk. The images are encoded right here
+// (PNG, or plain PPM), without calling out to any other program.
+//
+
+// The formats that the images can be written in. Either way, the file type is appended to the name.
+#define IMAGE_PNG 0
+#define IMAGE_PPM 1
+
+// The format to write all of the images in.
+extern int IMAGE_FORMAT;
+
+// Returns room for an image of the given size, 3 bytes (red, green, blue) for each pixel, row by row
+// from the top down.
+unsigned char *NewImage(int width, int height);
+// Queues the image to be written to name (plus the file type) by the writer thread, which is started
+// the first time this is called. The image is then owned by the writer, which frees it when done.
+void SaveImage(char *name, unsigned char *image, int width, int height);
+// Queues the text (which the writer then owns) to be written to the file, after everything queued before it.
+void SaveText(char *fileName, char *text);
+// Waits until every queued image has been written, and then stops the writer thread.
+void CloseImages();
+
+// Sets the pixel (3 bytes) to the given color.
+static inline void SetPixel(unsigned char *pixel, int red, int green, int blue)
+{
+  pixel[0] = (unsigned char) red;
+  pixel[1] = (unsigned char) green;
+  pixel[2] = (unsigned char) blue;
+}
+
+// Encode the image and write it out to the file, right away. Return -1 if it can't be written.
+int WritePNG(char *fileName, unsigned char *image, int width, int height);
+int WritePPM(char *fileName, unsigned char *image, int width, int height);
+
+
+// A map can also be written out in tiles, EXPORT_TILE grid squares on a side, each to a file of its own in
+// one directory (named tXXX_YYY after its position in tiles). The tiles are laid out over all of the area
+// that the map could ever cover, so they stay put as the map grows, but a tile is only ever written once
+// something has been seen in it. Each frame, only the tiles which look any different from when they were
+// last written are written again, so the cost of a frame follows the part of the map that has changed,
+// not the size of the map, and a viewer can load just the tiles it needs. Only the tiles which have been
+// marked since the last frame are checked (see MarkTileChanged).
+// After the tiles, a manifest (TILE_MANIFEST) is written into the directory. It gives the area that the
+// written tiles cover (x, y, width and height), and then lists every tile which has been written, as the
+// grid square at its lower left corner (x, y), its width and height, the frame that it was last written
+// in, and its file. Like the whole maps, each tile has the highest y at its top.
+#define EXPORT_TILE_BITS 8
+#define EXPORT_TILE (1 << EXPORT_TILE_BITS)
+#define TILE_MANIFEST "manifest.txt"
+
+struct TTileExport_struct {
+  char *directory;
+  // The size of the whole area that the map could cover, in grid squares and in tiles.
+  int width, height, tilesWide, tilesHigh;
+  // For each tile (tx*tilesHigh + ty), its grid squares (x*EXPORT_TILE + y) as of the last time that it was
+  // written, or NULL if it has never been written, which is the same as all unknown (255).
+  unsigned char **shown;
+  // For each tile (tx*tilesHigh + ty), whether it is to be checked at the next frame, and the frame it was
+  // last written in (-1 for never).
+  char *dirty;
+  int *written;
+};
+typedef struct TTileExport_struct TTileExport;
+
+// Sets up the tiles for a map of the given size, making the directory if need be.
+void InitTileExport(TTileExport *tiles, char *directory, int width, int height);
+// Marks the tile holding grid square x,y, or every tile, to be checked at the next frame.
+void MarkTileChanged(TTileExport *tiles, int x, int y);
+void MarkAllTiles(TTileExport *tiles);
+// Queues each of the marked tiles that look different from before to be written, followed by the manifest.
+// The map is given as shade (indexed [x][y], from 0 for black to 255 for white), which covers width x height
+// grid squares from x,y on. Everything outside of that is unknown. Returns how many tiles were queued.
+int ExportTiles(TTileExport *tiles, unsigned char **shade, int x, int y, int width, int height, int frame);
@@ -0,0 +1,514 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// level.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// The code for maintaining the ancestry tree, which is the same for both levels of the
+// hierarchy. Like levelMap.h, everything here is a template on the level type (TLowLevel or
+// THighLevel), and this is to be included after levelMap.h.
+//
+// UpdateAncestry in low.c and HighUpdateAncestry in high.c put these together, in order:
+// PruneAncestry, CollapseAncestry, InitializeFlags, AddSavedParticles (which ends with OrderLineage), then the new observations
+// are added to the map, and finally RecoverCollapsed. See UpdateAncestry in low.c for a full
+// description of each step.
+//
+
+
+//
+// Resets the ancestry tree to a single root node, with every other ID on the stack of unused IDs.
+// Returns the root.
+//
+template <class L> TAncestor *InitAncestry()
+{
+  TAncestor *particleID = L::Ancestors();
+  int i;
+
+  // ID_NUMBER-1 is being used as the root of the ancestry tree.
+  L::CleanID() = L::IDs() - 2;
+  // The root has no ancestors to fill in an entry of the observation cache from.
+  L::Cache()->lineages = 0;
+
+  // Initialize all of our unused ancestor particles to look unused.
+  for (i = 0; i < L::IDs(); i++) {
+    L::AvailableID()[i] = i;
+
+    particleID[i].generation = -1;
+    particleID[i].numChildren = 0;
+    particleID[i].ID = -1;
+    particleID[i].parent = NULL;
+    particleID[i].mapEntries = NULL;
+    particleID[i].path = NULL;
+    particleID[i].pathTail = NULL;
+    particleID[i].seen = 0;
+    particleID[i].serial = 0;
+    particleID[i].total = 0;
+    particleID[i].size = 0;
+  }
+
+  // Initialize the root of our ancestry tree.
+  particleID[L::IDs()-1].generation = 0;
+  particleID[L::IDs()-1].serial = NewAncestorSerial();
+  particleID[L::IDs()-1].numChildren = 1;
+  particleID[L::IDs()-1].ID = L::IDs()-1;
+  return &(particleID[L::IDs()-1]);
+}
+
+
+
+//
+// Called when the stack of unused IDs has run dry. Rather than giving up, the pool of IDs is made half again
+// as large, and the new IDs are put on the stack. The ancestor nodes for them are already there (room is made
+// for MAX_ID_NUMBER of them when the map is allocated), so nothing which points into the ancestry tree has to
+// change. The entries of the observation cache do need to be made wider, which can only be done while the
+// cache is empty.
+//
+template <class L> void GrowIDs()
+{
+  TAncestor *particleID = L::Ancestors();
+  int i, more;
+
+  more = MIN(MAX(L::IDs()/2, 1), MAX_ID_NUMBER - L::IDs());
+  // This can't happen with no more than MAX_PARTICLE_NUMBER particles (see map.h), which InitMapSizes checks.
+  if (more <= 0) {
+    fprintf(stderr, "Ran out of particle IDs: all %d are in use.\n", MAX_ID_NUMBER);
+    exit(-1);
+  }
+
+  L::AvailableID() = (int *) realloc(L::AvailableID(), (L::IDs() + more) * sizeof(int));
+  if (L::AvailableID() == NULL) {
+    fprintf(stderr, "Unable to grow the pool of particle IDs.\n");
+    exit(-1);
+  }
+
+  // The new IDs go on the stack so that the highest is handed out first, the same as at the start.
+  for (i = L::IDs(); i < L::IDs() + more; i++) {
+    particleID[i].generation = -1;
+    particleID[i].numChildren = 0;
+    particleID[i].ID = -1;
+    particleID[i].parent = NULL;
+    particleID[i].mapEntries = NULL;
+    particleID[i].path = NULL;
+    particleID[i].pathTail = NULL;
+    particleID[i].seen = 0;
+    particleID[i].serial = 0;
+    particleID[i].total = 0;
+    particleID[i].size = 0;
+
+    L::CleanID()++;
+    L::AvailableID()[L::CleanID()] = i;
+  }
+  L::IDs() = L::IDs() + more;
+
+  InitializeFlags<L>();
+  WidenObservationCache(L::Cache(), L::IDs());
+}
+
+
+
+//
+// Gives up the memory held by an ancestor node: its list of altered squares, along with the observations
+// themselves, and its part of the robot's path.
+//
+template <class L> void ClearAncestor(TAncestor *node)
+{
+  TPath *tempPath, *trashPath;
+  int j;
+
+  // Free up the memory in the map by deleting the associated observations.
+  for (j=0; j < node->total; j++)
+    DeleteObservation<L>(node->mapEntries[j].x, node->mapEntries[j].y, node->mapEntries[j].node);
+
+  PoolFree(L::Pool(), node->mapEntries, sizeof(TEntryList)*node->size);
+  node->mapEntries = NULL;
+
+  tempPath = node->path;
+  while (tempPath != NULL) {
+    trashPath = tempPath;
+    tempPath = tempPath->next;
+    PoolFree(L::Pool(), trashPath, sizeof(TPath));
+  }
+  node->path = NULL;
+  node->pathTail = NULL;
+}
+
+
+
+//
+// Remove Dead Nodes -
+// Go through the current particle array, and prune out all particles that did not spawn any particles. We know that the particle
+// had to spawn samples, but those samples may not have become particles themselves, through not generating any samples for the
+// next generation. Recurse up through there.
+//
+template <class L> void PruneAncestry(int generation)
+{
+  TAncestor *temp, *hold;
+  int i;
+
+  for (i=0; i < L::ParticlesUsed(); i++) {
+    temp = L::Particles()[i].ancestryNode;
+
+    // This is a "while" loop for purposes of recursing up the tree.
+    while (temp->numChildren == 0) {
+      ClearAncestor<L>(temp);
+
+      // Recover the ID, so that it can be used later.
+      L::CleanID()++;
+      L::AvailableID()[L::CleanID()] = temp->ID;
+      temp->generation = generation;
+      temp->ID = -42;
+
+      // Remove this node from the tree, while keeping track of its parent. We need that for recursing
+      // up the tree (its parent could possibly need to be removed itself, now)
+      hold = temp;
+      temp = temp->parent;
+      hold->parent = NULL;
+
+      // Note the disappearance of this particle (may cause telescoping of particles, or outright deletion)
+      temp->numChildren--;
+    }
+  }
+}
+
+
+
+//
+// Collapse Branches -
+// Run through the particle IDs, checking for those node IDs that are currently in use. Essentially is
+// an easy way to pass through the entire tree.  If the node is in use, look at its parent.
+// If the parent has only one child, give all of the altered map squares of the parent to the child,
+// and dispose of the parent. This collapses those ancestor nodes which have a branching factor of only one.
+//
+template <class L> void CollapseAncestry()
+{
+  TAncestor *particleID = L::Ancestors();
+  TAncestor *parentNode;
+  TEntryList *entry, *workArray;
+  TGridCell *cell;
+  TMapStarter *node;
+  int i, j, oldSize;
+
+  for (i = 0; i < L::IDs(); i++) {
+    // These booleans mean (in order) that the ID is in use, it has a parent (ie is not the root of the ancestry tree),
+    // and that its parent has only one child (which is necessarily this ID)
+    if ((particleID[i].ID == i) && (particleID[i].parent != NULL) && (particleID[i].parent->numChildren == 1)) {
+      // This is a special value for redirections. If the node's parent has already participated in a collapse
+      // during this generation, then that node has already been removed from the tree, and we need to go up
+      // one more step in the tree.
+      while (particleID[i].parent->generation == -111)
+	particleID[i].parent = particleID[i].parent->parent;
+
+      parentNode = particleID[i].parent;
+
+      // Check to make sure that the parent's array is large enough to accomadate all of the entries of the child
+      // in addition to its own. If not, we need to increase the dynamic array.
+      if (parentNode->size < (parentNode->total + particleID[i].total)) {
+	oldSize = parentNode->size;
+	parentNode->size = (int)(ceil((parentNode->size + particleID[i].size)*1.75));
+	workArray = (TEntryList *) PoolAlloc(L::Pool(), sizeof(TEntryList)*parentNode->size);
+
+	for (j=0; j < parentNode->total; j++) {
+	  workArray[j].x = parentNode->mapEntries[j].x;
+	  workArray[j].y = parentNode->mapEntries[j].y;
+	  workArray[j].node = parentNode->mapEntries[j].node;
+	}
+	// Note that parentNode->total hasn't changed- that will grow as the child's entries are added in
+	PoolFree(L::Pool(), parentNode->mapEntries, sizeof(TEntryList)*oldSize);
+	parentNode->mapEntries = workArray;
+      }
+
+      // Change all map entries of the parent to have the ID of the child
+      // Also check to see if this entry supercedes an entry currently attributed to the parent.
+      // Since collapses can merge all of the entries between the parent and the current child into the parent, this check is performed
+      // by comparing to see if the generation of the last observation (before the child's update) is at least as recent as parent's
+      // generation. If so, note that there is another "dead" entry in the observation array. It will be cleaned up later. If this puts
+      // the total number of used slot, minus the number of "dead", below the threshold, shrink the array (which cleans up the dead)
+      entry = particleID[i].mapEntries;
+      for (j=0; j < particleID[i].total; j++) {
+	cell = GridCell(L::Map(), entry[j].x, entry[j].y);
+	TakeOverObservation<L>(cell, entry[j].node, parentNode->ID);
+	MarkGridChange(L::Map(), entry[j].x, entry[j].y);
+	node = cell->node;
+
+	// Change the ID
+	MapIDs(node)[entry[j].node] = parentNode->ID;
+	node->array[entry[j].node].source = parentNode->total;
+
+	parentNode->mapEntries[parentNode->total].x = entry[j].x;
+	parentNode->mapEntries[parentNode->total].y = entry[j].y;
+	parentNode->mapEntries[parentNode->total].node = entry[j].node;
+	parentNode->total++;
+
+	// Check for pre-existing observation in the parent's list
+	if (node->array[entry[j].node].parentGen >= parentNode->generation) {
+	  node->array[entry[j].node].parentGen = -1;
+	  node->dead++;
+	  ForgetObservation<L>(cell);
+	}
+      }
+
+      // We do this in a second pass for a good reason. If there are more than one update for a given grid square which uses the child's
+      // ID (as a consequence of an earlier collapse), then we want to make certain that the resizing doesn't take place until after all
+      // entries have changed their ID appropriately.
+      for (j=0; j < particleID[i].total; j++) {
+	node = GridNode(L::Map(), entry[j].x, entry[j].y);
+	if ((node->total - node->dead)*2.5 < node->size)
+	  ResizeArray<L>(node, -7);
+      }
+
+      // We're done with it- remove the array of updates from the child.
+      PoolFree(L::Pool(), entry, sizeof(TEntryList)*particleID[i].size);
+      particleID[i].mapEntries = NULL;
+
+      // Inherit the path, by tacking the child's onto the end of the parent's
+      if (L::PATHS) {
+	parentNode->pathTail->next = particleID[i].path;
+	parentNode->pathTail = particleID[i].pathTail;
+	particleID[i].path = NULL;
+	particleID[i].pathTail = NULL;
+      }
+
+      // Inherit the number of children
+      parentNode->numChildren = particleID[i].numChildren;
+
+      // Subtlety of the ancestry tree: since we only keep pointers up to the parent, we can't exactly change all of the
+      // descendents of the child to now point to the parent. What we can do, however, is mark the change for later, and
+      // update all of the ancestor particles in a single go, later. That will take a single O(P) pass
+      particleID[i].generation = -111;
+    }
+  }
+
+  // This is the step where we correct for redirections that arise from the collapse of a branch of the ancestry tree
+  for (i=0; i < L::IDs(); i++)
+    if ((particleID[i].ID == i) && (particleID[i].parent != NULL)) {
+      while (particleID[i].parent->generation == -111)
+	particleID[i].parent = particleID[i].parent->parent;
+    }
+}
+
+
+
+//
+// Lists the ancestors of the current particles, each one after its parent (see TObservationCache in map.h), so
+// that BuildObservation can fill in an entry of the observation cache with one pass down the list, rather than
+// climbing the tree from every particle each time. The tree only changes in UpdateAncestry, so this is done
+// once per generation, when the new particles are added. Rather than clearing the seen marks of every ancestor,
+// a new value of lineageEpoch is used to mark those already listed.
+//
+template <class L> void OrderLineage()
+{
+  TObservationCache *cache = L::Cache();
+  TAncestor *lineage;
+  PAncestor stack[L::ParticleNumber()];
+  int i, topStack;
+
+  if (cache->lineageRoom < L::IDs()) {
+    cache->lineageRoom = L::IDs();
+    cache->lineageID = (short int *) realloc(cache->lineageID, cache->lineageRoom*sizeof(short int));
+    cache->lineageParent = (short int *) realloc(cache->lineageParent, cache->lineageRoom*sizeof(short int));
+    if ((cache->lineageID == NULL) || (cache->lineageParent == NULL)) {
+      fprintf(stderr, "Unable to list the ancestors for the observation cache.\n");
+      exit(-1);
+    }
+  }
+
+  cache->lineageEpoch++;
+  cache->lineages = 0;
+  for (i=0; i < L::ParticlesUsed(); i++) {
+    lineage = L::Particles()[i].ancestryNode;
+    topStack = 0;
+
+    // Eventually we will either get to an ancestor that we have already listed,
+    // or we will hit the top of the tree (and thus its parent is NULL)
+    while ((lineage != NULL) && (lineage->seen != cache->lineageEpoch)) {
+      stack[topStack] = lineage;
+      topStack++;
+      lineage->seen = cache->lineageEpoch;
+      lineage = lineage->parent;
+    }
+
+    // Now trapse back down the stack, so that the parents go on the list first. We never 
+    // have to list the root of the tree, because it has no parent.
+    while (topStack > 0) {
+      topStack--;
+      lineage = stack[topStack];
+      if (lineage->parent != NULL) {
+	cache->lineageID[cache->lineages] = lineage->ID;
+	cache->lineageParent[cache->lineages] = lineage->parent->ID;
+	cache->lineages++;
+      }
+    }
+  }
+}
+
+
+
+//
+// Add the saved particles (count of them, from this generation) into the ancestry tree, and copy them
+// over into the 'real' particle array. If the level keeps paths, each new ancestor node also gets the
+// step of the robot's path (C, D, T) which that particle represents.
+//
+template <class L> void AddSavedParticles(TParticle savedParticle[], int count, int generation)
+{
+  TAncestor *particleID = L::Ancestors();
+  TParticle *particle = L::Particles();
+  TAncestor *temp;
+  TPath *newPath;
+  int i, j;
+
+  j = 0;
+  for (i = 0; i < count; i++) {
+    // Check for redirection of parent pointers due to collapsing of branches (see above)
+    while (savedParticle[i].ancestryNode->generation == -111)
+      savedParticle[i].ancestryNode = savedParticle[i].ancestryNode->parent;
+
+    // A saved particle has ancestryNode denote the parent particle for that saved particle
+    // If that parent has only this one child, due to resampling, then we want to perform a collapse
+    // of the branch, but it hasn't been done yet, because the savedParticle hasn't been entered into
+    // the tree yet. Therefore, we just designate the parent as the "new" entry for this savedParticle.
+    // We then update the already created ancestry node as if it were the new node.
+    if (savedParticle[i].ancestryNode->numChildren == 1) {
+      // Change the generation of the node
+      savedParticle[i].ancestryNode->generation = generation;
+      // Now that it represents the new node as well, it no longer is considered to have children.
+      savedParticle[i].ancestryNode->numChildren = 0;
+      // We're copying the savedParticles to the main particle array
+      particle[j].ancestryNode = savedParticle[i].ancestryNode;
+
+      // Add a new entry to the path of the ancestor node.
+      if (L::PATHS) {
+	newPath = (TPath *) PoolAlloc(L::Pool(), sizeof(TPath));
+	newPath->C = savedParticle[i].C;
+	newPath->D = savedParticle[i].D;
+	newPath->T = savedParticle[i].T;
+	newPath->next = NULL;
+	particle[j].ancestryNode->pathTail->next = newPath;
+	particle[j].ancestryNode->pathTail = newPath;
+      }
+    }
+
+    // IF the parent has multiple children, then each child needs its own new ancestor node in the tree
+    else if (savedParticle[i].ancestryNode->numChildren > 0) {
+      // Find a new entry in the array of ancestor nodes. This is done by taking an unused ID off of the
+      // stack, and using that slot.
+      temp = &(particleID[ L::AvailableID()[L::CleanID()] ]);
+      temp->ID = L::AvailableID()[L::CleanID()];
+      // That ID on the top of the stack is now being used.
+      L::CleanID()--;
+
+      // If that was the last one, make some more.
+      if (L::CleanID() < 0)
+	GrowIDs<L>();
+
+      // This new node needs to have its info filled in
+      temp->parent = savedParticle[i].ancestryNode;
+      // No updates to the map have been made yet for this node
+      temp->mapEntries = NULL;
+      temp->total = 0;
+      temp->size = 0;
+      // The generation of this node is important for collapsing branches of the tree. See above.
+      temp->generation = generation;
+      temp->numChildren = 0;
+      temp->seen = 0;
+      temp->serial = NewAncestorSerial();
+      // A kept observation cache will need to know what this node sees (see RefreshObservations)
+      AddObservationBirth(L::Cache(), temp->ID, temp->parent->ID);
+
+      // This is where we add a new entry to this node's hypothesized path for the robot
+      temp->path = NULL;
+      temp->pathTail = NULL;
+      if (L::PATHS) {
+	newPath = (TPath *) PoolAlloc(L::Pool(), sizeof(TPath));
+	newPath->C = savedParticle[i].C;
+	newPath->D = savedParticle[i].D;
+	newPath->T = savedParticle[i].T;
+	newPath->next = NULL;
+	temp->path = newPath;
+	temp->pathTail = newPath;
+      }
+
+      // Transfer this entry over to the main particle array
+      particle[j].ancestryNode = temp;
+    }
+    else
+      continue;
+
+    particle[j].x = savedParticle[i].x;
+    particle[j].y = savedParticle[i].y;
+    particle[j].theta = savedParticle[i].theta;
+    particle[j].probability = savedParticle[i].probability;
+    j++;
+  }
+
+  L::ParticlesUsed() = count;
+  OrderLineage<L>();
+}
+
+
+
+//
+// Clean up the ancestry particles which disappeared in branch collapses. Also, recover their IDs.
+// This waits until after the new observations have been added, because until then we need to allow
+// for redirection of parents.
+//
+template <class L> void RecoverCollapsed()
+{
+  TAncestor *particleID = L::Ancestors();
+  int i;
+
+  for (i=0; i < L::IDs(); i++)
+    if (particleID[i].generation == -111) {
+      particleID[i].generation = -1;
+      particleID[i].numChildren = 0;
+      particleID[i].parent = NULL;
+      particleID[i].mapEntries = NULL;
+      particleID[i].path = NULL;
+      particleID[i].pathTail = NULL;
+      particleID[i].seen = 0;
+      particleID[i].total = 0;
+      particleID[i].size = 0;
+
+      // Recover the ID.
+      L::CleanID()++;
+      L::AvailableID()[L::CleanID()] = i;
+      particleID[i].ID = -3;
+    }
+}
+
+
+
+//
+// When the SLAM process is complete, this function will clean up the memory being used by the ancestry
+// tree. The map is about to be thrown out as well (see DestroyMap), so rather than removing each of the
+// associated entries from the map, the lists of altered squares and the paths are simply dropped. They
+// go back all at once with the level's pool.
+//
+template <class L> void DisposeAncestry()
+{
+  TAncestor *particleID = L::Ancestors();
+  int i;
+
+  for (i = 0; i < L::IDs(); i++)
+    if (particleID[i].ID == i) {
+      particleID[i].mapEntries = NULL;
+      particleID[i].total = 0;
+      particleID[i].size = 0;
+      particleID[i].path = NULL;
+      particleID[i].pathTail = NULL;
+      particleID[i].ID = -123;
+    }
+
+  for (L::CleanID()=0; L::CleanID() < L::IDs(); L::CleanID()++)
+    L::AvailableID()[L::CleanID()] = L::CleanID();
+  L::CleanID() = L::IDs();
+}
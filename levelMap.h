@@ -0,0 +1,1802 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// levelMap.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// The code for creating, querying and maintaining the maps. The low and high levels of the
+// hierarchy keep their maps in exactly the same way, so the code is written once here, as
+// templates on a level type (TLowLevel in lowMap.h, or THighLevel in highMap.h). The level type
+// holds the constants for that level, so that they are known when the code is compiled, and
+// gives access to the map, ancestry and observation cache that belong to that level:
+//
+//   PRIOR, PRIOR_DIST    The density of unobserved grid squares, and how much observation it is worth
+//   VARIANCE             The variance of the laser, for evaluating line traces
+//   ENTRY_GROWTH         How much to grow an ancestor's list of altered squares by when it fills up
+//   PATHS                Whether ancestors keep the part of the robot's path that they represent
+//   Map()                             The map (a sparse grid, see TGrid in map.h)
+//   Cache()                           The observation cache for the map
+//   Pool()                            Where the map's observations and the ancestors' entry lists come from
+//   Insertion()                       Room for adding scans to the map by stripes (see InsertScans)
+//   Ancestors(), IDs()                The ancestry nodes, indexed by ID, and the number of IDs in use
+//   AvailableID(), CleanID()          The stack of unused IDs, and the index of its top entry
+//   Particles(), ParticlesUsed(), ParticleNumber()    The current particles
+//
+// lowMap.c and highMap.c give the functions their usual names (LowResizeArray and HighResizeArray,
+// and so on). See level.h for the code which maintains the ancestry trees.
+//
+// This is to be included after map.h, threads.h, simd.h, rays.h and fastMath.h.
+//
+
+#include <stddef.h>
+#include <sched.h>
+#include <immintrin.h>
+
+// A special value for flagMap, marking a grid square whose entry in the observationArray
+// is in the middle of being built by another thread. See ClaimObservation.
+#define OBS_BUILDING -3
+
+// When the observationArray is built for localizing, a particle whose observation of the grid square
+// has no hits gets EMPTY_ENTRY of the observation's index, rather than the index itself, so that the
+// density can be seen to be 0 without looking at the observation (see BuildObservation and
+// PrepareObservations). These are all -3 or less, and EMPTY_INDEX turns one back into the index.
+#define EMPTY_ENTRY(i) (-3 - (i))
+#define EMPTY_INDEX(e) (-3 - (e))
+
+
+//
+// This process should be called at the start of each iteration of the slam process.
+// It clears the observation cache so that it can be reloaded with the local maps
+// for the new iteration.
+//
+template <class L> void InitializeFlags()
+{
+  TObservationCache *cache = L::Cache();
+  short int *pos;
+
+  // Each entry observationArray corresponds to a single grid square in the map. 
+  // observationID is a count of how many of these entries there are. For each
+  // one of these entries, ObservationPos gives its x,y coordinate in the map.
+  // The flagMap entry of each grid square gives a proper index into observationArray
+  // for that location. Therefore, we are resetting the flagMap entries of every grid 
+  // square which has an entry. Entry 0 is reserved, and doesn't have a grid square, and neither
+  // do entries which have been thrown out (see ForgetObservation).
+  TrimObservationCache(cache, cache->observationID);
+  while (cache->observationID > 1) {
+    cache->observationID--;
+    pos = ObservationPos(cache, cache->observationID);
+    if (pos[0] >= 0)
+      GridCell(L::Map(), pos[0], pos[1])->flag = 0;
+  }
+  cache->observationID = 1;
+  cache->births = 0;
+}
+
+
+//
+// Throws out the entry in the observationArray for a grid square whose observations have been
+// removed, moved around or taken over by another ancestor, since the entry can't follow those
+// changes. The entry stays where it is, but no longer belongs to any grid square, and the grid
+// square will get a new one the next time that it is looked at.
+//
+template <class L> inline void ForgetObservation(TGridCell *cell)
+{
+  if (cell->flag > 0)
+    ObservationPos(L::Cache(), cell->flag)[0] = -1;
+  cell->flag = 0;
+}
+
+
+//
+// The observation at index from in the grid square's array has been moved to index to, in order to
+// fill the hole left by a deleted observation. If the cache is being kept, the grid square's entry in
+// the observationArray is fixed to match, rather than thrown out.
+//
+template <class L> inline void MoveObservation(TGridCell *cell, int from, int to)
+{
+  short int *entry;
+  int i;
+
+  if ((!L::Cache()->keep) || (cell->flag <= 0))
+    return;
+  entry = ObservationEntry(L::Cache(), cell->flag);
+  for (i = 0; i < L::IDs(); i++)
+    if (entry[i] == from)
+      entry[i] = to;
+    else if (entry[i] == EMPTY_ENTRY(from))
+      entry[i] = EMPTY_ENTRY(to);
+}
+
+
+//
+// The grid square's array of observations has been resized, and moved tells where each of the total
+// old observations went (see ResizeArray). The entry in the observationArray is fixed to match. Only
+// dead ancestors could have been using an observation which was removed outright (or one past the
+// end of the array, left over from an earlier delete), and they no longer matter. An observation 
+// which was merged into another may have picked up some hits along the way.
+//
+template <class L> inline void RemapObservation(TGridCell *cell, short int moved[], int total)
+{
+  short int *entry;
+  int i, here;
+
+  entry = ObservationEntry(L::Cache(), cell->flag);
+  for (i = 0; i < L::IDs(); i++) {
+    if (entry[i] >= total)
+      entry[i] = -1;
+    else if (entry[i] >= 0)
+      entry[i] = moved[entry[i]];
+    else if (entry[i] < -2) {
+      here = (EMPTY_INDEX(entry[i]) < total) ? moved[EMPTY_INDEX(entry[i])] : -1;
+      if ((here >= 0) && (cell->node->array[here].hits == 0))
+	entry[i] = EMPTY_ENTRY(here);
+      else
+	entry[i] = here;
+    }
+  }
+}
+
+
+//
+// The observation at index here in the grid square's array is being taken over by the ancestor ID,
+// in a collapse. If ID doesn't have an observation of its own in the grid square, the entry in the 
+// observationArray only needs to point ID at this one. Otherwise, ID will have two observations here,
+// and the entry is thrown out, so that they can be sorted out the next time that it is built.
+//
+template <class L> inline void TakeOverObservation(TGridCell *cell, int here, int ID)
+{
+  short int *entry;
+  int mine;
+
+  if ((!L::Cache()->keep) || (cell->flag <= 0)) {
+    ForgetObservation<L>(cell);
+    return;
+  }
+  entry = ObservationEntry(L::Cache(), cell->flag);
+  mine = (entry[ID] < -2) ? EMPTY_INDEX(entry[ID]) : entry[ID];
+  if ((mine >= 0) && (MapIDs(cell->node)[mine] == ID))
+    ForgetObservation<L>(cell);
+  else
+    entry[ID] = here;
+}
+
+
+//
+// When the observation cache is kept from one generation to the next, this is called in place of
+// InitializeFlags, once the new particles have been added to the ancestry tree. Between generations,
+// the only changes that the entries can't follow on their own are these:
+// - Observations removed by pruning, or taken over by the parent in a collapse. The entries for those
+//   grid squares have already been fixed, or thrown out if that wasn't simple (see MoveObservation,
+//   RemapObservation, TakeOverObservation and ForgetObservation).
+// - New ancestors. They haven't made any observations yet, so they see what their parents see.
+// - Ancestors which died or were collapsed away. Nothing looks at their part of an entry any more,
+//   until the ID is given to a new ancestor.
+// So every entry that is left just needs the new ancestors to be copied over from their parents.
+// Entries for grid squares more than range away from all of the particles are thrown out instead,
+// since the robot has left them behind, and the entries which are kept are packed down to the front
+// of the cache, so that the cache only ever holds about one generation's worth of grid squares.
+// A grid square which is empty for everyone (-2) has no entry to patch, but still has its slot, which
+// is kept as well. Such a square may have been thrown out and built again since, leaving an older slot
+// that also points to it, so squares already seen here are marked (-4) to keep only the first slot.
+//
+template <class L> void RefreshObservations(int range)
+{
+  TObservationCache *cache = L::Cache();
+  TGridCell *cell;
+  short int *pos, *entry, *birth;
+  float minX, maxX, minY, maxY;
+  int i, j, kept;
+
+  minX = minY = GRID_LIMIT;
+  maxX = maxY = 0;
+  for (i = 0; i < L::ParticlesUsed(); i++) {
+    minX = MIN(minX, L::Particles()[i].x - range);
+    maxX = MAX(maxX, L::Particles()[i].x + range);
+    minY = MIN(minY, L::Particles()[i].y - range);
+    maxY = MAX(maxY, L::Particles()[i].y + range);
+  }
+
+  birth = cache->birth;
+  kept = 1;
+  for (i = 1; i < cache->observationID; i++) {
+    pos = ObservationPos(cache, i);
+    if (pos[0] < 0)
+      continue;
+    cell = GridCell(L::Map(), pos[0], pos[1]);
+    // Slots which no longer belong to their grid square are dropped.
+    if ((cell->flag != i) && (cell->flag != -2))
+      continue;
+    if ((pos[0] < minX) || (pos[0] > maxX) || (pos[1] < minY) || (pos[1] > maxY)) {
+      if (cell->flag == i)
+	ObservationPos(cache, i)[0] = -1;
+      cell->flag = 0;
+      continue;
+    }
+
+    // Move the slot down into place, bringing the new ancestors up to date along the way.
+    ObservationPos(cache, kept)[0] = pos[0];
+    ObservationPos(cache, kept)[1] = pos[1];
+    if (cell->flag == -2)
+      cell->flag = -4;
+    else {
+      entry = ObservationEntry(cache, kept);
+      if (kept != i)
+	memcpy(entry, ObservationEntry(cache, i), sizeof(short int)*L::IDs());
+      for (j = 0; j < cache->births; j++)
+	entry[birth[2*j]] = entry[birth[2*j+1]];
+      cell->flag = kept;
+    }
+    kept++;
+  }
+
+  // Put back the marks on the grid squares which are empty for everyone.
+  for (i = 1; i < kept; i++) {
+    pos = ObservationPos(cache, i);
+    cell = GridCell(L::Map(), pos[0], pos[1]);
+    if (cell->flag == -4)
+      cell->flag = -2;
+  }
+
+  TrimObservationCache(cache, cache->observationID);
+  cache->observationID = kept;
+  cache->births = 0;
+}
+
+
+//
+// Entries which were built (or patched) while the map was being updated don't have the marks
+// which make localizing faster (see BuildObservation). When the cache is kept, this puts them back
+// in before localizing: observations without hits are marked as such for the current particles, and
+// grid squares which are empty for all of the current particles are marked (-2) as empty for everyone.
+//
+template <class L> void PrepareObservations()
+{
+  TObservationCache *cache = L::Cache();
+  TGridCell *cell;
+  short int *pos, *entry;
+  int i, j, ID, empty;
+
+  for (i = 1; i < cache->observationID; i++) {
+    pos = ObservationPos(cache, i);
+    if (pos[0] < 0)
+      continue;
+    cell = GridCell(L::Map(), pos[0], pos[1]);
+    if (cell->flag != i)
+      continue;
+
+    entry = ObservationEntry(cache, i);
+    empty = 1;
+    for (j = 0; j < L::ParticlesUsed(); j++) {
+      ID = L::Particles()[j].ancestryNode->ID;
+      if (entry[ID] == -1)
+	empty = 0;
+      else if (entry[ID] >= 0) {
+	if (cell->node->array[entry[ID]].hits == 0)
+	  entry[ID] = EMPTY_ENTRY(entry[ID]);
+	else
+	  empty = 0;
+      }
+    }
+    if (empty)
+      cell->flag = -2;
+  }
+}
+
+
+//
+// Initializes the map and the observationArray.
+//
+template <class L> void InitializeWorldMap()
+{
+  // The map starts out without any tiles. A grid square in a tile which hasn't been made
+  // yet is unobserved, and has no entry in the observationArray.
+  ClearGrid(L::Map());
+
+  // observationArray[0] is reserved as a constant for "unused". We start the
+  // array at 1.
+  L::Cache()->observationID = 1;
+  L::Cache()->births = 0;
+}
+
+
+//
+// Frees up all of the memory being used by the map. Completely erases all info in
+// that map, making it ready for another slam implementation. In hierarchical slam,
+// this is called inbetween iterations of the high level slam, since each low level
+// process runs essentially independently of previous low level processes.
+// All of the observations, and the ancestors' lists of altered squares, go at once
+// with the level's pool, so the ancestry has to be done with first (see DisposeAncestry).
+//
+template <class L> void DestroyMap()
+{
+  ClearGrid(L::Map());
+  PoolReset(L::Pool());
+}
+
+
+
+
+//
+// The entry in an ancestor's list of altered grid squares that the source of one of its observations 
+// refers to. While scans are being added by stripes, a new observation is listed on its stripe instead 
+// (see TInsertion in map.h).
+//
+template <class L> inline TEntryList *MapEntry(int ID, int source)
+{
+  if (source < 0)
+    return &(L::Insertion()->entry[SOURCE_STRIPE(source)][SOURCE_INDEX(source)]);
+  return &(L::Ancestors()[ID].mapEntries[source]);
+}
+
+
+//
+// Each grid square contains a dynamic array of the observations made at that grid
+// square. Therefore, these arrays need to be resized occasionally. In the process
+// of resizing the array, we also clean up any redundant or obsolete "dead" entries.
+// If moved is given, it is filled in with the new index of each of the old entries
+// (or -1 for those of deadID), for fixing up the observation cache.
+//
+template <class L> void ResizeArray(TMapStarter *node, int deadID, short int moved[] = NULL)
+{
+  TAncestor *particleID = L::Ancestors();
+  short int i, j, ID, x, y;
+  short int hash[L::IDs()];
+  int source, last, oldSize;
+  TMapNode *temp;
+  short int *oldID, *tempID;
+
+  // This is a special flag that can be raised when calling ResizeArray, indicating
+  // that a specific ID is "dead". Currently this is only used when the ancestry tree
+  // is pruning off a dead branch, and the process of removing the corresponding
+  // observations leads to a reduction in the size of a dynamic array.
+  if (deadID >= 0)
+    node->dead++;
+
+  // Create a new array of the appropriate size.
+  // Don't count the dead entries in computing the new size
+  oldSize = node->size;
+  oldID = MapIDs(node);
+  node->size = (int)(ceil((node->total - node->dead)*1.75));
+  temp = (TMapNode *) PoolAlloc(L::Pool(), MapArraySize(node->size));
+  tempID = MapNodeIDs(temp, node->size);
+
+  // Initialize our hash table.
+  memset(hash, -1, L::IDs()*sizeof(short int));
+
+  j = 0;
+  // Run through each entry in our old array of observations.
+  for (i=0; i < node->total; i++) {
+    if (oldID[i] == deadID) {
+      // Denote that this has been removed already. Therefore, we won't try to remove it later.
+      // We don't bother actually removing the source, since the only way that we can have a deadID is if we are in
+      // the process of removing all updates that deadID has made.
+      particleID[deadID].mapEntries[node->array[i].source].node = -1;
+    }
+
+    // This observation is the first one of this ID entered into the new array. Just copy it over, and note its position.
+    else if (hash[oldID[i]] == -1) {
+      // Copy the information into the new array.
+      tempID[j] = oldID[i];
+      temp[j].source = node->array[i].source;
+      temp[j].parentGen = node->array[i].parentGen;
+      temp[j].hits = node->array[i].hits;
+      temp[j].distance = node->array[i].distance;
+      temp[j].density = node->array[i].density;
+
+      // This entry is moving- alter its source to track it
+      MapEntry<L>(tempID[j], temp[j].source)->node = j;
+
+      // Note that an observation with this ID has already been entered into the new array, and where that was entered.
+      hash[oldID[i]] = j;
+      j++;
+    }
+
+    // There is already an entry in the new array with the same ID, and this current observation is
+    // actually more recent (as indicated by having seen more distance of laser scans). This current
+    // observation will replace the older one.
+    else if (node->array[i].distance > temp[hash[oldID[i]]].distance) {
+      // We set a couple of values to shorter variable names, in order to reduce indirection and make
+      // reading the code easier.
+      ID = oldID[i];   // The ID of the observations in conflict.
+      source = temp[hash[ID]].source;  // The ancestor node corresponding to that ID
+
+      // Remove the source of the dead entry
+      particleID[ID].total--;
+      last = particleID[ID].total;
+      particleID[ID].mapEntries[source].x = particleID[ID].mapEntries[last].x;
+      particleID[ID].mapEntries[source].y = particleID[ID].mapEntries[last].y;
+      particleID[ID].mapEntries[source].node = particleID[ID].mapEntries[last].node;
+
+      // The last source entry was moved into this newly vacated position. Make sure that the
+      // observation it links to notes the new source position.
+      x = particleID[ID].mapEntries[source].x;
+      y = particleID[ID].mapEntries[source].y;
+
+      if ((GridNode(L::Map(), x, y) == node) && (particleID[ID].mapEntries[source].node < i))
+	temp[hash[ID]].source = source;
+      else
+	GridNode(L::Map(), x, y)->array[ particleID[ID].mapEntries[source].node ].source = source;
+
+      // Copy the more recent information into the slot previously held by the dead entry
+      temp[hash[ID]].source = node->array[i].source;
+      temp[hash[ID]].hits = node->array[i].hits;
+      temp[hash[ID]].distance = node->array[i].distance;
+      temp[hash[ID]].density = node->array[i].density;
+      // We do not copy over the parentGen- we are inheriting it from the dead entry, since it was the predecessor
+      // The ID does not need to be copied, since it was necessarily the same for both observations.
+
+      // This entry is moving- alter its source to track it
+      MapEntry<L>(ID, node->array[i].source)->node = hash[ID];
+    }
+
+    // There was already an entry for this ID. This new entry is an older form of the observation already recorded. Therefore,
+    // the new entry is dead, and should not be copied over, and it's source in the ancestry tree should be removed.
+    else {
+      // The new entry is an older form of the one already entered. We should inherit the new parentGen
+      if (node->array[i].parentGen != -1)
+	temp[hash[oldID[i]]].parentGen = node->array[i].parentGen;
+
+      ID = oldID[i];
+      source = node->array[i].source;
+
+      // Remove the source of the dead entry
+      particleID[ID].total--;
+      last = particleID[ID].total;
+
+      if (last != source) {
+	particleID[ID].mapEntries[source].x = particleID[ID].mapEntries[last].x;
+	particleID[ID].mapEntries[source].y = particleID[ID].mapEntries[last].y;
+	particleID[ID].mapEntries[source].node = particleID[ID].mapEntries[last].node;
+
+	// A source entry was moved. Make sure that the observation it links to notes the new source position.
+	x = particleID[ID].mapEntries[source].x;
+	y = particleID[ID].mapEntries[source].y;
+
+	if ((GridNode(L::Map(), x, y) == node) && (particleID[ID].mapEntries[source].node <= i))
+	  temp[hash[ID]].source = source;
+	else
+	  GridNode(L::Map(), x, y)->array[ particleID[ID].mapEntries[source].node ].source = source;
+      }
+    }
+
+
+    // Unless it was removed, this observation now lives on as the one for its ID.
+    if (moved)
+      moved[i] = (oldID[i] == deadID) ? -1 : hash[oldID[i]];
+  }
+
+  // Note the new total, which should be the previous size minus the dead.
+  node->total = j;
+  // After completing this process, we have removed all dead entries.
+  node->dead = 0;
+  PoolFree(L::Pool(), node->array, MapArraySize(oldSize));
+  node->array = temp;
+}
+
+
+//
+// When we add a new entry to workingArray, there is a chance that we will run into a dead entry.
+// If so, we will need to delete the dead entry, by copying the last entry in the array onto its
+// location. We then need to recursively add the entry (that we just copied onto that spot) to
+// the workingArray
+//
+template <class L> void AddToWorkingArray(int i, TMapStarter *node, short int workingArray[])
+{
+  TAncestor *particleID = L::Ancestors();
+  int j, source, last;
+  TEntryList *entries;
+
+  // Keep an eye out for dead entries. They will be made apparent when two entries both have the same ID.
+  if (workingArray[MapIDs(node)[i]] == -1)
+    workingArray[MapIDs(node)[i]] = i;
+
+  else {
+    // The node we are currently looking at is the dead one.
+    if (node->array[i].distance < node->array[ workingArray[MapIDs(node)[i]] ].distance) {
+      // Otherwise, remove the source, then remove the entry. Follow with a recursive call.
+      j = i;
+      if (node->array[i].parentGen >= 0)
+	node->array[ workingArray[MapIDs(node)[i]] ].parentGen = node->array[i].parentGen;
+    }
+
+    // The previously entered entry is outdated. Replace it with this newer one.
+    else {
+      j = workingArray[MapIDs(node)[i]];
+      workingArray[MapIDs(node)[i]] = i;
+      if (node->array[j].parentGen >= 0)
+	node->array[i].parentGen = node->array[j].parentGen;
+    }
+
+    // The node identified as "j" is dead. Remove its entry from the list of altered squares in the ancestor tree.
+    particleID[MapIDs(node)[j]].total--;
+
+    entries = particleID[MapIDs(node)[j]].mapEntries;
+    source = node->array[j].source;
+    last = particleID[MapIDs(node)[j]].total;
+
+    if (last != source) {
+      entries[source].x = entries[last].x;
+      entries[source].y = entries[last].y;
+      entries[source].node = entries[last].node;
+
+      // Somewhat confusing- we just removed an entry from the list of altered squares maintained by an ancestor particle (entries)
+      // This means moving an entry from the end of that list to the spot which was vacated (entries[particleID[ID].total], for the ID of node j)
+      // Therefore, the entry in the map corresponding to that last entry needs to point to the new entry.
+      GridNode(L::Map(), entries[source].x, entries[source].y)->array[ entries[source].node ].source = source;
+    }
+
+    // Now remove the node itself
+    node->total--;
+    node->dead--;
+
+    if (j != node->total) {
+      node->array[j].parentGen = node->array[node->total].parentGen;
+      node->array[j].distance = node->array[node->total].distance;
+      node->array[j].source = node->array[node->total].source;
+      node->array[j].hits = node->array[node->total].hits;
+      node->array[j].density = node->array[node->total].density;
+      MapIDs(node)[j] = MapIDs(node)[node->total];
+      // We just moved the last entry in the list to position j. Update it's source entry in the ancestry tree to reflect its new position
+      particleID[ MapIDs(node)[j] ].mapEntries[ node->array[j].source ].node = j;
+
+      // If the entry we just moved was in workingArray, we need to correct workingArray.
+      // Also, we know that since it has been entered already, we don't need to enter it again
+      if (workingArray[MapIDs(node)[j]] == node->total)
+	workingArray[MapIDs(node)[j]] = j;
+      else if (i != node->total)
+	// Final step- add this newly copied node to the working array (we don't want it skipped over)
+	AddToWorkingArray<L>(j, node, workingArray);
+    }
+
+  }
+}
+
+
+//
+// This function is called whenever a grid square in the map (which has at least one
+// observation associated with it) is accessed for the first time in an iteration. This
+// function then creates an entry in the observationArray for this location.  This
+// effectively expands the local map by one grid square, and allows any future accesses to
+// this grid square to be completed in constant time. This function itself can take O(P) time.
+// When localizing with several threads, only the thread which claimed the grid square (see
+// ClaimObservation) will be building it, and flagMap is only set once the entry is complete.
+//
+template <class L> void BuildObservation(TGridCell *cell, int x, int y, char usage)
+{
+  TObservationCache *cache = L::Cache();
+  PMapStarter node = cell->node;
+  short int workingArray[L::IDs()+1];
+  short int ID;
+  int i, here;
+  char flag = 0;
+
+  // Initialize the ancestor particles.
+  memset(workingArray, -1, L::IDs()*sizeof(short int));
+
+  // Fill in the particle entries of the array that made direct observations
+  // to this grid square. If there are dead entries here, cleaning them up will alter the
+  // ancestry nodes, so we need exclusive access for that.
+  if (node->dead > 0) {
+    pthread_mutex_lock(&(cache->deadLock));
+    for (i=0; i < node->total; i++)
+      AddToWorkingArray<L>(i, node, workingArray);
+    pthread_mutex_unlock(&(cache->deadLock));
+  }
+  else
+    for (i=0; i < node->total; i++)
+      AddToWorkingArray<L>(i, node, workingArray);
+
+  // A trick to speed up code when localizing. If an observation has no hits,
+  // then it has a 0% chance of stopping the laser, regardless of any other
+  // info. Marking that specially will remove an extra memory call, which
+  // would almost certainly be a cache miss. Also, if all entries are "empty",
+  // then maybe we can skip the whole access to the observationArray entirely.
+  // The index of the empty observation is still kept (see EMPTY_ENTRY), since a kept cache may
+  // later be used to update the map.
+  if (usage) {
+    flag = 1;
+    for (i=0; i < node->total; i++)
+      if (node->array[i].hits > 0)
+	flag = 0;
+      else
+	workingArray[MapIDs(node)[i]] = EMPTY_ENTRY(i);
+  }
+
+  // Fill in the holes in the observation array, by using the value of their parents. The ancestors
+  // of the current particles are listed so that each one comes after its parent (see OrderLineage in
+  // level.h), so this only takes one pass. If the parent is also UNKNOWN, we know by construction 
+  // that all of the other ancestors are also UNKNOWN, and thus the designation is correct.
+  for (i=0; i < cache->lineages; i++) {
+    ID = cache->lineageID[i];
+    if (workingArray[ID] == -1) {
+      workingArray[ID] = workingArray[ cache->lineageParent[i] ];
+      // If any particle still has an "unobserved" value for this square, we can't use our cheat to
+      // speed up code.
+      if (workingArray[ID] == -1)
+	flag = 0;
+    }
+  }
+
+  // Grab a slot in the observationArray. Even a grid square which turns out to be empty for
+  // everyone needs one, so that its flag can be found and reset later (see InitializeFlags).
+  here = __atomic_fetch_add(&(cache->observationID), 1, __ATOMIC_RELAXED);
+
+  // The observationArray is not large enough- make some more room.
+  if (here >= __atomic_load_n(&(cache->area), __ATOMIC_ACQUIRE))
+    GrowObservationCache(cache, here);
+  ObservationPos(cache, here)[0] = x;
+  ObservationPos(cache, here)[1] = y;
+
+  // If we are only localizing right now (usage) and all particles agree that this grid square
+  // is empty (flag), then any access to this grid square doesn't even have to go as far as the
+  // observation array- a glance at the flagMap can indicate that the desity is 0, regardless of
+  // which particle is making the access.
+  if ((usage) && (flag))
+    __atomic_store_n(&(cell->flag), -2, __ATOMIC_RELEASE);
+  else {
+    for (i=0; i < L::IDs(); i++)
+      ObservationEntry(cache, here)[i] = workingArray[i];
+    // Only now that the entry is complete can other threads be allowed to see it.
+    __atomic_store_n(&(cell->flag), here, __ATOMIC_RELEASE);
+  }
+}
+
+
+
+//
+// Returns the flagMap value for a grid square which has observations, building the entry
+// in the observationArray first if this is the first access this iteration. Several threads
+// may be scoring samples at once, so the first one to reach an unbuilt grid square claims
+// it, and any others wait for it to finish rather than building it a second time.
+//
+template <class L> inline int ClaimObservation(TGridCell *cell, int x, int y)
+{
+  int flag;
+
+  flag = __atomic_load_n(&(cell->flag), __ATOMIC_ACQUIRE);
+  if (flag == 0) {
+    if (__atomic_compare_exchange_n(&(cell->flag), &flag, OBS_BUILDING, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+      BuildObservation<L>(cell, x, y, 1);
+      return cell->flag;
+    }
+  }
+
+  while (flag == OBS_BUILDING) {
+    sched_yield();
+    flag = __atomic_load_n(&(cell->flag), __ATOMIC_ACQUIRE);
+  }
+  return flag;
+}
+
+
+
+
+//
+// Makes sure that the ancestor's list of altered grid squares has room for needed entries, growing
+// it by ENTRY_GROWTH at a time.
+//
+template <class L> void GrowMapEntries(TAncestor *node, int needed)
+{
+  TEntryList *tempEntry;
+  int i, oldSize;
+
+  if (node->size >= needed)
+    return;
+  oldSize = node->size;
+  if (node->size == 0)
+    node->size = 1;
+  while (node->size < needed)
+    node->size = (int)(ceil(node->size*L::ENTRY_GROWTH));
+
+  tempEntry = (TEntryList *) PoolAlloc(L::Pool(), sizeof(TEntryList)*node->size);
+  for (i=0; i < node->total; i++) {
+    tempEntry[i].x = node->mapEntries[i].x;
+    tempEntry[i].y = node->mapEntries[i].y;
+    tempEntry[i].node = node->mapEntries[i].node;
+  }
+  PoolFree(L::Pool(), node->mapEntries, sizeof(TEntryList)*oldSize);
+  node->mapEntries = tempEntry;
+}
+
+
+//
+// Lists a new observation, at index node of grid square x,y, on the stripe's list of the observations 
+// that it has added (see TInsertion in map.h). Returns the source that the observation should have.
+//
+template <class L> inline int StripeEntry(int stripe, int x, int y, int node)
+{
+  TInsertion *insertion = L::Insertion();
+  int here;
+
+  here = insertion->entries[stripe];
+  if (here >= insertion->entryRoom[stripe]) {
+    insertion->entryRoom[stripe] = MAX(1024, 2*insertion->entryRoom[stripe]);
+    insertion->entry[stripe] = (TEntryList *) realloc(insertion->entry[stripe], 
+						       insertion->entryRoom[stripe] * sizeof(TEntryList));
+    if (insertion->entry[stripe] == NULL) {
+      fprintf(stderr, "Unable to make room for the new observations of a stripe.\n");
+      exit(-1);
+    }
+  }
+  insertion->entry[stripe][here].x = x;
+  insertion->entry[stripe][here].y = y;
+  insertion->entry[stripe][here].node = node;
+  insertion->entries[stripe]++;
+  return STRIPE_SOURCE(stripe, here);
+}
+
+
+//
+// Finds the appropriate entry in the designated grid square, and then makes a duplicate of that entry
+// modified according to the input.
+// When the scans are being added by stripes (see InsertScans), stripe is the stripe that the grid square 
+// belongs to, and a new observation is listed on the stripe, rather than on the ancestor. Otherwise, it is -1.
+// Returns the particle's observation of the grid square, now that it has one of its own, or NULL if the
+// grid square is off of the map.
+//
+template <class L> TMapNode *UpdateGridSquare(int x, int y, double distance, int hit, int parentID, int stripe = -1)
+{
+  TObservationCache *cache = L::Cache();
+  TAncestor *particleID = L::Ancestors();
+  TGridCell *cell;
+  PMapStarter *square;
+  int here, i;
+
+  // Find the grid square, making room for it in the map if need be. A grid square which
+  // the map can't hold is ignored.
+  cell = TouchGridCell(L::Map(), x, y);
+  if (cell == NULL)
+    return NULL;
+  square = &(cell->node);
+  MarkGridChange(L::Map(), x, y);
+
+  // If the grid square was previously unobserved, then we will need to create a new
+  // entry in the observationArray for it, so that later accesses can take full advantage
+  // of constant time access.
+  if (*square == NULL) {
+    // Grab a slot in the observation cache, making sure there is still room left for it. Other stripes
+    // may be doing the same.
+    here = __atomic_fetch_add(&(cache->observationID), 1, __ATOMIC_RELAXED);
+    if (here >= __atomic_load_n(&(cache->area), __ATOMIC_ACQUIRE))
+      GrowObservationCache(cache, here);
+
+    // Display ownership of this slot
+    cell->flag = here;
+    ObservationPos(cache, here)[0] = x;
+    ObservationPos(cache, here)[1] = y;
+
+    // Since the grid square was unobserved previously, we will also need to create a
+    // new entry into the map at this location, that we can then build on.
+    // The first step is to create a starter structure, to keep track of the dynamic array
+    // of observations.
+    *square = (TMapStarter *) PoolAlloc(L::Pool(), sizeof(TMapStarter));
+    // No dead or obsolete entries yet.
+    (*square)->dead = 0;
+    // No entries have actually been added to this location yet. We will increment this counter later.
+    (*square)->total = 0;
+    // We will only have room for one observation in this grid square so far. Later, this can grow.
+    (*square)->size = 1;
+    // The actual dynamic array is created here, of exactly the size for one entry.
+    (*square)->array = (TMapNode *) PoolAlloc(L::Pool(), MapArraySize(1));
+
+    // Initialize the slot
+    for (i=0; i < L::IDs(); i++)
+      ObservationEntry(cache, cell->flag)[i] = -1;
+  }
+  // We could have observations here, but this square hasn't been observed yet this iteration.
+  // In that case, we need to build an entry into the observationArray for constant time access.
+  // A grid square marked as empty for everyone (-2) needs a proper entry as well.
+  else if (cell->flag <= 0)
+    BuildObservation<L>(cell, x, y, 0);
+
+  // Note where in the dynamic array of observations we need to look for this one particle's
+  // relevent observation. This is indicated to us by the observationArray.
+  // An entry left over from localizing may have marked the observation as empty.
+  here = ObservationEntry(cache, cell->flag)[parentID];
+  if (here < -2)
+    here = EMPTY_INDEX(here);
+
+  // If the ID of the relevent observation is the same as our altering particle's ID, then the
+  // new observation is merely an amendment to this data, and noone else is using it yet. Just
+  // alter the source directly
+  if ((here != -1) && (MapIDs(*square)[here] == parentID)) {
+    (*square)->array[here].hits = (*square)->array[here].hits + hit;
+    (*square)->array[here].distance = (*square)->array[here].distance + distance;
+    (*square)->array[here].density = (*square)->array[here].hits/(*square)->array[here].distance;
+    ObservationEntry(cache, cell->flag)[parentID] = here;
+    return &((*square)->array[here]);
+  }
+  // Otherwise, we need to use that relevent observation in order to create a new observation.
+  // Otherwise, we can corrupt the data for other particles.
+  else {
+    // We will be adding a new entry to the list- is there enough room?
+    if ((*square)->size <= (*square)->total)
+      ResizeArray<L>(*square, -71);
+
+    // Make all changes before incrementing (*square)->total, since it's used as an index
+    // Update the observationArray, to let it know that this ID will have its own special entry
+    // in the global at this location.
+    ObservationEntry(cache, cell->flag)[parentID] = (*square)->total;
+
+    // i is used as a quick reference guide here, in order to make the code easier to read.
+    i = (*square)->total;
+
+    // Add an entry in to the list of altered map squares for this particle. The pointers between the 
+    // ancestry node's list and the map's observation list need to point back towards each other, in 
+    // order to coordinate data. 
+    // When adding by stripes, the entry goes on the stripe's list for now.
+    if (stripe >= 0)
+      (*square)->array[i].source = StripeEntry<L>(stripe, x, y, i);
+    else {
+      // First check to see if the size of that array is big enough to hold another entry
+      GrowMapEntries<L>(&(particleID[parentID]), particleID[parentID].total+1);
+
+      // Add the location of this new entry to the list in the ancestry node
+      particleID[parentID].mapEntries[particleID[parentID].total].x = x;
+      particleID[parentID].mapEntries[particleID[parentID].total].y = y;
+      particleID[parentID].mapEntries[particleID[parentID].total].node = i;
+      (*square)->array[i].source = particleID[parentID].total;
+      // Note that we now have one more observation at this ancestor node
+      particleID[parentID].total++;
+    }
+
+    // Assign the appropriate ID to this new observation.
+    MapIDs(*square)[i] = parentID;
+
+    // Check to see if this square has been observed by an ancestor
+    if (here == -1) {
+      // Previously unknown; clean slate. Update directly with the observed data.
+      (*square)->array[i].hits = hit;
+      // Include the strength of the prior.
+      (*square)->array[i].distance = distance + L::PRIOR_DIST;
+      // A value of -2 here indicates that this observation had no preceding observation
+      // that it was building off of.
+      (*square)->array[i].parentGen = -2;
+    }
+    else {
+      // Include the pertinent info from the old observation in with the new observation.
+      (*square)->array[i].hits = (*square)->array[here].hits + hit;
+      (*square)->array[i].distance = distance + (*square)->array[here].distance;
+      (*square)->array[i].parentGen = particleID[ MapIDs(*square)[here] ].generation;
+    }
+    (*square)->array[i].density = (*square)->array[i].hits/(*square)->array[i].distance;
+
+    // Now we can acknowledge that there is another observation at this grid square.
+    (*square)->total++;
+    return &((*square)->array[i]);
+  }
+}
+
+
+
+
+//
+// Makes the update to its grid square, followed by the rest of the updates linked to it (see CoalesceUpdates
+// in map.h), in order. After the first one, the particle has its own observation of the grid square, so the
+// rest only need to be added to it, and the grid square is only looked up once. The observation comes out
+// exactly as if each update had been made with UpdateGridSquare.
+//
+template <class L> void AddSquare(TMapUpdate *update, TMapUpdate trace[], int parentID, int stripe = -1)
+{
+  TMapNode *node;
+  int i;
+
+  node = UpdateGridSquare<L>(update->x, update->y, update->distance, update->hit, parentID, stripe);
+  if ((node == NULL) || (update->next < 0))
+    return;
+  for (i = update->next; i >= 0; i = trace[i].next) {
+    node->hits = node->hits + trace[i].hit;
+    node->distance = node->distance + trace[i].distance;
+  }
+  node->density = node->hits/node->distance;
+}
+
+
+
+
+//
+// Removes an observation from the map at position x,y. Node is the index into the
+// dynamic array of which observation needs to be removed. This is typically gotten
+// from the ancestry node, since the death of a node is currently the only way to
+// call this function.
+//
+template <class L> void DeleteObservation(short int x, short int y, short int node)
+{
+  TGridCell *cell;
+  PMapStarter *square;
+  int total;
+
+  // We may have already removed this observation previously in the process of
+  // resizing the array at some point. In that case, there's nothing to do here.
+  cell = GridCell(L::Map(), x, y);
+  if ((node == -1) || (cell == NULL) || (cell->node == NULL))
+    return;
+  square = &(cell->node);
+  MarkGridChange(L::Map(), x, y);
+
+  // If this is the last observation left at this location in the map, then we can
+  // revert the whole entry in the map to NULL, indicating that no current particle
+  // has observed this location.
+  if ((*square)->total - (*square)->dead == 1) {
+    ForgetObservation<L>(cell);
+    PoolFree(L::Pool(), (*square)->array, MapArraySize((*square)->size));
+    PoolFree(L::Pool(), *square, sizeof(TMapStarter));
+    *square = NULL;
+    return;
+  }
+
+  // Look to see if we need to shrink the array
+  if ((int)(((*square)->total - 1 - (*square)->dead)*2.5) <= (*square)->size) {
+    // Let resizing the array remove this entry (it's what is considered a "dead" entry
+    // now, as indicated by the second argument). The cache entry can be fixed afterwards
+    // if it is being kept.
+    if ((L::Cache()->keep) && (cell->flag > 0)) {
+      total = (*square)->total;
+      short int moved[total];
+      ResizeArray<L>(*square, MapIDs(*square)[node], moved);
+      RemapObservation<L>(cell, moved, total);
+    }
+    else {
+      ForgetObservation<L>(cell);
+      ResizeArray<L>(*square, MapIDs(*square)[node]);
+    }
+    if ((*square)->total == 0) {
+      ForgetObservation<L>(cell);
+      PoolFree(L::Pool(), (*square)->array, MapArraySize((*square)->size));
+      PoolFree(L::Pool(), *square, sizeof(TMapStarter));
+      *square = NULL;
+    }
+    return;
+  }
+
+  // If we got this far, we are removing the entry manually. Make a note that we have
+  // one less entry here.
+  (*square)->total--;
+  // This variable is here solely to make the code mroe readable by having less
+  // redirections and indexes.
+  total = (*square)->total;
+  // If the ibservation was the last one in the array, our work is done. Otherwise,
+  // we take the last observation in dynamic array, and copy it ontop of the observation
+  // we are deleting. Since we don't use any of the entries beyond total, that last
+  // observation is essentially already deleted, and we don't have to worry about duplicates.
+  if (node != total) {
+    (*square)->array[node].hits      = (*square)->array[total].hits;
+    (*square)->array[node].distance  = (*square)->array[total].distance;
+    (*square)->array[node].density   = (*square)->array[total].density;
+    MapIDs(*square)[node]        = MapIDs(*square)[total];
+    (*square)->array[node].source    = (*square)->array[total].source;
+    (*square)->array[node].parentGen = (*square)->array[total].parentGen;
+    L::Ancestors()[ MapIDs(*square)[node] ].mapEntries[ (*square)->array[node].source ].node = node;
+    MoveObservation<L>(cell, total, node);
+  }
+}
+
+
+
+//
+// Input: x, y- location of a grid square
+//        distance- the length of a line passing through the square
+// Output: returns the probability of trace of the given length through this square will be stopped by an obstacle
+//
+template <class L> inline double ComputeProbability(int x, int y, double distance, int parentID)
+{
+  TGridCell *cell;
+  PMapStarter node;
+  int flag, here;
+
+  // If there are no entries at this location in the map, we know that the observation
+  // for any particle is UNKNOWN. Use the density of our prior for unknown grid squares
+  cell = GridCell(L::Map(), x, y);
+  if ((cell == NULL) || (cell->node == NULL))
+    return (1.0 - ModelExp(L::PRIOR * distance));
+  node = cell->node;
+
+  // If this grid square has been observed already this iteration, the flagMap will show
+  // how to get constant time access. If that value is set to 0, we know that this location
+  // has yet to be accessed this iteration, and we have build the observation array entry
+  // for this square
+  flag = ClaimObservation<L>(cell, x, y);
+
+  // If the flagMap is set to the constant -2, all particles agree that this location is
+  // empty. We can avoid significant pointer redirection and memory accesses, and just
+  // acknowledge that an empty square has probability 0 of stopping a scan.
+  if (flag == -2)
+    return 0;
+
+  // If the observationArray does not have an entry for this particle (as indicated by
+  // the index of -1) then this location is considered UNKNOWN for this particle, and
+  // we can use our prior value for density.
+  here = ObservationEntry(L::Cache(), flag)[parentID];
+  if (here == -1)
+    return (1.0 - ModelExp(L::PRIOR * distance));
+  // Values below -1 are used to indicate that the square is empty (see EMPTY_ENTRY), and
+  // it is not necessary to access the map, and risk a cache miss.
+  if (here < -1)
+    return 0;
+  // If there is an entry in the observationArray, then we use that entry as an index
+  // into the global map at the relevent location, and retrieve the information
+  // appropriate to compute the density, specifically the number of observed laser stops
+  // in that grid square (hits) and the total distance of laser scans that we have
+  // observed passing through that grid square (distance). density = hits/distance.
+  // Note that if no laser scan have been observed to stop in this square, density is
+  // zero, and no matter what the distance currently being observed to pass through the
+  // square, there is no chance that it will stop the scan.
+  if (node->array[here].hits == 0)
+    return 0;
+  return (1.0 - ModelExp(-node->array[here].density * distance));
+}
+
+
+
+//
+// This function performs the exact same function as the one above, except that it can work
+// without the observation array. This is useful for printing out the map or doing debugging
+// or similar investigation in areas which are not within the area currently being observed.
+//
+template <class L> double ComputeProb(int x, int y, double distance, int ID)
+{
+  PMapStarter node = GridNode(L::Map(), x, y);
+  int i;
+
+  if (node == NULL)
+    return UNKNOWN;
+
+  while (1) {
+    for (i=0; i < node->total; i++) {
+      if (MapIDs(node)[i] == ID) {
+	if (node->array[i].hits == 0)
+	  return 0;
+	return (1.0 - exp(-node->array[i].density * distance));
+      }
+    }
+
+    if (L::Ancestors()[ID].parent == NULL)
+      return UNKNOWN;
+    else
+      ID = L::Ancestors()[ID].parent->ID;
+  }
+
+  return UNKNOWN;
+}
+
+
+
+//
+// Shades one column (i) of the canvas being drawn on by RenderMap, from the observations that its grid
+// squares were claimed for, and clears the claims behind it.
+//
+template <class L> void ShadeColumn(int i, int worker, void *arg)
+{
+  TMapRender *render = (TMapRender *) arg;
+  TMapCanvas *canvas = render->canvas;
+  TMapNode *entry;
+  double hit;
+  int y;
+
+  for (y = 0; y < canvas->height; y++) {
+    if (canvas->claim[i][y] == 0)
+      continue;
+    entry = &(GridNode(L::Map(), canvas->x + i, canvas->y + y)->array[(canvas->claim[i][y] - 1) % RENDER_NODES]);
+    if (entry->hits == 0)
+      hit = 0;
+    else
+      hit = 1.0 - exp(-entry->density * render->distance);
+    canvas->shade[i][y] = (int) (230 - (hit * 230));
+    canvas->claim[i][y] = 0;
+  }
+}
+
+
+//
+// Draws the map of the given particle onto the canvas: 255 for the grid squares it knows nothing about,
+// and darker the more likely a trace of the given length through the square would be to stop, down to 0.
+// This is what looking up ComputeProb for every square gives, but only costs as much as the number of
+// observations in the particle's lineage (see TMapRender in map.h). The canvas is first fitted to the
+// area that the lineage has observed (or the square the robot started at, if there is none), wherever
+// in the grid that is, and the shading is spread across the threads by columns.
+//
+template <class L> void RenderMap(TAncestor *particle, double distance, TMapCanvas *canvas)
+{
+  TMapRender render;
+  TAncestor *ancestor;
+  TEntryList *entry;
+  int i, x, y, depth, here, startx, starty, lastx, lasty;
+
+  startx = starty = GRID_LIMIT;
+  lastx = lasty = -1;
+  for (ancestor = particle; ancestor != NULL; ancestor = ancestor->parent)
+    for (i = 0; i < ancestor->total; i++) {
+      entry = &(ancestor->mapEntries[i]);
+      if (entry->node < 0)
+	continue;
+      startx = MIN(startx, entry->x);
+      starty = MIN(starty, entry->y);
+      lastx = MAX(lastx, entry->x);
+      lasty = MAX(lasty, entry->y);
+    }
+  if (lastx < 0)
+    startx = starty = lastx = lasty = GRID_START;
+
+  CanvasRoom(canvas, lastx - startx + 1, lasty - starty + 1);
+  canvas->x = startx;
+  canvas->y = starty;
+  canvas->width = lastx - startx + 1;
+  canvas->height = lasty - starty + 1;
+  for (x = 0; x < canvas->width; x++)
+    memset(canvas->shade[x], 255, canvas->height);
+  render.canvas = canvas;
+  render.distance = distance;
+
+  for (ancestor = particle, depth = 0; ancestor != NULL; ancestor = ancestor->parent, depth++)
+    for (i = 0; i < ancestor->total; i++) {
+      entry = &(ancestor->mapEntries[i]);
+      if (entry->node < 0)
+	continue;
+      // Should the ancestor have more than one observation here, the first in the grid square's array
+      // is the one which shows, as it is the one that ComputeProb would find.
+      here = depth*RENDER_NODES + entry->node + 1;
+      x = entry->x - startx;
+      y = entry->y - starty;
+      if ((canvas->claim[x][y] == 0) || (canvas->claim[x][y] > here))
+	canvas->claim[x][y] = here;
+    }
+
+  ParallelFor(canvas->width, 16, ShadeColumn<L>, &render);
+}
+
+
+
+
+//
+// Takes as input the parameters of a laser scan, and updates the world map appropriately
+// startx and stary are the origins of the laser scan, MeasuredDist is how far it was
+// was percieved to travel (the length of the line trace), and theta was the angle of the
+// line (in radians). parentID lets us know which particle ID this update is associated with,
+// and addEnd = 1 when the laser scan was stopped by an object (instead of just travelling
+// maximum range without seeing anything) indicating that the last grid square needs to be
+// updated as occupied. The grid squares that the line passes through are found first (see TraceUpdates
+// in rays.h), and then updated in order.
+//
+template <class L> void AddTrace(double startx, double starty, double MeasuredDist, double theta, int parentID, int addEnd)
+{
+  TMapUpdate update[MAX_TRACE_UPDATES];
+  int i, n;
+
+  n = TraceUpdates(startx, starty, MeasuredDist, theta, addEnd, update);
+  for (i = 0; i < n; i++)
+    UpdateGridSquare<L>(update[i].x, update[i].y, update[i].distance, update[i].hit, parentID);
+}
+
+
+
+//
+// Makes sure that there is room for count updates in one of the lists of TInsertion.
+//
+static inline TMapUpdate *UpdateRoom(TMapUpdate **list, int *room, int count)
+{
+  if (count > *room) {
+    *room = MAX(count, 2*(*room));
+    *list = (TMapUpdate *) realloc(*list, *room * sizeof(TMapUpdate));
+    if (*list == NULL) {
+      fprintf(stderr, "Unable to make room for %d map updates.\n", count);
+      exit(-1);
+    }
+  }
+  return *list;
+}
+
+
+//
+// Traces each laser cast of the scan from the particle, and lists the grid squares that they pass
+// through, in order, in *list (which has room for *room, and is made larger if need be). Returns the
+// number of updates.
+//
+static inline int TraceScanUpdates(TParticle *particle, TSenseSample sense[], TMapUpdate **list, int *room)
+{
+  TMapUpdate *trace;
+  int j, n;
+
+  n = 0;
+  for (j=0; j < SENSE_NUMBER; j++) {
+    trace = UpdateRoom(list, room, n + MAX_TRACE_UPDATES);
+    n = n + TraceUpdates(particle->x, particle->y, sense[j].distance, (sense[j].theta + particle->theta), 
+			 (sense[j].distance < MAX_SENSE_RANGE), trace + n);
+  }
+  return n;
+}
+
+
+//
+// The first stage of InsertScans, for particle p: traces each laser cast of the scan from the particle,
+// links together the updates to the same grid square, and sorts the grid squares by stripe. Also notes
+// (fix) whether any of them will need to be sorted out before the stripes start. Nothing is changed in 
+// the map here.
+//
+template <class L> void TraceScan(int p, int worker, void *arg)
+{
+  TInsertion *insertion = L::Insertion();
+  TMapUpdate *trace, *update;
+  TGridCell *cell;
+  int *bucket = insertion->bucket[p];
+  int count[INSERT_STRIPES];
+  int i, n, s;
+
+  n = TraceScanUpdates(&(L::Particles()[p]), insertion->sense, &(insertion->trace[p]), &(insertion->traceRoom[p]));
+  trace = insertion->trace[p];
+  CoalesceUpdates(&(insertion->table[worker]), trace, n);
+
+  // A counting sort of the first update to each grid square, which keeps those of each stripe in the
+  // order that they were traced.
+  memset(count, 0, INSERT_STRIPES*sizeof(int));
+  insertion->fix[p] = 0;
+  for (i=0; i < n; i++) 
+    if (!trace[i].repeat) {
+      count[SquareStripe(trace[i].x, trace[i].y)]++;
+      cell = GridCell(L::Map(), trace[i].x, trace[i].y);
+      if ((cell == NULL) || ((cell->node != NULL) && (cell->node->dead > 0)))
+	insertion->fix[p] = 1;
+    }
+  bucket[0] = 0;
+  for (s=0; s < INSERT_STRIPES; s++)
+    bucket[s+1] = bucket[s] + count[s];
+  memcpy(count, bucket, INSERT_STRIPES*sizeof(int));
+  update = UpdateRoom(&(insertion->update[p]), &(insertion->updateRoom[p]), bucket[INSERT_STRIPES]);
+  for (i=0; i < n; i++)
+    if (!trace[i].repeat)
+      update[count[SquareStripe(trace[i].x, trace[i].y)]++] = trace[i];
+}
+
+
+//
+// The second stage of InsertScans, for stripe s: adds the updates in the stripe for every particle, in
+// the order of the particles.
+//
+template <class L> void AddStripe(int s, int worker, void *arg)
+{
+  TInsertion *insertion = L::Insertion();
+  TMapUpdate *update;
+  int p, i, ID;
+
+  insertion->entries[s] = 0;
+  for (p=0; p < insertion->particles; p++) {
+    insertion->first[s][p] = insertion->entries[s];
+    update = insertion->update[p];
+    ID = L::Particles()[p].ancestryNode->ID;
+    for (i = insertion->bucket[p][s]; i < insertion->bucket[p][s+1]; i++)
+      AddSquare<L>(&(update[i]), insertion->trace[p], ID, s);
+  }
+  insertion->first[s][insertion->particles] = insertion->entries[s];
+}
+
+
+//
+// The last stage of InsertScans, for particle p: gathers its new observations from each of the stripes
+// onto its ancestor's list of altered grid squares, and points the observations at their place there.
+//
+template <class L> void CollectEntries(int p, int worker, void *arg)
+{
+  TInsertion *insertion = L::Insertion();
+  TAncestor *node = L::Particles()[p].ancestryNode;
+  TEntryList *entry;
+  int s, i, count;
+
+  count = 0;
+  for (s=0; s < INSERT_STRIPES; s++)
+    count = count + insertion->first[s][p+1] - insertion->first[s][p];
+  GrowMapEntries<L>(node, node->total + count);
+
+  for (s=0; s < INSERT_STRIPES; s++)
+    for (i = insertion->first[s][p]; i < insertion->first[s][p+1]; i++) {
+      entry = &(insertion->entry[s][i]);
+      node->mapEntries[node->total] = *entry;
+      GridNode(L::Map(), entry->x, entry->y)->array[entry->node].source = node->total;
+      node->total++;
+    }
+}
+
+
+//
+// Adds the laser scan to the map, as seen from each of the first count particles. Each particle's laser 
+// casts are traced first, and then the updates to each grid square are made all together, in the order 
+// of the particles (see AddSquare). If PARALLEL_INSERT is off, or there is only one thread, this is done
+// one particle at a time. Otherwise, it is done in stages, each of which can be spread across several 
+// threads (see TInsertion in map.h):
+// - Every particle's laser casts are traced, and the grid squares that they pass through are sorted
+//   by stripe.
+// - Any tiles of the map that are missing are made, and any grid squares with dead observations have
+//   their entry in the observation cache built, which clears them out. Both of these reach outside 
+//   of a single stripe, so this is done by this thread alone, but is rarely needed.
+// - Each stripe adds all of the updates to its own grid squares.
+// - Each particle collects its new observations from the stripes.
+// Each grid square ends up with the same observations, in the same order, either way, and the same as 
+// adding each laser cast with AddTrace. Only the order of the ancestors' lists of altered grid squares 
+// differs, which has no bearing on the results.
+//
+template <class L> void InsertScans(TSenseSample sense[], int count)
+{
+  TInsertion *insertion = L::Insertion();
+  TParticle *particle = L::Particles();
+  TMapUpdate *update, *trace;
+  TGridCell *cell;
+  int p, i, s, n;
+
+  if (count > insertion->particleRoom) {
+    insertion->trace = (TMapUpdate **) realloc(insertion->trace, count * sizeof(TMapUpdate *));
+    insertion->update = (TMapUpdate **) realloc(insertion->update, count * sizeof(TMapUpdate *));
+    insertion->traceRoom = (int *) realloc(insertion->traceRoom, count * sizeof(int));
+    insertion->updateRoom = (int *) realloc(insertion->updateRoom, count * sizeof(int));
+    insertion->bucket = (int (*)[INSERT_STRIPES+1]) realloc(insertion->bucket, count * sizeof(int [INSERT_STRIPES+1]));
+    insertion->fix = (int *) realloc(insertion->fix, count * sizeof(int));
+    for (s=0; s < INSERT_STRIPES; s++)
+      insertion->first[s] = (int *) realloc(insertion->first[s], (count+1) * sizeof(int));
+    if ((insertion->trace == NULL) || (insertion->update == NULL) || (insertion->traceRoom == NULL) ||
+	(insertion->updateRoom == NULL) || (insertion->bucket == NULL) || (insertion->fix == NULL)) {
+      fprintf(stderr, "Unable to make room for adding the scans of %d particles.\n", count);
+      exit(-1);
+    }
+    for (p = insertion->particleRoom; p < count; p++) {
+      insertion->trace[p] = insertion->update[p] = NULL;
+      insertion->traceRoom[p] = insertion->updateRoom[p] = 0;
+    }
+    insertion->particleRoom = count;
+  }
+  if (insertion->tables < THREADS) {
+    insertion->table = (TSquareTable *) realloc(insertion->table, THREADS * sizeof(TSquareTable));
+    if (insertion->table == NULL) {
+      fprintf(stderr, "Unable to make room for adding the scans with %d threads.\n", THREADS);
+      exit(-1);
+    }
+    memset(insertion->table + insertion->tables, 0, (THREADS - insertion->tables) * sizeof(TSquareTable));
+    insertion->tables = THREADS;
+  }
+
+  if (!PARALLEL_INSERT || (THREADS == 1)) {
+    for (p=0; p < count; p++) {
+      n = TraceScanUpdates(&(particle[p]), sense, &(insertion->trace[0]), &(insertion->traceRoom[0]));
+      trace = insertion->trace[0];
+      CoalesceUpdates(&(insertion->table[0]), trace, n);
+      for (i=0; i < n; i++)
+	if (!trace[i].repeat)
+	  AddSquare<L>(&(trace[i]), trace, particle[p].ancestryNode->ID);
+    }
+    return;
+  }
+
+  insertion->sense = sense;
+  insertion->particles = count;
+
+  ParallelFor(count, 1, TraceScan<L>, NULL);
+
+  for (p=0; p < count; p++)
+    if (insertion->fix[p]) {
+      update = insertion->update[p];
+      for (i=0; i < insertion->bucket[p][INSERT_STRIPES]; i++) {
+	cell = TouchGridCell(L::Map(), update[i].x, update[i].y);
+	if ((cell != NULL) && (cell->node != NULL) && (cell->node->dead > 0)) {
+	  ForgetObservation<L>(cell);
+	  BuildObservation<L>(cell, update[i].x, update[i].y, 0);
+	}
+      }
+    }
+
+  L::Pool()->shared = (THREADS > 1);
+  ParallelFor(INSERT_STRIPES, 1, AddStripe<L>, NULL);
+  ParallelFor(count, 1, CollectEntries<L>, NULL);
+  L::Pool()->shared = 0;
+}
+
+
+
+//
+// Inputs: x, y- starting point for the trace
+//         theta- angle for the trace
+//         measuredDist- the observed distance for this trace
+//         parentID- the ID of the most recent member of the ancestry for the particle being considered
+//         culling- how far past the measured distance to trace, or 0 for a full trace (see below)
+// Output: The total evaluated probability for this laser cast (unnormalized).
+//
+template <class L> double LineTrace(double startx, double starty, double theta, double MeasuredDist, int parentID, float culling)
+{
+  double overflow, slope; // Used for actually tracing the line
+  int x, y, incX, incY, endx, endy;
+  double dx, dy;
+  double totalProb; // Total probability that the line trace should have stopped before this step in the trace
+  double eval;      // Total raw probability for the observation given this line trace through the map
+  double prob, distance, error;
+  double secant, cosecant;   // precomputed for speed
+  double xblock, yblock;
+  double xMotion, yMotion;
+  double standardDist;
+
+  // eval is the total probability for this line trace. Since this is a summation, eval starts at 0
+  eval = 0.0;
+  // totalProb is the total probability that the laser scan could travel this far through the map.
+  // This starts at 1, and decreases as possible objects are passed.
+  totalProb = 1.0;
+  // a couple of variables are precomuted for speed.
+  secant = 1.0/fabs(cos(theta));
+  cosecant = 1.0/fabs(sin(theta));
+
+  // If you look at Localize funtion in low.c, you can see that there are two different line traces
+  // performed. The second trace is the full evaluation of the scan. The first trace is a kind of
+  // approximate scan, only covering a small section near the percieved endpoint of the scan. The
+  // first trace is used as a way of culling out obviously bad particles without having to do too
+  // much on them. For this "culling" trace, we specify directly how much further past the endpoint
+  // we want to trace. When that culling number is set to zero, we know that it is the full trace
+  // we are looking at, and we can as far out as 20 grid squares beyond the endpoint (anything further
+  // has essentially zero probability to add to the scan.
+  if (culling)
+    distance = MeasuredDist+culling;
+  else
+    distance = MIN(MeasuredDist+20.0, MAX_SENSE_RANGE);
+
+  // The endpoint of the scan, in both float and int.
+  dx = (startx + (cos(theta) * distance));
+  dy = (starty + (sin(theta) * distance));
+  endx = (int) (dx);
+  endy = (int) (dy);
+
+  // Decide which x and y directions the line is travelling.
+  if (startx > dx) {
+    incX = -1;
+    xblock = -startx;
+  }
+  else {
+    incX = 1;
+    xblock = 1.0-startx;
+  }
+
+  if (starty > dy) {
+    incY = -1;
+    yblock = -starty;
+  }
+  else {
+    incY = 1;
+    yblock = 1.0-starty;
+  }
+
+  // Two copies of the same basic code, swapping the roles of x and y, depending on which one is the primary
+  // direction of motion in the line trace.
+  if (fabs(startx - dx) > fabs(starty - dy)) {
+    y = (int) (starty);
+
+    // The given starting point is non-integer. The line therefore starts at some point partially set in to the starting
+    // square. Overflow starts at this off-center amount, in order to make steps in the y direction at the right places.
+    overflow = starty - y;
+    // Code is simpler if overflow is always decreasing towards zero. Note that slope is forced to be postive
+    if (incY == 1)
+      overflow = 1.0 - overflow;
+
+    slope = fabs(tan(theta));
+    if (slope > 1.0)
+      slope = fabs((starty - dy) / (startx - dx));
+
+    // The first square is a delicate thing, as we aren't doing a full square traversal in
+    // either direction. So we figure out this strange portion of a step so that we can then
+    // work off of the axes later.
+    // NOTE: we aren't computing the probability of this first step. Its a technical issue for
+    // simplicity, and the odds of the sensor sitting on top of a solid object are sufficiently
+    // close to zero to ignore this tiny portion of a step.
+    dx = fabs((int)(startx)+xblock);
+    dy = fabs(tan(theta)*dx);
+    // The first step is actually in the y direction, due to the proximity of starty
+    // to the y axis.
+    if (overflow - dy < 0.0) {
+      y = y + incY;
+      overflow = overflow - dy + 1.0;
+    }
+    // Our first step is in fact in the x direction in this case. Set up for the overflow to
+    // be our starting offset plus this little extra we travel in the y direction.
+    else
+      overflow = overflow - dy;
+
+    // Most of the scans will be the same length across a grid square, entering and exiting on opposite
+    // sides. Precompute this amount to save a little time.
+    standardDist = slope*cosecant;
+
+    // These two numbers help determine just how far away the endpoint of the scan is from the current
+    // position in the scan. xMotion keeps track of the distance from the endpoint of the scan to next
+    // point where the line trace will cross the x-axis. Since each step in this loop moves us across
+    // exactly one grid square, this number will change by 1/cosine(theta) (ie secant) each iteration.
+    // yMotion obviously does the same for the y axis.
+    xMotion = -fabs(fabs(( ((int) (startx)) +xblock) * secant) - MeasuredDist);
+    yMotion = -fabs(fabs((y+yblock) * cosecant) - MeasuredDist);
+
+    for (x = (int) (startx) + incX; x != endx; x = x + incX) {
+      // Update our two running counts.
+      xMotion = xMotion + secant;
+      overflow = overflow - slope;
+
+      // Establish the distance travelled by the laser through this square. Note that this amount is
+      // less than normal if the slope has overflowed, implying that the y-axis has been crossed.
+      if (overflow < 0.0)
+	distance = (overflow+slope)*cosecant;
+      else
+	distance = standardDist;
+
+      // Compute the probability of the laser stopping in the square, given the particle's unique map.
+      // Keep in mind that the probability of even getting this far in the trace is likely less than 1.
+      prob = totalProb * ComputeProbability<L>(x, y, distance, parentID);
+      if (prob > 0) {
+	// If the scan had actually been stopped by an object in the map at this square,
+	// how much error would there be in the laser? Determine which axis will be crossed
+	// next, and compute from there. (This value is actually kept as a running total now).
+	if (overflow < 0.0)
+	  error = fabs(yMotion);
+	else
+	  error = fabs(xMotion);
+
+	// Increase the probability of the scan by the probability of stopping here, multiplied by the
+	// probability that a scan which stopped here could produce the error observed.
+	// If the error is too large, the net effect on probability of the scan is essentially zero.
+	// We can save some time by not computing this exponential.
+	if (error < 20.0)
+	  eval = eval + (prob * ModelExp(-(error*error)/(2*L::VARIANCE)));
+
+	// Correspondingly decrease the probability that laser has continued.
+	totalProb = totalProb - prob;
+      }
+
+      // If the overflow has dipped below zero, then the trace has crossed the y-axis, and we need to compute
+      // everything for a single step in the y direction.
+      if (overflow < 0.0) {
+	y += incY;
+	yMotion = yMotion + cosecant;
+
+	distance = -overflow*cosecant;
+	overflow = overflow + 1.0;
+
+	prob = totalProb * ComputeProbability<L>(x, y, distance, parentID);
+	if (prob > 0) {
+	  // There is no question about which axis will be the next crossed, since we just crossed the y-axis,
+	  // and x motion is dominant
+	  error = fabs(xMotion);
+	  if (error < 20.0)
+	    eval = eval + (prob * ModelExp(-(error*error)/(2*L::VARIANCE)));
+	}
+	totalProb = totalProb - prob;
+      }
+
+    }
+  }
+
+  // ...second verse, same as the first...
+  // Pretty much a direct copy of the previous block of code, with x and y reversed.
+  else {
+    x = (int) (startx);
+    overflow = startx - x;
+    if (incX == 1)
+      overflow = 1.0 - overflow;
+    slope = 1.0/fabs(tan(theta));
+
+    // (See corresponding comments in the previous half of this function)
+    dy = fabs((int)(starty)+yblock);
+    dx = fabs(dy/tan(theta));
+    if (overflow - dx < 0) {
+      x = x + incX;
+      overflow = overflow - dx + 1.0;
+    }
+    else
+      overflow = overflow - dx;
+
+    standardDist = slope*secant;
+    xMotion = -fabs(fabs((x+xblock) * secant) - MeasuredDist);
+    yMotion = -fabs(fabs(( ((int) (starty)) +yblock) * cosecant) - MeasuredDist);
+
+    for (y = (int) (starty) + incY; y != endy; y = y + incY) {
+      yMotion = yMotion + cosecant;
+      overflow = overflow - slope;
+
+      if (overflow < 0.0)
+	distance = (overflow+slope)*secant;
+      else
+	distance = standardDist;
+
+      prob = totalProb * ComputeProbability<L>(x, y, distance, parentID);
+      if (prob > 0) {
+	if (overflow < 0.0)
+	  error = fabs(xMotion);
+	else
+	  error = fabs(yMotion);
+	if (error < 20.0)
+	  eval = eval + (prob * ModelExp(-(error*error)/(2*L::VARIANCE)));
+      }
+      totalProb = totalProb - prob;
+
+      if (overflow < 0.0) {
+	x += incX;
+	xMotion = xMotion + secant;
+
+	distance = -overflow*secant;
+	overflow = overflow + 1.0;
+
+	prob = totalProb * ComputeProbability<L>(x, y, distance, parentID);
+	if (prob > 0) {
+	  error = fabs(yMotion);
+	  if (error < 20.0)
+	    eval = eval + (prob * ModelExp(-(error*error)/(2*L::VARIANCE)));
+	}
+	totalProb = totalProb - prob;
+      }
+
+    }
+  }
+
+  // If the laser reported a range beyond the maximum range allowed, any left-over probability that
+  // the laser has not yet been stopped all has a probability of 1 to get the measured reading. We
+  // therefore just add this remaining probability to the evaluation.
+  if (MeasuredDist >= MAX_SENSE_RANGE)
+    return (eval + totalProb);
+
+  // Otherwise, we know that the total probability of the laser being stopped at some point during
+  // the scan is 1. Normalize the evaluation to enforce this.
+  if (totalProb == 1)
+    return 0;
+  return (eval / (1.0 - totalProb));
+}
+
+
+
+//
+// The density of a grid square, as seen by the given particle. This is the same as ComputeProbability,
+// except that it stops short of the exponential, so that those can be done for several traces at once.
+// cell is the square's cell in the map (NULL if its tile hasn't been made), and node and flag are the
+// values in that cell, if they have already been read. Any flag other than -2 or an index into the
+// observationArray is checked again by ClaimObservation.
+//
+template <class L> inline double ComputeDensity(TGridCell *cell, PMapStarter node, int flag, int x, int y, int parentID)
+{
+  int here;
+
+  if (node == NULL)
+    return -L::PRIOR;
+
+  if ((flag <= 0) && (flag != -2))
+    flag = ClaimObservation<L>(cell, x, y);
+  if (flag == -2)
+    return 0;
+
+  here = ObservationEntry(L::Cache(), flag)[parentID];
+  if (here == -1)
+    return -L::PRIOR;
+  if ((here < -1) || (node->array[here].hits == 0))
+    return 0;
+  return node->array[here].density;
+}
+
+
+
+//
+// Looks up the densities for a set of interleaved line traces, a step at a time. The tiles, and then the
+// node and flag of the cells, for all of the lanes in a step are fetched together with AVX2 gathers,
+// since these are the reads most likely to miss the cache. Lanes which are off the edge of the grid, or
+// which land in a tile that hasn't been made, are masked off and see an empty square.
+// On x86, a plain read of a flag which sees a finished index also sees the entry that it points to,
+// so only the unbuilt squares need to go through ClaimObservation.
+//
+template <class L> __attribute__((target("avx2")))
+void GatherDensities(int steps, const int *cellX, const int *cellY, const int *length, int parentID, double *rate)
+{
+  __m128i xs, ys, index, valid;
+  __m256i tiles, cells, mask, nodes;
+  __m128i offset, flags;
+  TGridCell *cell[TRACE_LANES];
+  PMapStarter node[TRACE_LANES];
+  int flag[TRACE_LANES];
+  TGridTile **directory;
+  int k, l;
+
+  directory = L::Map()->tile;
+  for (k = 0; k < steps; k++) {
+    xs = _mm_loadu_si128((const __m128i *) (cellX + k*TRACE_LANES));
+    ys = _mm_loadu_si128((const __m128i *) (cellY + k*TRACE_LANES));
+    // Only lanes still in their trace and inside the grid (an unsigned compare against GRID_LIMIT) are looked up.
+    valid = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *) length), _mm_set1_epi32(k));
+    valid = _mm_and_si128(valid, _mm_cmpeq_epi32(_mm_srli_epi32(_mm_or_si128(xs, ys), GRID_BITS), _mm_setzero_si128()));
+    index = _mm_add_epi32(_mm_slli_epi32(_mm_srli_epi32(xs, TILE_BITS), GRID_BITS-TILE_BITS), _mm_srli_epi32(ys, TILE_BITS));
+
+    // The tiles, and then the cells within them
+    tiles = _mm256_mask_i32gather_epi64(_mm256_setzero_si256(), (const long long *) directory, index,
+					_mm256_cvtepi32_epi64(valid), sizeof(TGridTile *));
+    mask = _mm256_xor_si256(_mm256_cmpeq_epi64(tiles, _mm256_setzero_si256()), _mm256_set1_epi64x(-1));
+    offset = _mm_add_epi32(_mm_slli_epi32(_mm_and_si128(xs, _mm_set1_epi32(TILE_SIZE-1)), TILE_BITS),
+			   _mm_and_si128(ys, _mm_set1_epi32(TILE_SIZE-1)));
+    cells = _mm256_add_epi64(tiles, _mm256_mul_epu32(_mm256_cvtepu32_epi64(offset), _mm256_set1_epi64x(sizeof(TGridCell))));
+    cells = _mm256_and_si256(cells, mask);
+
+    nodes = _mm256_mask_i64gather_epi64(_mm256_setzero_si256(), (const long long *) 0, cells, mask, 1);
+    flags = _mm256_mask_i64gather_epi32(_mm_setzero_si128(), (const int *) offsetof(TGridCell, flag), cells,
+					_mm256_castsi256_si128(_mm256_permutevar8x32_epi32(mask, _mm256_setr_epi32(0, 2, 4, 6, 0, 0, 0, 0))), 1);
+    _mm256_storeu_si256((__m256i *) cell, cells);
+    _mm256_storeu_si256((__m256i *) node, nodes);
+    _mm_storeu_si128((__m128i *) flag, flags);
+
+    for (l = 0; l < TRACE_LANES; l++)
+      if (k < length[l])
+	rate[k*TRACE_LANES+l] = ComputeDensity<L>(cell[l], node[l], flag[l], cellX[k*TRACE_LANES+l], cellY[k*TRACE_LANES+l], parentID);
+      else
+	rate[k*TRACE_LANES+l] = 0.0;
+  }
+}
+
+
+
+//
+// Performs LineTrace for a whole set of traces by the same particle, placing the evaluation of each into
+// result. The traces are worked on TRACE_LANES at a time: first the grid squares of each trace are found,
+// then the densities of all of those squares are looked up, and finally the probabilities are accumulated
+// with one trace per vector lane (see simd.h). The vector exponentials can differ from the library's in the
+// last place, so when SIMD_LEVEL is SIMD_SCALAR we simply call LineTrace, for results identical to it.
+//
+template <class L> void LineTraceBatch(int count, double startx[], double starty[], double theta[], double MeasuredDist[],
+				       int parentID, float culling, double result[])
+{
+  int cellX[MAX_TRACE_STEPS*TRACE_LANES], cellY[MAX_TRACE_STEPS*TRACE_LANES];
+  double rate[MAX_TRACE_STEPS*TRACE_LANES], dist[MAX_TRACE_STEPS*TRACE_LANES], error[MAX_TRACE_STEPS*TRACE_LANES];
+  double eval[TRACE_LANES], totalProb[TRACE_LANES];
+  int length[TRACE_LANES];
+  int i, k, l, lanes, steps;
+
+  if (SIMD_LEVEL == SIMD_SCALAR) {
+    for (i = 0; i < count; i++)
+      result[i] = LineTrace<L>(startx[i], starty[i], theta[i], MeasuredDist[i], parentID, culling);
+    return;
+  }
+
+  for (i = 0; i < count; i = i + TRACE_LANES) {
+    lanes = MIN(TRACE_LANES, count - i);
+
+    steps = 0;
+    for (l = 0; l < TRACE_LANES; l++) {
+      if (l < lanes)
+	length[l] = TraceSquares(startx[i+l], starty[i+l], theta[i+l], MeasuredDist[i+l], culling,
+				 cellX+l, cellY+l, dist+l, error+l, TRACE_LANES);
+      else
+	length[l] = 0;
+      steps = MAX(steps, length[l]);
+    }
+
+    // Pad out the shorter traces with steps that have no chance of stopping the laser.
+    for (l = 0; l < TRACE_LANES; l++)
+      for (k = length[l]; k < steps; k++) {
+	cellX[k*TRACE_LANES+l] = 0;
+	cellY[k*TRACE_LANES+l] = 0;
+	dist[k*TRACE_LANES+l] = 0.0;
+	error[k*TRACE_LANES+l] = 20.0;
+      }
+
+    if (SIMD_LEVEL == SIMD_AVX2)
+      GatherDensities<L>(steps, cellX, cellY, length, parentID, rate);
+    else
+      for (k = 0; k < steps; k++)
+	for (l = 0; l < TRACE_LANES; l++)
+	  if (k < length[l])
+	    rate[k*TRACE_LANES+l] = ComputeDensity<L>(GridCell(L::Map(), cellX[k*TRACE_LANES+l], cellY[k*TRACE_LANES+l]),
+						      GridNode(L::Map(), cellX[k*TRACE_LANES+l], cellY[k*TRACE_LANES+l]), 0,
+						      cellX[k*TRACE_LANES+l], cellY[k*TRACE_LANES+l], parentID);
+	  else
+	    rate[k*TRACE_LANES+l] = 0.0;
+
+    TraceEvaluate(steps, rate, dist, error, L::VARIANCE, eval, totalProb);
+
+    // The same normalization as at the end of LineTrace.
+    for (l = 0; l < lanes; l++) {
+      if (MeasuredDist[i+l] >= MAX_SENSE_RANGE)
+	result[i+l] = eval[l] + totalProb[l];
+      else if (totalProb[l] == 1)
+	result[i+l] = 0;
+      else
+	result[i+l] = eval[l] / (1.0 - totalProb[l]);
+    }
+  }
+}
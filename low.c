@@ -19,6 +19,16 @@
 
 #include "low.h"
 #include "mt-rand.h"
+#include "threads.h"
+#include "simd.h"
+#include "rays.h"
+#include "fastMath.h"
+#include "levelMap.h"
+#include "level.h"
+#include "resample.h"
+#include "binlog.h"
+#include "reader.h"
+#include "image.h"
 
 struct THold {
   TSense sense;
@@ -63,12 +73,28 @@ struct THold {
 #define MAX_TRACE_ERROR exp(-24.0/LOW_VARIANCE)
 // A constant used for culling in Localize
 #define WORST_POSSIBLE -10000
-
-// Used for recognizing the format of some data logs.
-#define LOG 0
-#define REC 1
+// The number of samples handed to a worker thread at a time when scoring samples in parallel
+#define SCORE_GRAIN 4
+// The number of samples handed to a worker thread at a time when moving samples in parallel
+#define MOVE_GRAIN 32
+// With KLD-sampling, the number of samples drawn and moved at a time, before checking whether there are
+// enough. Their noise (3 deviates each) is then a whole number of blocks (NOISE_BLOCK in noise.h).
+#define KLD_CHUNK 64
+
+// For KLD-sampling (see KLDBound). Samples are sorted into bins by pose, KLD_XY_BIN grid squares
+// on a side and KLD_THETA_BIN radians around. Enough samples are generated that, with probability
+// 1-delta, the error between the sampled and the true distribution is at most KLD_EPSILON. KLD_Z
+// is the upper 1-delta quantile of the standard normal distribution (delta = 0.01).
+#define KLD_XY_BIN 3.0
+#define KLD_THETA_BIN 0.1
+#define KLD_EPSILON 0.05
+#define KLD_Z 2.326
+
+// The format of the data log being played back (see reader.h).
 int FILE_FORMAT;
 FILE *readFile;
+// The data log, when it is a binary one.
+TBinLog binLog;
 
 //
 // Structures
@@ -94,34 +120,70 @@ struct TSample_struct {
 };
 typedef struct TSample_struct TSample;
 
+// Everything that the worker threads need to know in order to score the samples for 
+// a single pass of Localize.
+struct TPass_struct {
+  TSenseSample *sense;
+  int pass;
+  double threshold;
+  // Whether this is a pass of the full evaluation (CheckScore) or the quick culling (QuickScore)
+  char full;
+};
+typedef struct TPass_struct TPass;
+
+// The expected motion of every sample in this iteration of Localize, before the noise is added.
+struct TMotion_struct {
+  double CCenter, DCenter, TCenter;
+  // The first sample of the chunk being moved.
+  int first;
+};
+typedef struct TMotion_struct TMotion;
+
  // The number of iterations between writing out the map as a png. 0 is off.
 int L_VIDEO = 0;
 
- // Every particle needs a unique ID number. This stack keeps track of the unused IDs.
-int cleanID;
-int availableID[ID_NUMBER];
-
  // We generate a large number of extra samples to evaluate during localization, much larger than the number of true particles.
  // We store the samples that are being localized over in newSample, rather than keep a true particle for each.
-TSample newSample[SAMPLE_NUMBER];
+TSample *newSample;
+ // Marks which samples survived the culling of the current pass of Localize.
+char *survivor;
+ // How many of the samples were generated this iteration. This is SAMPLE_NUMBER, unless it is
+ // adapted to the spread of the samples (see MIN_SAMPLE_NUMBER in map.h).
+int cur_samples_used;
+ // The parent of each sample to be generated, in the order that they are generated.
+int *sampleParent;
+ // How many children each sample gets when they are resampled.
+int *newchildren;
+ // The noise for the motion model of each sample: the C, D and T terms, in that order (see Localize).
+double *motionNoise;
+ // The pose bins already holding a sample this iteration, for KLD-sampling. This is an open hash
+ // table, where a bin only counts if its stamp matches the current iteration's.
+long long *binKey;
+int *binStamp;
+int binMask, binEpoch;
  // In order to compute the amount of percieved motion from the odometry, the last odometry readings are recorded 
  // The actual percieved movement is the current odometry readings minus these recorded 'last' readings.
 double lastX, lastY, lastTheta;
  // No. of children each particle gets, based on random resampling
-int children[PARTICLE_NUMBER];
+int *children;
+ // Decides which samples are kept as particles, and how many children each gets (see resample.h)
+TResampler lowResampler;
 
  // savedParticle is where we store the current set of samples which were resampled, before we have
  // created an ID and an entry in the ancestry tree for each one.
-TParticle savedParticle[PARTICLE_NUMBER];
+TParticle *savedParticle;
 int cur_saved_particles_used;
 
  // Keeps track of what iteration the SLAM process is currently on.
 int curGeneration;
+ // Where the best pose of each generation is recorded, if anywhere.
+FILE *POSE_LOG = NULL;
  // Stores the most recent set of laser observations.
 TSense sense;
- // This array stores the color values for each grid square when printing out the map. For some reason,
- // moving this out as a global variable greatly increases the stability of the code.
-unsigned char map[MAP_WIDTH][MAP_HEIGHT];
+ // This stores the color values for each grid square when printing out the map. For some reason,
+ // moving this out as a global variable greatly increases the stability of the code. It only covers the
+ // area that the map being printed has observed (see TMapCanvas in map.h).
+TMapCanvas map;
 THold hold[LOW_DURATION];
 
 
@@ -147,21 +209,34 @@ void AddToWorldModel(TSense sense, int particleNum) {
 //
 // CheckScore
 //
-// Determine the fitness of a laser endpoint
+// Determine the fitness of the laser endpoints for one pass of Localize
 //
 // sense- the set of all current laser observations
-// index- the specific number of the laser observation that we are going to score
+// first- the number of the first laser observation that we are going to score. Every PASSES-th observation
+//        after it is scored as well, and they are all traced together (see LowLineTraceBatch)
 // sampleNum- the idnex into the sample array for the sample we are currently concerned with
+// score- filled with the unnormalized posterior of each of the observations scored, in order
 //
-// Returns the unnormalized posterior for current particle
+// Returns the number of observations scored
 //
-inline double CheckScore(TSense sense, int index, int sampleNum) 
+inline int CheckScore(TSense sense, int first, int sampleNum, double score[]) 
 {
-  double a;
+  double startx[SENSE_NUMBER], starty[SENSE_NUMBER], theta[SENSE_NUMBER], distance[SENSE_NUMBER];
+  int k, n;
+
+  n = 0;
+  for (k = first; k < SENSE_NUMBER; k += PASSES) {
+    startx[n] = newSample[sampleNum].x;
+    starty[n] = newSample[sampleNum].y;
+    theta[n] = sense[k].theta + newSample[sampleNum].theta;
+    distance[n] = sense[k].distance;
+    n++;
+  }
 
-  a = LowLineTrace(newSample[sampleNum].x, newSample[sampleNum].y, (sense[index].theta + newSample[sampleNum].theta), 
-		   sense[index].distance, l_particle[ newSample[sampleNum].parent ].ancestryNode->ID, 0);
-  return MAX(MAX_TRACE_ERROR, a);
+  LowLineTraceBatch(n, startx, starty, theta, distance, l_particle[ newSample[sampleNum].parent ].ancestryNode->ID, 0, score);
+  for (k = 0; k < n; k++)
+    score[k] = MAX(MAX_TRACE_ERROR, score[k]);
+  return n;
 }
 
 
@@ -169,25 +244,193 @@ inline double CheckScore(TSense sense, int index, int sampleNum)
 // 
 // QuickScore
 //
-// Basically the same as CheckScore, except that the value returned is just a heuristic approximation,
-// based on a small distance near the percieved endpoint of the scan, which is intended to be used to 
+// Basically the same as CheckScore, except that the values returned are just a heuristic approximation,
+// based on a small distance near the percieved endpoint of each scan, which is intended to be used to 
 // quickly cull out bad samples, without having to evaluate the entire trace.
 // The evaluation area is currently set at 3.5 grid squares before the endpoint to 3 grid squares past 
 // the endpoint. There is no special reason for these specific values, if you want to change them.
 //
-inline double QuickScore(TSense sense, int index, int sampleNum) 
+inline int QuickScore(TSense sense, int first, int sampleNum, double score[]) 
 {
-  double distance, eval;
+  double startx[SENSE_NUMBER], starty[SENSE_NUMBER], theta[SENSE_NUMBER], measured[SENSE_NUMBER], eval[SENSE_NUMBER];
+  int which[SENSE_NUMBER];
+  double distance;
+  int k, n, traced;
+
+  // Observations at maximum range aren't worth tracing, and get a score of 1. The rest are 
+  // gathered up to be traced together.
+  n = 0;
+  traced = 0;
+  for (k = first; k < SENSE_NUMBER; k += PASSES) {
+    score[n] = 1;
+    if (sense[k].distance < MAX_SENSE_RANGE) {
+      distance = MAX(0, sense[k].distance-3.5);
+      theta[traced] = sense[k].theta + newSample[sampleNum].theta;
+      startx[traced] = (int)(newSample[sampleNum].x + (cos(theta[traced]) * distance));
+      starty[traced] = (int)(newSample[sampleNum].y + (sin(theta[traced]) * distance));
+      measured[traced] = 3.5;
+      which[traced] = n;
+      traced++;
+    }
+    n++;
+  }
+
+  LowLineTraceBatch(traced, startx, starty, theta, measured, l_particle[ newSample[sampleNum].parent ].ancestryNode->ID, 3, eval);
+  for (k = 0; k < traced; k++)
+    score[which[k]] = MAX(MAX_TRACE_ERROR, eval[k]);
+  return n;
+}
+
+
+
+//
+// ScoreSample
+//
+// Performs a single pass of evaluation on one sample, as part of Localize. Samples which fell
+// below the threshold in the previous pass are culled instead. Each sample is only ever touched
+// by one worker, so this can be run on many samples at once.
+//
+static void ScoreSample(int i, int worker, void *arg)
+{
+  TPass *pass = (TPass *) arg;
+  double score[SENSE_NUMBER];
+  int k, n;
+
+  if (newSample[i].probability >= pass->threshold) {
+    if (pass->full)
+      n = CheckScore(pass->sense, pass->pass, i, score);
+    else
+      n = QuickScore(pass->sense, pass->pass, i, score);
+    for (k = 0; k < n; k++) 
+      newSample[i].probability = newSample[i].probability + ModelLog(score[k]); 
+    survivor[i] = 1;
+  }
+  else {
+    newSample[i].probability = WORST_POSSIBLE;
+    survivor[i] = 0;
+  }
+}
+
+
+
+//
+// BestSample
+//
+// Finds the most likely sample which survived the last pass, and counts how many survived.
+// This is done after all of the samples have been scored, in index order, so that the result
+// is the same no matter how many threads did the scoring.
+//
+static int BestSample(int *keepers)
+{
+  int i, best;
+
+  best = 0;
+  *keepers = 0;
+  for (i = 0; i < cur_samples_used; i++) 
+    if (survivor[i]) {
+      (*keepers)++;
+      if (newSample[i].probability > newSample[best].probability) 
+	best = i;
+    }
+  return best;
+}
+
+
+
+//
+// AddToBin
+//
+// Finds the pose bin of the given sample for KLD-sampling, marking it as being in use for this
+// iteration. Returns 1 if no earlier sample this iteration was in the same bin, and 0 otherwise.
+//
+static int AddToBin(TSample *sample)
+{
+  long long key;
+  int slot;
+
+  key = ((long long) floor(sample->x / KLD_XY_BIN) & 0x1fffff) << 42 |
+        ((long long) floor(sample->y / KLD_XY_BIN) & 0x1fffff) << 21 |
+        ((long long) floor(sample->theta / KLD_THETA_BIN) & 0x1fffff);
+  slot = (int) (((unsigned long long) key * 0x9E3779B97F4A7C15ULL) >> 40) & binMask;
+  while (binStamp[slot] == binEpoch) {
+    if (binKey[slot] == key)
+      return 0;
+    slot = (slot + 1) & binMask;
+  }
+  binStamp[slot] = binEpoch;
+  binKey[slot] = key;
+  return 1;
+}
+
+
+
+//
+// KLDBound
+//
+// The number of samples needed so that, if they occupy the given number of pose bins, the
+// Kullback-Leibler distance between the sampled distribution and the true one is at most KLD_EPSILON,
+// with probability 1-delta. This is the Wilson-Hilferty approximation of the chi-square quantile,
+// as given by Fox ("KLD-Sampling: Adaptive Particle Filters", NIPS 2001).
+//
+static int KLDBound(int bins)
+{
+  double a;
 
-  if (sense[index].distance >= MAX_SENSE_RANGE)
+  if (bins < 2)
     return 1;
+  a = 2.0 / (9.0 * (bins - 1));
+  return (int) ceil(((bins - 1) / (2.0 * KLD_EPSILON)) * pow(1.0 - a + (sqrt(a) * KLD_Z), 3));
+}
+
+
+
+//
+// MoveSample
+//
+// Moves sample i (counting from the first sample of the chunk in motion) from the pose of its parent 
+// (sampleParent[i]), according to the motion model, using the noise already drawn for it in motionNoise.
+// Each sample is only ever touched by one worker, so this can be run on many samples at once.
+//
+static void MoveSample(int n, int worker, void *arg)
+{
+  TMotion *motion = (TMotion *) arg;
+  double tempC, tempD;  // Temporary variables for the motion model. 
+  double moveAngle;
+  int i, j;
 
-  distance = MAX(0, sense[index].distance-3.5);
-  eval = LowLineTrace((int)(newSample[sampleNum].x + (cos(sense[index].theta + newSample[sampleNum].theta) * distance)),
-		      (int)(newSample[sampleNum].y + (sin(sense[index].theta + newSample[sampleNum].theta) * distance)),
-		      (sense[index].theta + newSample[sampleNum].theta), 
-		      3.5, l_particle[ newSample[sampleNum].parent ].ancestryNode->ID, 3);
-  return MAX(MAX_TRACE_ERROR, eval);
+  i = motion->first + n;
+  j = sampleParent[i];
+
+  // We make a sample entry. The first, most important value is which of the old particles 
+  // is this new sample's parent. This defines which map is being inherited, which will be
+  // used during localization to evaluate the "fitness" of that sample.
+  newSample[i].parent = j;
+  
+  // Randomly calculate the 'probable' trajectory, based on the movement model. The starting
+  // point is of course the position of the parent.
+  tempC = motion->CCenter + motionNoise[3*i]; // The amount of motion along the minor axis of motion
+  tempD = motion->DCenter + motionNoise[3*i+1]; // The amount of motion along the major axis of motion
+  // Record this actual motion. If we are using hierarchical SLAM, it will be used to keep track
+  // of the "corrected" motion of the robot, to define this step of the path.
+  newSample[i].C = tempC;
+  newSample[i].D = tempD;
+  newSample[i].T = motion->TCenter + motionNoise[3*i+2];
+  newSample[i].theta = l_particle[j].theta + newSample[i].T;
+
+  // Assuming that the robot turned continuously throughout the time step, the major direction
+  // of movement (D) should be the average of the starting angle and the final angle
+  moveAngle = (newSample[i].theta + l_particle[j].theta)/2.0;
+
+  // The first term is to correct for the LRF not being mounted on the pivot point of the robot's turns
+  // The second term is to allow for movement along the major axis of movement (D)
+  // The last term is movement perpendicular to the the major axis (C). We add pi/2 to give a consistent
+  // "positive" direction for this term. MeanC significantly shifted from 0 would mean that the robot
+  // has a distinct drift to one side.
+  newSample[i].x = l_particle[j].x + (TURN_RADIUS * (cos(newSample[i].theta) - cos(l_particle[j].theta))) +
+ 	               (tempD * cos(moveAngle)) + (tempC * cos(moveAngle + M_PI/2));
+  newSample[i].y = l_particle[j].y + (TURN_RADIUS * (sin(newSample[i].theta) - sin(l_particle[j].theta))) +
+ 	               (tempD * sin(moveAngle)) + (tempC * sin(moveAngle + M_PI/2));
+  newSample[i].probability = 0.0;
 }
 
 
@@ -200,15 +443,18 @@ inline double QuickScore(TSense sense, int index, int sampleNum)
 //
 void Localize(TSense sense)
 {
-  double ftemp; 
   double threshold;  // threshhold for discarding particles (in log prob.)
   double total; 
-  double turn, distance, moveAngle; // The incremental motion reported by the odometer
+  double turn, distance; // The incremental motion reported by the odometer
   double CCenter, DCenter, TCenter, CCoeff, DCoeff, TCoeff;
-  double tempC, tempD;  // Temporary variables for the motion model. 
+  double deviation[3];  // The standard deviations of the motion model, in the order of motionNoise
   int i, j, k, p, best;  // Incremental counters.
   int keepers = 0; // How many particles finish all rounds
-  int newchildren[SAMPLE_NUMBER]; // Used for resampling
+  int bins; // How many pose bins the samples fill, for KLD-sampling
+  int chunk, n, enough; // How many samples are drawn at a time, and whether there are enough of them yet
+  TStream order;
+  TMotion motion;
+  TPass pass;
   
   // Take the odometry readings from both this time step and the last, in order to figure out
   // the base level of incremental motion. Convert our measurements from meters and degrees 
@@ -248,45 +494,64 @@ void Localize(TSense sense)
   // To start this function, we have already determined which particles have been resampled, and 
   // how many times. What we still need to do is move them from their parent's position, according
   // to the motion model, so that we have the appropriate scatter.
+  // Iterate through each of the old particles, to see how many times it got resampled, and list
+  // it as the parent of a new sample for each time (possibly 0)
   i = 0;
-  // Iterate through each of the old particles, to see how many times it got resampled.
-  for (j = 0; j < PARTICLE_NUMBER; j++) {
-    // Now create a new sample for each time this particle got resampled (possibly 0)
-    for (k=0; k < children[j]; k++) {
-      // We make a sample entry. The first, most important value is which of the old particles 
-      // is this new sample's parent. This defines which map is being inherited, which will be
-      // used during localization to evaluate the "fitness" of that sample.
-      newSample[i].parent = j;
-      
-      // Randomly calculate the 'probable' trajectory, based on the movement model. The starting
-      // point is of course the position of the parent.
-      tempC = CCenter + GAUSSIAN(CCoeff); // The amount of motion along the minor axis of motion
-      tempD = DCenter + GAUSSIAN(DCoeff); // The amount of motion along the major axis of motion
-      // Record this actual motion. If we are using hierarchical SLAM, it will be used to keep track
-      // of the "corrected" motion of the robot, to define this step of the path.
-      newSample[i].C = tempC;
-      newSample[i].D = tempD;
-      newSample[i].T = TCenter + GAUSSIAN(TCoeff);
-      newSample[i].theta = l_particle[j].theta + newSample[i].T;
-
-      // Assuming that the robot turned continuously throughout the time step, the major direction
-      // of movement (D) should be the average of the starting angle and the final angle
-      moveAngle = (newSample[i].theta + l_particle[j].theta)/2.0;
-
-      // The first term is to correct for the LRF not being mounted on the pivot point of the robot's turns
-      // The second term is to allow for movement along the major axis of movement (D)
-      // The last term is movement perpendicular to the the major axis (C). We add pi/2 to give a consistent
-      // "positive" direction for this term. MeanC significantly shifted from 0 would mean that the robot
-      // has a distinct drift to one side.
-      newSample[i].x = l_particle[j].x + (TURN_RADIUS * (cos(newSample[i].theta) - cos(l_particle[j].theta))) +
- 	               (tempD * cos(moveAngle)) + (tempC * cos(moveAngle + M_PI/2));
-      newSample[i].y = l_particle[j].y + (TURN_RADIUS * (sin(newSample[i].theta) - sin(l_particle[j].theta))) +
- 	               (tempD * sin(moveAngle)) + (tempC * sin(moveAngle + M_PI/2));
-      newSample[i].probability = 0.0;
-      i++;
+  for (j = 0; j < PARTICLE_NUMBER; j++)
+    for (k=0; k < children[j]; k++) 
+      sampleParent[i++] = j;
+
+  // If the number of samples is adapted to their spread (KLD-sampling), they are generated in a random
+  // order, so that stopping early leaves a fair draw from all of the children.
+  if (MIN_SAMPLE_NUMBER < SAMPLE_NUMBER) {
+    OpenStream(&order, STREAM_LOW_ORDER, curGeneration, 0);
+    for (i = 0; i < SAMPLE_NUMBER; i++) {
+      k = i + (int) (StreamDec(&order) * (SAMPLE_NUMBER - i));
+      j = sampleParent[k];
+      sampleParent[k] = sampleParent[i];
+      sampleParent[i] = j;
     }
   }
 
+  // Draw the noise for the motion model and move the samples, a chunk at a time. The noise for each sample 
+  // is fixed by its place in the list, so the samples can be moved in any order, by any number of threads,
+  // and drawing them in chunks makes no difference to them. Without KLD-sampling, they are all done at once.
+  // With it, this stops as soon as there are enough samples for the number of pose bins that they fill (and
+  // at least MIN_SAMPLE_NUMBER of them), so that samples which wouldn't be kept are never drawn or moved.
+  deviation[0] = CCoeff;
+  deviation[1] = DCoeff;
+  deviation[2] = TCoeff;
+  motion.CCenter = CCenter;
+  motion.DCenter = DCenter;
+  motion.TCenter = TCenter;
+  chunk = SAMPLE_NUMBER;
+  if (MIN_SAMPLE_NUMBER < SAMPLE_NUMBER) {
+    chunk = KLD_CHUNK;
+    binEpoch++;
+  }
+  bins = 0;
+  enough = 0;
+  cur_samples_used = 0;
+  while ((!enough) && (cur_samples_used < SAMPLE_NUMBER)) {
+    motion.first = cur_samples_used;
+    n = MIN(chunk, SAMPLE_NUMBER - motion.first);
+    GaussianRange(motionNoise, 3*motion.first, 3*n, deviation, 3, STREAM_LOW_MOTION, curGeneration);
+    ParallelFor(n, MOVE_GRAIN, MoveSample, &motion);
+
+    for (i = motion.first; i < motion.first + n; i++) {
+      cur_samples_used = i+1;
+      if (MIN_SAMPLE_NUMBER < SAMPLE_NUMBER) {
+	bins = bins + AddToBin(&newSample[i]);
+	if ((cur_samples_used >= MIN_SAMPLE_NUMBER) && (cur_samples_used >= KLDBound(bins))) {
+	  enough = 1;
+	  break;
+	}
+      }
+    }
+  }
+  if (MIN_SAMPLE_NUMBER < SAMPLE_NUMBER)
+    fprintf(stderr, "Made %d (%d bins) ", cur_samples_used, bins);
+
   // Go through these particles in a number of passes, in order to find the best particles. This is
   // where we cull out obviously bad particles, by performing evaluation in a number of distinct
   // steps. At the end of each pass, we identify the probability of the most likely sample. Any sample
@@ -298,24 +563,20 @@ void Localize(TSense sense)
   // provide a good, quick heuristic for culling off bad samples, but should not be used for final
   // weights. Something which looks good in this scan can very easily turn out to be low probability
   // when the entire laser trace is considered.
+  // The samples within each pass are scored by ScoreSample, possibly spread across several threads.
+  pass.sense = sense;
+  pass.full = 0;
   threshold = WORST_POSSIBLE-1;  // ensures that we accept anything in 1st round
   for (p = 0; p < PASSES; p++){
-    best = 0;
-    for (i = 0; i < SAMPLE_NUMBER; i++) {
-      if (newSample[i].probability >= threshold) {
-	for (k = p; k < SENSE_NUMBER; k += PASSES) 
-	  newSample[i].probability = newSample[i].probability + log(QuickScore(sense, k, i)); 
-	if (newSample[i].probability > newSample[best].probability) 
-	  best = i;
-      }
-      else 
-	newSample[i].probability = WORST_POSSIBLE;
-    }
+    pass.pass = p;
+    pass.threshold = threshold;
+    ParallelFor(cur_samples_used, SCORE_GRAIN, ScoreSample, &pass);
+    best = BestSample(&keepers);
     threshold = newSample[best].probability - THRESH;
   }
 
   keepers = 0;
-  for (i = 0; i < SAMPLE_NUMBER; i++) {
+  for (i = 0; i < cur_samples_used; i++) {
     if (newSample[i].probability >= threshold) {
       keepers++;
       // Don't let this heuristic evaluation be included in the final eval.
@@ -332,21 +593,12 @@ void Localize(TSense sense)
   // Now reevaluate all of the surviving samples, using the full laser scan to look for possible
   // obstructions, in order to get the most accurate weights. While doing this evaluation, we can
   // still keep our eye out for unlikely samples before we are finished.
-  keepers = 0;
+  pass.full = 1;
   for (p = 0; p < PASSES; p++){
-    best = 0;
-    for (i = 0; i < SAMPLE_NUMBER; i++) {
-      if (newSample[i].probability >= threshold) {
-	if (p == PASSES -1)
-	  keepers++;
-	for (k = p; k < SENSE_NUMBER; k += PASSES) 
-	  newSample[i].probability = newSample[i].probability + log(CheckScore(sense, k, i)); 
-	if (newSample[i].probability > newSample[best].probability) 
-	  best = i;
-      }
-      else 
-	newSample[i].probability = WORST_POSSIBLE;
-    }
+    pass.pass = p;
+    pass.threshold = threshold;
+    ParallelFor(cur_samples_used, SCORE_GRAIN, ScoreSample, &pass);
+    best = BestSample(&keepers);
     threshold = newSample[best].probability - THRESH; 
   }
 
@@ -359,7 +611,7 @@ void Localize(TSense sense)
   // numbers.
   total = 0.0;
   threshold = newSample[best].probability;
-  for (i = 0; i < SAMPLE_NUMBER; i++) {
+  for (i = 0; i < cur_samples_used; i++) {
     // If the sample was culled, it has a weight of 0
     if (newSample[i].probability == WORST_POSSIBLE)
       newSample[i].probability = 0.0;
@@ -370,30 +622,23 @@ void Localize(TSense sense)
   }
 
   // Renormalize to ensure that the total probability is now equal to 1.
-  for (i=0; i < SAMPLE_NUMBER; i++)
+  for (i=0; i < cur_samples_used; i++)
     newSample[i].probability = newSample[i].probability/total;
 
-  total = 0.0;
   // Count how many children each particle will get in next generation
   // This is done through random resampling.
-  for (i = 0; i < SAMPLE_NUMBER; i++) {
+  for (i = 0; i < cur_samples_used; i++) {
     newchildren[i] = 0;
-    total = total + newSample[i].probability;
+    lowResampler.weight[i] = newSample[i].probability;
   }
 
-  i = j = 0;  // i = no. of survivors, j = no. of new samples
-  while ((j < SAMPLE_NUMBER) && (i < PARTICLE_NUMBER)) {
-    k = 0;
-    ftemp = MTrandDec()*total;
-    while (ftemp > (newSample[k].probability)) {
-      ftemp = ftemp - newSample[k].probability;
-      k++;
-    }    
-    if (newchildren[k] == 0)
+  // j = no. of new samples, i = no. of survivors
+  OpenStream(&lowResampler.stream, STREAM_LOW_RESAMPLE, curGeneration, 0);
+  j = Resample(&lowResampler, cur_samples_used, SAMPLE_NUMBER, PARTICLE_NUMBER, newchildren);
+  i = 0;
+  for (k = 0; k < cur_samples_used; k++)
+    if (newchildren[k] > 0)
       i++;
-    newchildren[k]++;
-    j++;
-  }
 
   // Report exactly how many samples are kept as particles, since they were actually
   // resampled.
@@ -409,7 +654,7 @@ void Localize(TSense sense)
   // Now copy over new particles to savedParticles
   best = 0;
   k = 0; // pointer into saved particles
-  for (i = 0; i < SAMPLE_NUMBER; i++)
+  for (i = 0; i < cur_samples_used; i++)
     if (newchildren[i] > 0) {
       savedParticle[k].probability = newSample[i].probability;
       savedParticle[k].x = newSample[i].x;
@@ -444,66 +689,16 @@ void Localize(TSense sense)
     for (i=0; i < cur_saved_particles_used; i++)
       savedParticle[i].probability = savedParticle[i].probability/total;
 
-    total = 0.0;
     for (i = 0; i < cur_saved_particles_used; i++) 
-      total = total + savedParticle[i].probability;
-
-    while (j < SAMPLE_NUMBER) {
-      k = 0;
-      ftemp = MTrandDec()*total;
-      while (ftemp > (savedParticle[k].probability)) {
-	ftemp = ftemp - savedParticle[k].probability;
-	k++;
-      }    
-      children[k]++;
-
-      j++;
-    }
+      lowResampler.weight[i] = savedParticle[i].probability;
+    Resample(&lowResampler, cur_saved_particles_used, SAMPLE_NUMBER - j, 0, children);
   }
 
   // Some useful information concerning the current generation of particles, and the parameters for the best one.
   fprintf(stderr, "-- %.3d (%.4f, %.4f, %.4f) : %.4f\n", curGeneration, savedParticle[best].x, savedParticle[best].y, 
 	  savedParticle[best].theta, savedParticle[best].probability);
-}
-
-
-
-//
-// DisposeAncestry
-//
-// When the SLAM process is complete, this function will clean up the memory being used by the ancestry
-// tree, and remove all of the associated entries from the low level map.
-//
-void DisposeAncestry(TAncestor particleID[]) 
-{
-  int i, j;
-  TPath *tempPath, *trashPath;
-  TEntryList *entry;
-
-  for (i = 0; i < ID_NUMBER; i++) {
-    if (particleID[i].ID == i) {
-      // Free up memory
-      entry = particleID[i].mapEntries;
-      for (j=0; j < particleID[i].total; j++)
-	LowDeleteObservation(entry[j].x, entry[j].y, entry[j].node);
-      free(entry);
-      particleID[i].mapEntries = NULL;
-      
-      tempPath = particleID[i].path;
-      while (tempPath != NULL) {
-	trashPath = tempPath;
-	tempPath = tempPath->next;
-	free(trashPath);
-      }
-      particleID[i].path = NULL;
-
-      particleID[i].ID = -123;
-    }
-
-    for (cleanID=0; cleanID < ID_NUMBER; cleanID++)
-      availableID[cleanID] = cleanID;
-    cleanID = ID_NUMBER;
-  }
+  if (POSE_LOG != NULL)
+    fprintf(POSE_LOG, "%d %.6f %.6f %.6f\n", curGeneration, savedParticle[best].x, savedParticle[best].y, savedParticle[best].theta);
 }
 
 
@@ -525,266 +720,31 @@ void DisposeAncestry(TAncestor particleID[])
 // d) Update the map for each new particle. We needed to wait until they were added into the tree, so that
 //    the ancestry tree can keep track of the different observations associated with the particle.
 //
-void UpdateAncestry(TSense sense, TAncestor particleID[])
+void UpdateAncestry(TSense sense)
 {
-  int i, j;
-  TAncestor *temp, *hold, *parentNode;
-  TEntryList *entry, *workArray;
-  TMapStarter *node;
-  TPath *tempPath, *trashPath;
-
-  // Remove Dead Nodes - 
-  // Go through the current particle array, and prune out all particles that did not spawn any particles. We know that the particle
-  // had to spawn samples, but those samples may not have become particles themselves, through not generating any samples for the 
-  // next generation. Recurse up through there.
-  for (i=0; i < l_cur_particles_used; i++) {
-    temp = l_particle[i].ancestryNode;
-
-    // This is a "while" loop for purposes of recursing up the tree.
-    while (temp->numChildren == 0) {
-      // Free up the memory in the map by deleting the associated observations.
-      for (j=0; j < temp->total; j++) 
-	LowDeleteObservation(temp->mapEntries[j].x, temp->mapEntries[j].y, temp->mapEntries[j].node);
-
-      // Get rid of the memory being used by this ancestor
-      free(temp->mapEntries);
-      temp->mapEntries = NULL;
-
-      // This is used exclusively for the low level in hierarchical SLAM. 
-      // Get rid of the hypothesized path that this ancestor used.
-      tempPath = temp->path;
-      while (tempPath != NULL) {
-	trashPath = tempPath;
-	tempPath = tempPath->next;
-	free(trashPath);
-      }
-      temp->path = NULL;
-
-      // Recover the ID, so that it can be used later.
-      cleanID++;
-      availableID[cleanID] = temp->ID;
-      temp->generation = curGeneration;
-      temp->ID = -42;
-
-      // Remove this node from the tree, while keeping track of its parent. We need that for recursing
-      // up the tree (its parent could possibly need to be removed itself, now)
-      hold = temp;
-      temp = temp->parent;
-      hold->parent = NULL;
-
-      // Note the disappearance of this particle (may cause telescoping of particles, or outright deletion)
-      temp->numChildren--;
-    }
-  }
-
-  // Collapse Branches -
-  // Run through the particle IDs, checking for those node IDs that are currently in use. Essentially is 
-  // an easy way to pass through the entire tree.  If the node is in use, look at its parent.
-  // If the parent has only one child, give all of the altered map squares of the parent to the child, 
-  // and dispose of the parent. This collapses those ancestor nodes which have a branching factor of only one.
-  for (i = 0; i < ID_NUMBER-1; i++) {
-    // These booleans mean (in order) that the ID is in use, it has a parent (ie is not the root of the ancestry tree),
-    // and that its parent has only one child (which is necessarily this ID) 
-    if ((particleID[i].ID == i) && (particleID[i].parent != NULL) && (particleID[i].parent->numChildren == 1)) {
-      // This is a special value for redirections. If the node's parent has already participated in a collapse
-      // during this generation, then that node has already been removed from the tree, and we need to go up
-      // one more step in the tree. 
-      while (particleID[i].parent->generation == -111)
-	particleID[i].parent = particleID[i].parent->parent;
-
-      parentNode = particleID[i].parent;
-
-      // Check to make sure that the parent's array is large enough to accomadate all of the entries of the child
-      // in addition to its own. If not, we need to increase the dynamic array.
-      if (parentNode->size < (parentNode->total + particleID[i].total)) {
-	parentNode->size = (int)(ceil((parentNode->size + particleID[i].size)*1.75));
-	workArray = (TEntryList *)malloc(sizeof(TEntryList)*parentNode->size);
-	if (workArray == NULL) fprintf(stderr, "Malloc failed for workArray\n");
-
-	for (j=0; j < parentNode->total; j++) {
-	  workArray[j].x = parentNode->mapEntries[j].x;
-	  workArray[j].y = parentNode->mapEntries[j].y;
-	  workArray[j].node = parentNode->mapEntries[j].node;
-	}
-	// Note that parentNode->total hasn't changed- that will grow as the child's entries are added in
-	free(parentNode->mapEntries);
-	parentNode->mapEntries = workArray;
-      }
-
-      // Change all map entries of the parent to have the ID of the child
-      // Also check to see if this entry supercedes an entry currently attributed to the parent.
-      // Since collapses can merge all of the entries between the parent and the current child into the parent, this check is performed
-      // by comparing to see if the generation of the last observation (before the child's update) is at least as recent as parent's
-      // generation. If so, note that there is another "dead" entry in the observation array. It will be cleaned up later. If this puts
-      // the total number of used slot, minus the number of "dead", below the threshold, shrink the array (which cleans up the dead)
-      entry = particleID[i].mapEntries;
-      for (j=0; j < particleID[i].total; j++) {
-	node = lowMap[entry[j].x][entry[j].y];
-
-	// Change the ID
-	node->array[entry[j].node].ID = parentNode->ID;
-	node->array[entry[j].node].source = parentNode->total;
-
-	parentNode->mapEntries[parentNode->total].x = entry[j].x;
-	parentNode->mapEntries[parentNode->total].y = entry[j].y;
-	parentNode->mapEntries[parentNode->total].node = entry[j].node;
-	parentNode->total++;
-
-	// Check for pre-existing observation in the parent's list
-	if (node->array[entry[j].node].parentGen >= parentNode->generation) {
-	  node->array[entry[j].node].parentGen = -1;
-	  node->dead++;
-	}
-      }
-
-      // We do this in a second pass for a good reason. If there are more than one update for a given grid square which uses the child's
-      // ID (as a consequence of an earlier collapse), then we want to make certain that the resizing doesn't take place until after all
-      // entries have changed their ID appropriately.
-      for (j=0; j < particleID[i].total; j++) {
-	node = lowMap[entry[j].x][entry[j].y];
-	if ((node->total - node->dead)*2.5 < node->size) 
-	  LowResizeArray(node, -7);
-      }
-
-      // We're done with it- remove the array of updates from the child.
-      free(particleID[i].mapEntries);
-      particleID[i].mapEntries = NULL;
-
-      // Inherit the path
-      tempPath = parentNode->path;
-      while (tempPath->next != NULL) 
-	tempPath = tempPath->next;
-      tempPath->next = particleID[i].path;
-      particleID[i].path = NULL;
-
-      // Inherit the number of children
-      parentNode->numChildren = particleID[i].numChildren;
-
-      // Subtlety of the ancestry tree: since we only keep pointers up to the parent, we can't exactly change all of the
-      // descendents of the child to now point to the parent. What we can do, however, is mark the change for later, and
-      // update all of the ancestor particles in a single go, later. That will take a single O(P) pass
-      particleID[i].generation = -111;
-    }
-  }
-
-  // This is the step where we correct for redirections that arise from the collapse of a branch of the ancestry tree
-  for (i=0; i < ID_NUMBER-1; i++) 
-    if (particleID[i].ID == i) {
-      while (particleID[i].parent->generation == -111) 
-	particleID[i].parent = particleID[i].parent->parent;
-    }
+  // Remove dead nodes, and collapse branches with only one child (see level.h).
+  PruneAncestry<TLowLevel>(curGeneration);
+  CollapseAncestry<TLowLevel>();
 
   // Wipe the slate clean, so that we don't get confused by the mechinations of the previous changes
   // from deletes and merges. Updates can make thier own tables, as needed.
-  LowInitializeFlags();
-
+  // If the observation cache is being kept, the changes have already fixed or thrown out the entries
+  // that they affect, and it only needs to learn about the new particles.
+  if (!KEEP_OBSERVATIONS)
+    LowInitializeFlags();
 
   // Add the current savedParticles into the ancestry tree, and copy them over into the 'real' particle array
-  j = 0;
-  for (i = 0; i < cur_saved_particles_used; i++) {
-    // Check for redirection of parent pointers due to collapsing of branches (see above)
-    while (savedParticle[i].ancestryNode->generation == -111) 
-      savedParticle[i].ancestryNode = savedParticle[i].ancestryNode->parent;
-
-    // A saved particle has ancestryNode denote the parent particle for that saved particle
-    // If that parent has only this one child, due to resampling, then we want to perform a collapse
-    // of the branch, but it hasn't been done yet, because the savedParticle hasn't been entered into
-    // the tree yet. Therefore, we just designate the parent as the "new" entry for this savedParticle.
-    // We then update the already created ancestry node as if it were the new node.
-    if (savedParticle[i].ancestryNode->numChildren == 1) {
-      // Change the generation of the node
-      savedParticle[i].ancestryNode->generation = curGeneration;
-      // Now that it represents the new node as well, it no longer is considered to have children.
-      savedParticle[i].ancestryNode->numChildren = 0;
-      // We're copying the savedParticles to the main particle array
-      l_particle[j].ancestryNode = savedParticle[i].ancestryNode;
-
-      // Add a new entry to the path of the ancestor node.
-      trashPath = (TPath *)malloc(sizeof(TPath));
-      trashPath->C = savedParticle[i].C;
-      trashPath->D = savedParticle[i].D;
-      trashPath->T = savedParticle[i].T;
-      trashPath->next = NULL;
-      tempPath = l_particle[i].ancestryNode->path;
-      while (tempPath->next != NULL)
-	tempPath = tempPath->next;
-      tempPath->next = trashPath;
-
-      l_particle[j].x = savedParticle[i].x;
-      l_particle[j].y = savedParticle[i].y;
-      l_particle[j].theta = savedParticle[i].theta;
-      l_particle[j].probability = savedParticle[i].probability;
-      j++;
-    }
-
-    // IF the parent has multiple children, then each child needs its own new ancestor node in the tree
-    else if (savedParticle[i].ancestryNode->numChildren > 0) {
-      // Find a new entry in the array of ancestor nodes. This is done by taking an unused ID off of the
-      // stack, and using that slot. 
-      temp = &(particleID[ availableID[cleanID] ]);
-      temp->ID = availableID[cleanID];
-      // That ID on the top of the stack is now being used.
-      cleanID--;
-
-      if (cleanID < 0) {
-	fprintf(stderr, " !!! Insufficient Number of Particle IDs : Abandon Ship !!!\n");
-	cleanID = 0;
-      }
-
-      // This new node needs to have its info filled in
-      temp->parent = savedParticle[i].ancestryNode;
-      // No updates to the map have been made yet for this node
-      temp->mapEntries = NULL;
-      temp->total = 0;
-      temp->size = 0;
-      // The generation of this node is important for collapsing branches of the tree. See above.
-      temp->generation = curGeneration;
-      temp->numChildren = 0;
-      temp->seen = 0;
-
-      // This is where we add a new entry to this node's hypothesized path for the robot
-      trashPath = (TPath *)malloc(sizeof(TPath));
-      trashPath->C = savedParticle[i].C;
-      trashPath->D = savedParticle[i].D;
-      trashPath->T = savedParticle[i].T;
-      trashPath->next = NULL;
-      temp->path = trashPath;
-
-      // Transfer this entry over to the main particle array
-      l_particle[j].ancestryNode = temp;
-      l_particle[j].x = savedParticle[i].x;
-      l_particle[j].y = savedParticle[i].y;
-      l_particle[j].theta = savedParticle[i].theta;
-      l_particle[j].probability = savedParticle[i].probability;
-      j++;
-    }
-  }
-
-  l_cur_particles_used = cur_saved_particles_used;
+  AddSavedParticles<TLowLevel>(savedParticle, cur_saved_particles_used, curGeneration);
+  if (KEEP_OBSERVATIONS)
+    LowRefreshObservations();
 
   // Here's where we actually go through and update the map for each particle. We had to wait
   // until now, so that the appropriate structures in the ancestry had been created and updated.
-  for (i=0; i < l_cur_particles_used; i++) 
-    AddToWorldModel(sense, i);
+  LowInsertScans(sense, l_cur_particles_used);
 
   // Clean up the ancestry particles which disappeared in branch collapses. Also, recover their IDs.
   // We waited until now because we needed to allow for redirection of parents.
-  for (i=0; i < ID_NUMBER-1; i++) 
-    if (particleID[i].generation == -111) {
-      particleID[i].generation = -1;
-      particleID[i].numChildren = 0;
-      particleID[i].parent = NULL;
-      particleID[i].mapEntries = NULL;
-      particleID[i].path = NULL;
-      particleID[i].seen = 0;
-      particleID[i].total = 0;
-      particleID[i].size = 0;
-
-      // Recover the ID. 
-      cleanID++;
-      availableID[cleanID] = i;
-      particleID[i].ID = -3;
-    }
+  RecoverCollapsed<TLowLevel>();
 }
 
 
@@ -793,101 +753,124 @@ void UpdateAncestry(TSense sense, TAncestor particleID[])
 // ReadLog
 //
 // Reads back into the sensor data structures the raw readings that were stored to file by WriteLog (above)
-// Reads a single line from the file, and interprets it by its delineator (either Laser or Odometry). If the line
-// is not delineated for some reason, the function prints out an error message, and advances to the next line.
+// Takes a single line of a text log, already interpreted by the reader thread (see reader.h), or a single
+// record from a binary log.
 // While there is still information in the file, it will return 0. When it reaches the end of the file, it will return 1.
 //
 int ReadLog(FILE *logFile, TSense &sense, int &continueSlam) {
-  int i, max;
-  char line[4096];
+  const TBinRecord *record;
+  const TLogRecord *line;
+  const float *range;
+  int i, count;
+
+  if (FILE_FORMAT == BIN) {
+    record = NextBinRecord(&binLog);
+    if (record == NULL) {
+      fprintf(stderr, "End of Log File.\n");
+      continueSlam = 0;
+      return 1;
+    }
+    // The readings are taken straight from the mapped file.
+    if (record->kind == BINLOG_ODOMETRY) {
+      odometry.x = BinOdometry(record)[0];
+      odometry.y = BinOdometry(record)[1];
+      odometry.theta = BinOdometry(record)[2];
+    }
+    else if (record->kind == BINLOG_LASER) {
+      range = BinRanges(record);
+      count = MIN(record->count, SENSE_NUMBER);
+      for (i = 0; i < count; i++)
+	sense[i].distance = range[i];
+    }
+    return 0;
+  }
 
-  if (fgets(line, 4096, logFile) == NULL) {
+  line = TakeLogRecord();
+  if (line == NULL) {
     fprintf(stderr, "End of Log File.\n");
     continueSlam = 0;
     return 1;
   }
+  if (line->kind == BINLOG_ODOMETRY) {
+    odometry.x = line->pose[0];
+    odometry.y = line->pose[1];
+    odometry.theta = line->pose[2];
+  }
+  else if (line->kind == BINLOG_LASER) 
+    for (i = 0; i < line->count; i++)
+      sense[i].distance = line->range[i];
+  ReleaseLogRecord();
+  return 0;
+}
 
-  if (FILE_FORMAT == REC) {
-    if (!strncmp(line, "POS", 3)) {
-      strtok(line, " ");   // This is to remove the keyword
-      strtok(NULL, " ");   // Second item is the time of the reading, in seconds. We don't care.
-      strtok(NULL, " ");   // Third item is the usecs of the time. We still don't care.
-      // Read x and y coordinates, and convert them from cm to m. 
-      odometry.x = atof(strtok(NULL, " "))/100.0;
-      odometry.y = atof(strtok(NULL, " "))/100.0;
-      // Read the facing angle of the robot, and convert from deg to rad
-      odometry.theta = atof(strtok(NULL, " "))*M_PI/180.0;
-
-      if (odometry.theta > M_PI) 
-	odometry.theta = odometry.theta - 2*M_PI;
-      else if (odometry.theta < -M_PI) 
-	odometry.theta = odometry.theta + 2*M_PI;
-
-      odometry.x = odometry.x - (cos(odometry.theta)*TURN_RADIUS/MAP_SCALE);
-      odometry.y = odometry.y - (sin(odometry.theta)*TURN_RADIUS/MAP_SCALE);
-      // There are still two parameters here, pitch and yaw, as far as i can tell, but we don't use them. 
-      // I don't think we have any maps to use that even let those two change.
-    }
-    // Apparently this is also sometimes recorded as 'LASER_RANGE'
-    // We accept anything that starts with LASER
-    else if (!strncmp(line, "LASER", 5)) {
-      strtok(line, " ");   // This is to remove the keyword
-      strtok(NULL, " ");   // Second item is the time of the reading, in seconds. We don't care.
-      strtok(NULL, " ");   // Third item is the usecs of the time. We still don't care.
-      i = (int) (atof(strtok(NULL, " ")));   // This item is the laser ID.
-      // We only use the first laser. This can be changed in hard code, but it is rare that
-      // we will try to use anything with multiple lasers. It's just in case.
-      if (i != 0)
-	return 0;
-
-      // Here we are reading in the total number of laser readings that will follow. This is usually 180 with
-      // SICK lasers.
-      max = (int) (atof(strtok(NULL, " ")));
-      if (max > SENSE_NUMBER)
-	max = SENSE_NUMBER;
-      // In theory, i don't think that this next item is supposed to be here, but in the Wean Hall data,
-      // i noticed this consistent term of "180.0:" which doesn't seem to mean anything pertinent. I hope.
-      strtok(NULL, " ");
-      
-      // Now read in the whole list of laser readings. Remember that they are in cm, so translating them to
-      // MAP_SCALE takes an extra 1/100
-      for (i = 0; i < max; i++) {
-	sense[i].distance = atof(strtok(NULL, " "))*MAP_SCALE/100.0;
-	if (sense[i].distance > MAX_SENSE_RANGE)
-	  sense[i].distance = MAX_SENSE_RANGE;
-      }
-    }
-    else 
-      fprintf(stderr, "Uninterpretable Line (.rec) : \n %s\n", line);
+
+
+//
+// LogFormat
+//
+// Works out the format of the named data log: binary, .rec, or otherwise our native .log files.
+//
+static int LogFormat(char *name)
+{
+  if (IsBinLog(name))
+    return BIN;
+  if ((strlen(name) >= 3) && (strncmp(&name[strlen(name)-3], "rec", 3) == 0))
+    return REC;
+  return LOG;
+}
+
+
+
+//
+// ConvertLog
+//
+// Converts the text data log from (.log or .rec) into a binary log, to (see binlog.h).
+// Returns -1 if it couldn't be done.
+//
+int ConvertLog(char *from, char *to)
+{
+  TBinLogWriter writer;
+  TLogRecord record;
+  FILE *logFile;
+  float range[SENSE_NUMBER];
+  char line[4096];
+  int i, result;
+
+  FILE_FORMAT = LogFormat(from);
+  if (FILE_FORMAT == BIN) {
+    fprintf(stderr, "%s is already a binary log\n", from);
+    return -1;
+  }
+  logFile = fopen(from, "r");
+  if (logFile == NULL) {
+    fprintf(stderr, "Unable to open the data log %s\n", from);
+    return -1;
+  }
+  if (BeginBinLog(&writer, to, SENSE_NUMBER) == -1) {
+    fclose(logFile);
+    return -1;
   }
 
-  // Anything not specified is assumed to our native .log files.
-  else {
-    if (!strncmp(line, "Odometry", 8)) {
-      strtok(line, " ");
-      odometry.x = atof(strtok(NULL, " "));
-      odometry.y = atof(strtok(NULL, " "));
-      odometry.theta = atof(strtok(NULL, " "));
-
-      if (odometry.theta > M_PI) 
-	odometry.theta = odometry.theta - 2*M_PI;
-      else if (odometry.theta < -M_PI) 
-	odometry.theta = odometry.theta + 2*M_PI;
-    }
-    else if (!strncmp(line, "Laser", 5)) {
-      strtok(line, " ");
-      max = (int) (atof(strtok(NULL, " ")));
-      if (max > SENSE_NUMBER)
-	max = SENSE_NUMBER;
-      for (i = 0; i < max; i++) {
-	sense[i].distance = atof(strtok(NULL, " "))*MAP_SCALE;
-      }
+  result = 0;
+  while ((result == 0) && (fgets(line, 4096, logFile) != NULL)) {
+    ParseLogLine(line, FILE_FORMAT, &record);
+    if (record.kind == BINLOG_ODOMETRY) 
+      result = AddBinRecord(&writer, record.kind, 0, record.pose);
+    else if (record.kind == BINLOG_LASER) {
+      for (i = 0; i < record.count; i++)
+	range[i] = record.range[i];
+      result = AddBinRecord(&writer, record.kind, record.count, range);
     }
-    else 
-      fprintf(stderr, "Uninterpretable Line : \n %s\n", line);
+    else
+      result = AddBinRecord(&writer, record.kind, 0, NULL);
   }
+  fclose(logFile);
 
-  return 0;
+  if (EndBinLog(&writer) == -1)
+    result = -1;
+  if (result == 0)
+    fprintf(stderr, "Converted %s into %lld records in %s\n", from, writer.header.records, to);
+  return result;
 }
 
 
@@ -904,112 +887,78 @@ int ReadLog(FILE *logFile, TSense &sense, int &continueSlam) {
 //
 void PrintMap(char *name, TAncestor *parent, int particles, double overlayX, double overlayY, double overlayTheta)
 {
-  FILE *printFile;
   int x, y, i;
-  int width, height;
-  int startx, starty, lastx, lasty;
-  char sysCall[128];
-  double hit, theta;
-
-  width = MAP_WIDTH;
-  height = MAP_HEIGHT;
-
-  for(x=0; x < width; x++)
-    for(y=0; y<height; y++)
-      map[x][y] = 0;
-
-  lastx = 0;
-  lasty = 0;
-  startx = width-1;
-  starty = height-1;
-
-  for (x = 0; x < width; x++) 
-    for (y = 0; y < height; y++) {
-      // The density of each grid square is reported, assuming a full diagonaly traversal of the square.
-      // This gives good contrast.
-      hit = LowComputeProb(x, y, 1.4, parent->ID);
-      // All unknown areas are the same color. You can specify what color that is later
-      if (hit == UNKNOWN) 
-	map[x][y] = 255;
-      else {
-	// This specifies the range of grey values for the different squares in the map. Black is occupied.
-	map[x][y] = (int) (230 - (hit * 230));
-	// This allows us to only print out those sections of the map where there is something interesting happening.
-	if (x > lastx)
-	  lastx = x;
-	if (y > lasty)
-	  lasty = y;
-	if (x < startx)
-	  startx = x;
-	if (y < starty)
-	  starty = y;
-      }
-    }
+  unsigned char **shade;
+  unsigned char *image, *pixel;
+  double theta;
+
+  // The density of each grid square is reported, assuming a full diagonaly traversal of the square.
+  // This gives good contrast. All unknown areas are the same color (255), and the rest get a range of 
+  // grey values, black being occupied. We also find the area that has been observed, so that we only 
+  // print out those sections of the map where there is something interesting happening. Anything drawn
+  // over the map below is left off if it falls outside of that area.
+  LowRenderMap(parent, 1.4, &map);
+  shade = map.shade;
 
   // If the command was given to print out the set of particles on the map, that's done here.
   if (particles) 
     for (i = 0; i < l_cur_particles_used; i++) 
-      if ((l_particle[i].x > 0) && (l_particle[i].x < MAP_WIDTH) && (l_particle[i].y > 0) && (l_particle[i].y < MAP_HEIGHT))
-	map[(int) (l_particle[i].x)][(int) (l_particle[i].y)] = 254;
+      if (InCanvas(&map, (int) (l_particle[i].x), (int) (l_particle[i].y)))
+	shade[(int) (l_particle[i].x) - map.x][(int) (l_particle[i].y) - map.y] = 254;
 
   // And this is where the endpoints of the current scan are visualized, if requested.
   if (overlayX != -1) {
-    map[(int) (overlayX)][(int) (overlayY)] = 254;
+    if (InCanvas(&map, (int) (overlayX), (int) (overlayY)))
+      shade[(int) (overlayX) - map.x][(int) (overlayY) - map.y] = 254;
     for (i = 0; i < SENSE_NUMBER; i++) {
       theta = overlayTheta + sense[i].theta;
       x = (int) (overlayX + (cos(theta) * sense[i].distance));
       y = (int) (overlayY + (sin(theta) * sense[i].distance));
+      if (!InCanvas(&map, x, y))
+	continue;
+      x = x - map.x;
+      y = y - map.y;
 
-      if ((map[x][y] < 250) || (map[x][y] == 255)) {
+      if ((shade[x][y] < 250) || (shade[x][y] == 255)) {
 	if (sense[i].distance < MAX_SENSE_RANGE) {
-	  if (map[x][y] < 200)
-	    map[x][y] = 251;
+	  if (shade[x][y] < 200)
+	    shade[x][y] = 251;
 	  else 
-	    map[x][y] = 252;
+	    shade[x][y] = 252;
 	}
 	else
-	  map[x][y] = 253;
+	  shade[x][y] = 253;
       }
     }
   }
 
 
-  // Header file for a ppm
-  sprintf(sysCall, "%s.ppm", name);
-  printFile = fopen(sysCall, "w");
-  fprintf(printFile, "P6\n # particles.ppm \n %d %d\n",
-	  lastx-startx+1, lasty-starty+1);
-  fprintf(printFile, "255\n");
-
-  // And this is where we finally print out the map to file. Note that there are number of special
-  // values which could have been specified, which get special, non-greyscale values. Really,
-  // you can play with those colors to your aesthetics.
-  for (y = lasty; y >= starty; y--) 
-    for (x = startx; x <= lastx; x++) {
-      if (map[x][y] == 254) 
-	fprintf(printFile, "%c%c%c", 255, 0, 0);
-      else if (map[x][y] == 253) 
-	fprintf(printFile, "%c%c%c", 0, 255, 200);
-      else if (map[x][y] == 252) 
-	fprintf(printFile, "%c%c%c", 255, 55, 55);
-      else if (map[x][y] == 251) 
-	fprintf(printFile, "%c%c%c", 50, 150, 255);
-      else if (map[x][y] == 250) 
-	fprintf(printFile, "%c%c%c", 250, 200, 200);
-      else if (map[x][y] == 0) 
-	fprintf(printFile, "%c%c%c", 100, 250, 100);
+  // And this is where we finally draw the map. Note that there are number of special values which could 
+  // have been specified, which get special, non-greyscale values. Really, you can play with those colors 
+  // to your aesthetics.
+  image = NewImage(map.width, map.height);
+  pixel = image;
+  for (y = map.height-1; y >= 0; y--) 
+    for (x = 0; x < map.width; x++, pixel += 3) {
+      if (shade[x][y] == 254) 
+	SetPixel(pixel, 255, 0, 0);
+      else if (shade[x][y] == 253) 
+	SetPixel(pixel, 0, 255, 200);
+      else if (shade[x][y] == 252) 
+	SetPixel(pixel, 255, 55, 55);
+      else if (shade[x][y] == 251) 
+	SetPixel(pixel, 50, 150, 255);
+      else if (shade[x][y] == 250) 
+	SetPixel(pixel, 250, 200, 200);
+      else if (shade[x][y] == 0) 
+	SetPixel(pixel, 100, 250, 100);
       else
-	fprintf(printFile, "%c%c%c", map[x][y], map[x][y], map[x][y]);
+	SetPixel(pixel, shade[x][y], shade[x][y], shade[x][y]);
     }
       
-  // We're finished making the ppm file, and now convert it to png, for compressed storage and easy viewing.
-  fclose(printFile);
-  sprintf(sysCall, "convert %s.ppm %s.png", name, name);
-  system(sysCall);
-  sprintf(sysCall, "chmod 666 %s.ppm", name);
-  system(sysCall);
-  sprintf(sysCall, "chmod 666 %s.png", name);
-  system(sysCall);
+  // The image is written out (as a png, for compressed storage and easy viewing) by the image writer thread,
+  // so that we can get right back to work.
+  SaveImage(name, image, map.width, map.height);
   fprintf(stderr, "Map dumped to file\n");
 }
 
@@ -1021,16 +970,54 @@ void PrintMap(char *name, TAncestor *parent, int particles, double overlayX, dou
 void InitLowSlam()
 {
   int i, j;
-  char name[32];
+
+  // Now that the sizes are known, make room for the map, the particles and the samples.
+  LowAllocateMap();
+  availableID = (int *) malloc(ID_NUMBER * sizeof(int));
+  newSample = (TSample *) malloc(SAMPLE_NUMBER * sizeof(TSample));
+  survivor = (char *) malloc(SAMPLE_NUMBER * sizeof(char));
+  sampleParent = (int *) malloc(SAMPLE_NUMBER * sizeof(int));
+  newchildren = (int *) malloc(SAMPLE_NUMBER * sizeof(int));
+  motionNoise = (double *) malloc(3 * SAMPLE_NUMBER * sizeof(double));
+  children = (int *) malloc(PARTICLE_NUMBER * sizeof(int));
+  savedParticle = (TParticle *) malloc(PARTICLE_NUMBER * sizeof(TParticle));
+  InitMapCanvas(&map, MAP_WIDTH, MAP_HEIGHT);
+  // The table of pose bins is kept at most half full
+  for (binMask = 1; binMask < 2*SAMPLE_NUMBER; binMask = binMask*2)
+    ;
+  binKey = (long long *) malloc(binMask * sizeof(long long));
+  binStamp = (int *) calloc(binMask, sizeof(int));
+  binMask = binMask - 1;
+  binEpoch = 0;
+  if ((availableID == NULL) || (newSample == NULL) || (survivor == NULL) || (sampleParent == NULL) || (newchildren == NULL) || (motionNoise == NULL) || (children == NULL) || 
+      (savedParticle == NULL) || (binKey == NULL) || (binStamp == NULL)) {
+    fprintf(stderr, "Unable to allocate the particles for the low level.\n");
+    exit(-1);
+  }
+  if (InitResampler(&lowResampler, RESAMPLER, RESAMPLE_ESS, SAMPLE_NUMBER) < 0)
+    exit(-1);
 
   // Set up the variables to open the correct data log, and identify its format.
   if (PLAYBACK != "") {
-    readFile = fopen(PLAYBACK, "r");
-    strcpy(name, &PLAYBACK[strlen(PLAYBACK)-3]);
-    if (strncmp(name, "rec", 3) == 0) 
-      FILE_FORMAT = REC;
-    else
-      FILE_FORMAT = LOG;
+    FILE_FORMAT = LogFormat(PLAYBACK);
+    if (FILE_FORMAT == BIN) {
+      if (OpenBinLog(&binLog, PLAYBACK) == -1)
+	exit(-1);
+      if (binLog.header->senseNumber != SENSE_NUMBER) {
+	fprintf(stderr, "%s was converted for a laser with %d readings, rather than %d.\n", PLAYBACK, binLog.header->senseNumber, SENSE_NUMBER);
+	exit(-1);
+      }
+      readFile = NULL;
+    }
+    else {
+      // The text logs are read and parsed ahead of time by a thread of their own.
+      readFile = fopen(PLAYBACK, "r");
+      if (readFile == NULL) {
+	fprintf(stderr, "Unable to open the data log %s\n", PLAYBACK);
+	exit(-1);
+      }
+      StartLogReader(readFile, FILE_FORMAT);
+    }
   }
 
   // All angle values will remain static
@@ -1045,11 +1032,15 @@ void InitLowSlam()
   }
   else {
     // Read through the file the specified number of iterations, in order to get to a 
-    // later portion of the sensor log.
-    for (i=0; i < START_ITERATION; i++) {
-      ReadLog(readFile, sense, j);
-      ReadLog(readFile, sense, j);
-    }
+    // later portion of the sensor log. A binary log can go straight there, since each iteration
+    // is two records.
+    if (FILE_FORMAT == BIN)
+      SeekBinLog(&binLog, 2*START_ITERATION);
+    else
+      for (i=0; i < START_ITERATION; i++) {
+	ReadLog(readFile, sense, j);
+	ReadLog(readFile, sense, j);
+      }
 
     // Read in the first data before starting SLAM.
     ReadLog(readFile, sense, i);
@@ -1065,8 +1056,14 @@ void InitLowSlam()
 //
 void CloseLowSlam()
 {
-  if (PLAYBACK != "")
-    fclose(readFile);
+  if (PLAYBACK != "") {
+    if (FILE_FORMAT == BIN)
+      CloseBinLog(&binLog);
+    else {
+      StopLogReader();
+      fclose(readFile);
+    }
+  }
 }
 
 
@@ -1076,51 +1073,26 @@ void CloseLowSlam()
 // arguments return the corrected odometry for the time steps, and the corresponding list of
 // observations. This can be used for the higher level SLAM process when using hierarchical SLAM.
 //
-void LowSlam(int &continueSlam, TPath **path, TSenseLog **obs)
+void LowSlam(int &continueSlam, TSegmentLog *log)
 {
   double moveAngle;
   int counter;
-  int i, j, overflow = 0;
+  int i, j, k, overflow = 0;
   char name[32];
-  TPath *tempPath;
-  TSenseLog *tempObs;
-  TAncestor *lineage;
+  TPath *tempPath, *path;
+  TAncestor *lineage, *root;
 
   // Initialize the worldMap
   LowInitializeWorldMap();
 
   // Initialize the ancestry and particles
-  cleanID = ID_NUMBER - 2;    // ID_NUMBER-1 is being used as the root of the ancestry tree.
-
-  // Initialize all of our unused ancestor particles to look unused.
-  for (i = 0; i < ID_NUMBER; i++) {
-    availableID[i] = i;
-
-    l_particleID[i].generation = -1;
-    l_particleID[i].numChildren = 0;
-    l_particleID[i].ID = -1;
-    l_particleID[i].parent = NULL;
-    l_particleID[i].mapEntries = NULL;
-    l_particleID[i].path = NULL;
-    l_particleID[i].seen = 0;
-    l_particleID[i].total = 0;
-    l_particleID[i].size = 0;
-  }
-
-  // Initialize the root of our ancestry tree.
-  l_particleID[ID_NUMBER-1].generation = 0;
-  l_particleID[ID_NUMBER-1].numChildren = 1;
-  l_particleID[ID_NUMBER-1].size = 0;
-  l_particleID[ID_NUMBER-1].total = 0;
-  l_particleID[ID_NUMBER-1].ID = ID_NUMBER-1;
-  l_particleID[ID_NUMBER-1].parent = NULL;
-  l_particleID[ID_NUMBER-1].mapEntries = NULL;
+  root = InitAncestry<TLowLevel>();
 
   // Create all of our starting particles at the center of the map.
   for (i = 0; i < PARTICLE_NUMBER; i++) {
-    l_particle[i].ancestryNode = &(l_particleID[ID_NUMBER-1]);
-    l_particle[i].x = MAP_WIDTH / 2;
-    l_particle[i].y = MAP_HEIGHT / 2;
+    l_particle[i].ancestryNode = root;
+    l_particle[i].x = GRID_START;
+    l_particle[i].y = GRID_START;
     l_particle[i].theta = 0.001;
     l_particle[i].probability = 0;
     children[i] = 0;
@@ -1178,12 +1150,8 @@ void LowSlam(int &continueSlam, TPath **path, TSenseLog **obs)
   }
 
   // Get our observation log started.
-  (*obs) = (TSenseLog *)malloc(sizeof(TSenseLog));
-  for (i=0; i < SENSE_NUMBER; i++) {
-    (*obs)->sense[i].distance = hold[0].sense[i].distance;
-    (*obs)->sense[i].theta = hold[0].sense[i].theta;
-  }
-  (*obs)->next = NULL;
+  ClearSegmentLog(log);
+  AddLogSense(log, hold[0].sense);
 
   continueSlam = 1;
   counter = 0;
@@ -1221,26 +1189,20 @@ void LowSlam(int &continueSlam, TPath **path, TSenseLog **obs)
       if (PLAYBACK == "")
 	GetSensation(sense);
 
-      // Wipe the slate clean 
-      LowInitializeFlags();
+      // Wipe the slate clean, unless the observation cache is being kept from the last generation
+      if (!KEEP_OBSERVATIONS)
+	LowInitializeFlags();
+      else
+	LowPrepareObservations();
 
       // Apply the localization procedure, which will give us the N best particles
       Localize(sense);
 
       // Add these maintained particles to the FamilyTree, so that ancestry can be determined, and then prune dead lineages
-      UpdateAncestry(sense, l_particleID);
+      UpdateAncestry(sense);
 
       // Update the observation log (used only by hierarchical SLAM)
-      tempObs = (*obs);
-      while (tempObs->next != NULL)
-	tempObs = tempObs->next;
-      tempObs->next = (TSenseLog *)malloc(sizeof(TSenseLog));
-      if (tempObs->next == NULL) fprintf(stderr, "Malloc failed in making a new observation!\n");
-      for (i=0; i < SENSE_NUMBER; i++) {
-	tempObs->next->sense[i].distance = sense[i].distance;
-	tempObs->next->sense[i].theta = sense[i].theta;
-      }
-      tempObs->next->next = NULL;
+      AddLogSense(log, sense);
 
       // Holding Pen for observations.
       for (i=0; i < SENSE_NUMBER; i++) {
@@ -1266,31 +1228,32 @@ void LowSlam(int &continueSlam, TPath **path, TSenseLog **obs)
     if (l_particle[i].probability > l_particle[j].probability)
       j = i;
 
-  (*path) = NULL;
+  // Each ancestor in its lineage holds the part of the path since its parent. First count the steps,
+  // then copy each part into the log, working back from the end.
+  // The root of the tree is the only ancestor without a parent.
   i = 0;
-  lineage = l_particle[j].ancestryNode;
-  while ((lineage != NULL) && (lineage->ID != ID_NUMBER-1)) {
-    tempPath = lineage->path;
-    i++;
-    while (tempPath->next != NULL) {
+  for (lineage = l_particle[j].ancestryNode; (lineage != NULL) && (lineage->parent != NULL); lineage = lineage->parent)
+    for (tempPath = lineage->path; tempPath != NULL; tempPath = tempPath->next)
       i++;
-      tempPath = tempPath->next;
-    }
-    tempPath->next = (*path);
 
-    (*path) = lineage->path;
-    lineage->path = NULL;
-    lineage = lineage->parent;
+  path = SizeLogPath(log, i);
+  for (lineage = l_particle[j].ancestryNode; (lineage != NULL) && (lineage->parent != NULL); lineage = lineage->parent) {
+    k = 0;
+    for (tempPath = lineage->path; tempPath != NULL; tempPath = tempPath->next)
+      k++;
+    i = i - k;
+    for (tempPath = lineage->path, k = i; tempPath != NULL; tempPath = tempPath->next, k++) {
+      path[k].C = tempPath->C;
+      path[k].D = tempPath->D;
+      path[k].T = tempPath->T;
+      path[k].next = NULL;
+    }
   }
 
-  tempPath = (*path);
-  i = 0;
-  while (tempPath != NULL) {
-    hold[i].C = tempPath->C;
-    hold[i].D = tempPath->D;
-    hold[i].T = tempPath->T;
-    tempPath = tempPath->next;
-    i++;
+  for (i = 0; i < log->steps; i++) {
+    hold[i].C = path[i].C;
+    hold[i].D = path[i].D;
+    hold[i].T = path[i].T;
   }
 
   // Print out the map.
@@ -1300,11 +1263,9 @@ void LowSlam(int &continueSlam, TPath **path, TSenseLog **obs)
     if (l_particle[i].probability > l_particle[j].probability)
       j = i;
   PrintMap(name, l_particle[j].ancestryNode, FALSE, -1, -1, -1);
-  sprintf(name, "rm lmap%.2d.ppm", (int) (curGeneration/LOW_DURATION)-1);
-  system(name);
 
   // Clean up the memory being used.
-  DisposeAncestry(l_particleID);
+  DisposeAncestry<TLowLevel>();
   LowDestroyMap();
 }
 
@@ -30,11 +30,18 @@
 void InitLowSlam();
 // This function cleans up the memory and maps that were used by LowSlam.
 void CloseLowSlam();
+// Converts a text data log (.log or .rec) into a binary log (see binlog.h), which is much faster to play back.
+// Returns -1 if it couldn't be done.
+int ConvertLog(char *from, char *to);
 // The main function for performing SLAM at the low level. The first argument will return 
-// whether there is still information to be processed by SLAM (set to 1). The second and third
-// arguments return the corrected odometry for the time steps, and the corresponding list of
-// observations. This can be used for the higher level SLAM process when using hierarchical SLAM.
-void LowSlam(int &continueSlam, TPath **path, TSenseLog **obs);
+// whether there is still information to be processed by SLAM (set to 1). The log is filled with
+// the corrected odometry for the time steps, and the corresponding list of observations (see
+// TSegmentLog in map.h). This can be used for the higher level SLAM process when using hierarchical SLAM.
+void LowSlam(int &continueSlam, TSegmentLog *log);
+
+// When set, the best pose of each generation is also written to this file, one per line, as
+// "generation x y theta". Used to compare runs against each other (see ValidateFastMath in slam.cpp).
+extern FILE *POSE_LOG;
 
 
 
@@ -14,34 +14,82 @@
 //
 // Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
 //
-// lowMap.c contains a large amount of actual code which implement the way that maps are created,
-// queried and maintained. This is basically a duplicate of highMap.*, which is in charge of 
-// maintaining the high level mapping process. When not using hierarchical slam, highMap.* is
-// ignored, and only lowMap.* is used.
+// lowMap.c gives the level type for the low level of the hierarchy, TLowLevel, and the usual
+// names for the map functions, which are written once for both levels in levelMap.h. When not 
+// using hierarchical slam, highMap.* is ignored, and only lowMap.* is used.
 //
 
 #include "map.h"
 
-// The global map used by the low level slam process. These are pointers to MapStarter in order
-// to save memory on te large amount of unobserved grid squares.
-extern PMapStarter lowMap[MAP_WIDTH][MAP_HEIGHT];
+// The global map used by the low level slam process. This is a sparse grid of tiles (see TGrid in map.h),
+// in order to save memory on te large amount of unobserved grid squares.
+extern TGrid lowMap;
+// The observation cache for lowMap. See TObservationCache in map.h
+extern TObservationCache lowCache;
+// Whether lowCache is kept from one generation to the next, rather than built again from scratch
+// for each generation (see RefreshObservations in levelMap.h). Defaults to 1.
+extern int KEEP_OBSERVATIONS;
+// The pool for the observations in lowMap and the ancestors' lists of altered squares. It is
+// emptied all at once at the end of each low level segment. See TPool in map.h
+extern TPool lowPool;
+// Room for adding the scans to lowMap by stripes. See TInsertion in map.h
+extern TInsertion lowInsertion;
 // The nodes of the ancestry tree are stored here. Since each particle has a unique ID, we can 
 // quickly access the particles via their ID in this array. See the structure TAncestor in map.h 
 // for more details.
-extern TAncestor l_particleID[ID_NUMBER];
+extern TAncestor *l_particleID;
+// Every particle needs a unique ID number. This stack keeps track of the unused IDs.
+extern int cleanID;
+extern int *availableID;
 
 // Our current set of particles being processed by the particle filter
-extern TParticle l_particle[PARTICLE_NUMBER];
+extern TParticle *l_particle;
 // We like to keep track of exactly how many particles we are currently using.
 extern int l_cur_particles_used;
 
 
+// The level type for the low level (see levelMap.h).
+struct TLowLevel {
+  // Unobserved grid squares are treated of having a prior of one stopped scan per 
+  // 8 meters of laser scan. 
+  static constexpr double PRIOR = -1.0/(MAP_SCALE*8.0);
+  // The strength of the prior is set to be as if 4 grid squares worth of observation 
+  // has already been made at the prior's density
+  static constexpr double PRIOR_DIST = 4.0;
+  static constexpr double VARIANCE = LOW_VARIANCE;
+  static constexpr double ENTRY_GROWTH = 1.25;
+  // The ancestors at the low level keep the path of the robot, to be handed up to the high level.
+  static const bool PATHS = true;
+
+  static TGrid *Map() { return &lowMap; }
+  static TObservationCache *Cache() { return &lowCache; }
+  static TPool *Pool() { return &lowPool; }
+  static TInsertion *Insertion() { return &lowInsertion; }
+  static TAncestor *Ancestors() { return l_particleID; }
+  static int &IDs() { return ID_NUMBER; }
+  static int *&AvailableID() { return availableID; }
+  static int &CleanID() { return cleanID; }
+  static TParticle *Particles() { return l_particle; }
+  static int &ParticlesUsed() { return l_cur_particles_used; }
+  static int ParticleNumber() { return PARTICLE_NUMBER; }
+};
+
+
+void LowAllocateMap();
 void LowInitializeFlags();
+void LowRefreshObservations();
+void LowPrepareObservations();
 void LowInitializeWorldMap();
 void LowDestroyMap();
 void LowResizeArray(TMapStarter *node, int deadID);
 void LowDeleteObservation(short int x, short int y, short int node);
 double LowComputeProb(int x, int y, double distance, int ID);
+// Draws the particle's map onto the canvas, which is fitted to the area that it has observed (see RenderMap in levelMap.h).
+void LowRenderMap(TAncestor *particle, double distance, TMapCanvas *canvas);
 
 void LowAddTrace(double startx, double starty, double MeasuredDist, double theta, int parentID, int addEnd);
+// Adds the scan to the map from each of the first count particles (see InsertScans in levelMap.h).
+void LowInsertScans(TSense sense, int count);
 double LowLineTrace(double startx, double starty, double theta, double MeasuredDist, int parentID, float culling);
+void LowLineTraceBatch(int count, double startx[], double starty[], double theta[], double MeasuredDist[], 
+		       int parentID, float culling, double result[]);
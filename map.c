@@ -13,10 +13,509 @@
 // Copyright 2005 Austin Eliazar, Ronald Parr, Duke University
 //
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 #include "map.h"
 
-int flagMap[H_MAP_WIDTH][H_MAP_HEIGHT];
-short int obsX[AREA], obsY[AREA];
+int MAP_WIDTH = DEFAULT_MAP_WIDTH;
+int MAP_HEIGHT = DEFAULT_MAP_HEIGHT;
+int PARTICLE_NUMBER = DEFAULT_PARTICLE_NUMBER;
+int SAMPLE_NUMBER = 0;
+int MIN_SAMPLE_NUMBER = 0;
+int ID_NUMBER = 0;
 
-short int observationArray[AREA][TOP_ID_NUMBER];
-int observationID;
+int H_MAP_WIDTH = DEFAULT_H_MAP_WIDTH;
+int H_MAP_HEIGHT = DEFAULT_H_MAP_HEIGHT;
+int H_PARTICLE_NUMBER = DEFAULT_H_PARTICLE_NUMBER;
+int H_SAMPLE_NUMBER = 0;
+int H_ID_NUMBER = 0;
+
+int AREA = 0;
+
+int PARALLEL_INSERT = 1;
+int ancestorSerial = 0;
+
+
+// The sizes that can be set from a configuration file.
+struct TMapSize_struct {
+  const char *name;
+  int *value;
+};
+static struct TMapSize_struct mapSize[] = {
+  {"MAP_WIDTH", &MAP_WIDTH}, {"MAP_HEIGHT", &MAP_HEIGHT}, 
+  {"PARTICLE_NUMBER", &PARTICLE_NUMBER}, {"SAMPLE_NUMBER", &SAMPLE_NUMBER}, {"ID_NUMBER", &ID_NUMBER},
+  {"MIN_SAMPLE_NUMBER", &MIN_SAMPLE_NUMBER},
+  {"H_MAP_WIDTH", &H_MAP_WIDTH}, {"H_MAP_HEIGHT", &H_MAP_HEIGHT}, 
+  {"H_PARTICLE_NUMBER", &H_PARTICLE_NUMBER}, {"H_SAMPLE_NUMBER", &H_SAMPLE_NUMBER}, {"H_ID_NUMBER", &H_ID_NUMBER},
+  {"AREA", &AREA}, {NULL, NULL}
+};
+
+
+int ReadMapConfig(char *name)
+{
+  FILE *configFile;
+  char line[256], key[64], *comment;
+  int i, value, lineNumber, result;
+
+  configFile = fopen(name, "r");
+  if (configFile == NULL) {
+    fprintf(stderr, "Unable to open the configuration file %s\n", name);
+    return -1;
+  }
+
+  result = 0;
+  lineNumber = 0;
+  while (fgets(line, 256, configFile) != NULL) {
+    lineNumber++;
+    comment = strchr(line, '#');
+    if (comment != NULL)
+      *comment = '\0';
+    if (sscanf(line, "%63s", key) != 1)
+      continue;
+
+    for (i = 0; mapSize[i].name != NULL; i++)
+      if (strcmp(key, mapSize[i].name) == 0)
+	break;
+    if ((mapSize[i].name == NULL) || (sscanf(line, "%*s %d", &value) != 1)) {
+      fprintf(stderr, "%s, line %d: don't know what to do with \"%s\"\n", name, lineNumber, key);
+      result = -1;
+      continue;
+    }
+    *(mapSize[i].value) = value;
+  }
+
+  fclose(configFile);
+  return result;
+}
+
+
+int InitMapSizes()
+{
+  int i;
+
+  if (SAMPLE_NUMBER <= 0)
+    SAMPLE_NUMBER = PARTICLE_NUMBER*10;
+  if (MIN_SAMPLE_NUMBER <= 0)
+    MIN_SAMPLE_NUMBER = SAMPLE_NUMBER;
+  if (ID_NUMBER <= 0)
+    ID_NUMBER = (int) (PARTICLE_NUMBER*2.25);
+  if (H_SAMPLE_NUMBER <= 0)
+    H_SAMPLE_NUMBER = H_PARTICLE_NUMBER*10;
+  if (H_ID_NUMBER <= 0)
+    H_ID_NUMBER = (int) (H_PARTICLE_NUMBER*2.25);
+  if (AREA <= 0)
+    AREA = OBS_BLOCK;
+
+  for (i = 0; mapSize[i].name != NULL; i++)
+    if (*(mapSize[i].value) <= 0) {
+      fprintf(stderr, "%s must be positive (it is %d)\n", mapSize[i].name, *(mapSize[i].value));
+      return -1;
+    }
+  // The area that the maps are drawn in never needs to be larger than the grid (see TGrid in map.h).
+  if ((MAP_WIDTH > GRID_LIMIT) || (MAP_HEIGHT > GRID_LIMIT) || (H_MAP_WIDTH > GRID_LIMIT) || (H_MAP_HEIGHT > GRID_LIMIT)) {
+    fprintf(stderr, "The maps can't be drawn more than %d grid squares across.\n", GRID_LIMIT);
+    return -1;
+  }
+  if ((SAMPLE_NUMBER < PARTICLE_NUMBER) || (H_SAMPLE_NUMBER < H_PARTICLE_NUMBER)) {
+    fprintf(stderr, "There need to be at least as many samples as particles.\n");
+    return -1;
+  }
+  if ((MIN_SAMPLE_NUMBER < PARTICLE_NUMBER) || (MIN_SAMPLE_NUMBER > SAMPLE_NUMBER)) {
+    fprintf(stderr, "MIN_SAMPLE_NUMBER must be between PARTICLE_NUMBER and SAMPLE_NUMBER.\n");
+    return -1;
+  }
+  // The pool of IDs can't grow past MAX_ID_NUMBER, so more particles than this could run out of IDs part way.
+  if ((PARTICLE_NUMBER > MAX_PARTICLE_NUMBER) || (H_PARTICLE_NUMBER > MAX_PARTICLE_NUMBER)) {
+    fprintf(stderr, "PARTICLE_NUMBER and H_PARTICLE_NUMBER can be at most %d, since particle IDs are short ints.\n", 
+	    MAX_PARTICLE_NUMBER);
+    return -1;
+  }
+  // The root of the ancestry tree takes up an ID, and there need to be enough left over for every particle.
+  if ((ID_NUMBER <= PARTICLE_NUMBER) || (H_ID_NUMBER <= H_PARTICLE_NUMBER) ||
+      (ID_NUMBER > MAX_ID_NUMBER) || (H_ID_NUMBER > MAX_ID_NUMBER)) {
+    fprintf(stderr, "ID_NUMBER and H_ID_NUMBER must be more than the number of particles, and at most %d.\n", MAX_ID_NUMBER);
+    return -1;
+  }
+  return 0;
+}
+
+
+void **AllocateGrid(int width, int height, int size)
+{
+  void **grid;
+  char *block;
+  int x;
+
+  grid = (void **) malloc(width * sizeof(void *));
+  block = (char *) calloc((size_t) width * height, size);
+  if ((grid == NULL) || (block == NULL)) {
+    fprintf(stderr, "Unable to allocate a %d x %d grid.\n", width, height);
+    free(grid);
+    free(block);
+    return NULL;
+  }
+
+  for (x = 0; x < width; x++)
+    grid[x] = block + (size_t) x * height * size;
+  return grid;
+}
+
+
+void FreeGrid(void **grid)
+{
+  if (grid == NULL)
+    return;
+  free(grid[0]);
+  free(grid);
+}
+
+
+void InitMapCanvas(TMapCanvas *canvas, int width, int height)
+{
+  canvas->shade = NULL;
+  canvas->claim = NULL;
+  canvas->roomWidth = 0;
+  canvas->roomHeight = 0;
+  canvas->x = GRID_START;
+  canvas->y = GRID_START;
+  canvas->width = 0;
+  canvas->height = 0;
+  CanvasRoom(canvas, width, height);
+}
+
+
+void CanvasRoom(TMapCanvas *canvas, int width, int height)
+{
+  if ((width <= canvas->roomWidth) && (height <= canvas->roomHeight))
+    return;
+
+  // Grow by at least half again, so that a map which is slowly spreading out isn't made again every time.
+  if (width > canvas->roomWidth)
+    canvas->roomWidth = MAX(width, canvas->roomWidth + canvas->roomWidth/2);
+  if (height > canvas->roomHeight)
+    canvas->roomHeight = MAX(height, canvas->roomHeight + canvas->roomHeight/2);
+  canvas->roomWidth = MIN(canvas->roomWidth, GRID_LIMIT);
+  canvas->roomHeight = MIN(canvas->roomHeight, GRID_LIMIT);
+
+  FreeGrid((void **) canvas->shade);
+  FreeGrid((void **) canvas->claim);
+  canvas->shade = (unsigned char **) AllocateGrid(canvas->roomWidth, canvas->roomHeight, sizeof(unsigned char));
+  canvas->claim = (int **) AllocateGrid(canvas->roomWidth, canvas->roomHeight, sizeof(int));
+  if ((canvas->shade == NULL) || (canvas->claim == NULL)) {
+    fprintf(stderr, "Unable to make room to draw a %d x %d map.\n", canvas->roomWidth, canvas->roomHeight);
+    exit(-1);
+  }
+}
+
+
+int InitGrid(TGrid *grid)
+{
+  // Most of the directory is never looked at, and the system won't actually set aside memory for those parts.
+  grid->tile = (TGridTile **) calloc((size_t) GRID_TILES * GRID_TILES, sizeof(TGridTile *));
+  grid->room = 64;
+  grid->tiles = 0;
+  grid->warned = 0;
+  grid->touched = (TGridTile **) malloc(grid->room * sizeof(TGridTile *));
+  if ((grid->tile == NULL) || (grid->touched == NULL)) {
+    fprintf(stderr, "Unable to allocate the directory for a grid.\n");
+    return -1;
+  }
+  return 0;
+}
+
+
+TGridCell *TouchGridCell(TGrid *grid, int x, int y)
+{
+  TGridTile *tile;
+  int index;
+
+  // The stripes may be adding scans to the same grid at once (see InsertScans in levelMap.h).
+  if (((unsigned int) x >= GRID_LIMIT) || ((unsigned int) y >= GRID_LIMIT)) {
+    if (!__atomic_exchange_n(&(grid->warned), 1, __ATOMIC_RELAXED))
+      fprintf(stderr, "Grid square %d %d is off the edge of the map, which only goes from 0 to %d, %d squares each way "
+	      "from the start. Ignoring it, and any others.\n", x, y, GRID_LIMIT-1, GRID_LIMIT/2);
+    return NULL;
+  }
+
+  index = (x >> TILE_BITS)*GRID_TILES + (y >> TILE_BITS);
+  tile = grid->tile[index];
+  if (tile == NULL) {
+    if (grid->tiles >= grid->room) {
+      grid->room = grid->room*2;
+      grid->touched = (TGridTile **) realloc(grid->touched, grid->room * sizeof(TGridTile *));
+    }
+    tile = (TGridTile *) calloc(1, sizeof(TGridTile));
+    if ((tile == NULL) || (grid->touched == NULL)) {
+      fprintf(stderr, "Unable to allocate a tile of the map.\n");
+      exit(-1);
+    }
+    tile->index = index;
+    grid->touched[grid->tiles] = tile;
+    grid->tiles++;
+    grid->tile[index] = tile;
+  }
+  return &(tile->cell[((x & (TILE_SIZE-1)) << TILE_BITS) + (y & (TILE_SIZE-1))]);
+}
+
+
+void ClearGrid(TGrid *grid)
+{
+  int i;
+
+  for (i = 0; i < grid->tiles; i++) {
+    grid->tile[grid->touched[i]->index] = NULL;
+    free(grid->touched[i]);
+  }
+  grid->tiles = 0;
+}
+
+
+void ClearSegmentLog(TSegmentLog *log)
+{
+  log->steps = 0;
+  log->senses = 0;
+}
+
+
+void AddLogSense(TSegmentLog *log, TSense sense)
+{
+  if (log->senses >= log->senseRoom) {
+    log->senseRoom = (log->senseRoom == 0) ? 64 : log->senseRoom*2;
+    log->sense = (TSense *) realloc(log->sense, log->senseRoom * sizeof(TSense));
+    if (log->sense == NULL) {
+      fprintf(stderr, "Unable to grow the log of observations past %d.\n", log->senses);
+      exit(-1);
+    }
+  }
+  memcpy(log->sense[log->senses], sense, sizeof(TSense));
+  log->senses++;
+}
+
+
+TPath *SizeLogPath(TSegmentLog *log, int steps)
+{
+  if (steps > log->pathRoom) {
+    log->pathRoom = steps;
+    log->path = (TPath *) realloc(log->path, log->pathRoom * sizeof(TPath));
+    if (log->path == NULL) {
+      fprintf(stderr, "Unable to make room for a path of %d steps.\n", steps);
+      exit(-1);
+    }
+  }
+  log->steps = steps;
+  return log->path;
+}
+
+
+void CoalesceUpdates(TSquareTable *table, TMapUpdate update[], int count)
+{
+  long long key;
+  int i, slot, size;
+
+  // Keep the table at most half full.
+  if (2*count > table->mask+1) {
+    size = 1024;
+    while (size < 2*count)
+      size = size*2;
+    free(table->key);
+    free(table->stamp);
+    free(table->last);
+    table->key = (long long *) malloc(size * sizeof(long long));
+    table->stamp = (int *) calloc(size, sizeof(int));
+    table->last = (int *) malloc(size * sizeof(int));
+    if ((table->key == NULL) || (table->stamp == NULL) || (table->last == NULL)) {
+      fprintf(stderr, "Unable to allocate a table of %d grid squares.\n", size);
+      exit(-1);
+    }
+    table->mask = size-1;
+    table->epoch = 0;
+  }
+  table->epoch++;
+
+  for (i = 0; i < count; i++) {
+    update[i].next = -1;
+    update[i].repeat = 0;
+    key = ((long long) update[i].x << 32) | (unsigned int) update[i].y;
+    slot = (int) (((unsigned long long) key * 0x9E3779B97F4A7C15ULL) >> 40) & table->mask;
+    while (table->stamp[slot] == table->epoch) {
+      if (table->key[slot] == key)
+	break;
+      slot = (slot + 1) & table->mask;
+    }
+
+    if (table->stamp[slot] == table->epoch) {
+      update[table->last[slot]].next = i;
+      update[i].repeat = 1;
+    }
+    else {
+      table->stamp[slot] = table->epoch;
+      table->key[slot] = key;
+    }
+    table->last[slot] = i;
+  }
+}
+
+
+void InitPool(TPool *pool)
+{
+  memset(pool, 0, sizeof(TPool));
+  pthread_mutex_init(&(pool->lock), NULL);
+}
+
+
+void *PoolGrow(TPool *pool, int c)
+{
+  size_t size;
+  char *chunk;
+
+  if (c >= POOL_CLASSES) {
+    fprintf(stderr, "Unable to allocate a block of more than %lu bytes from a pool.\n", 
+	    (unsigned long) PoolClassSize(POOL_CLASSES-1));
+    exit(-1);
+  }
+
+  // Blocks too big to share a chunk with others get a chunk of their own, and the current chunk is kept.
+  size = PoolClassSize(c);
+  if (size > POOL_CHUNK/4)
+    chunk = (char *) malloc(size);
+  else
+    chunk = (char *) malloc(POOL_CHUNK);
+  if (pool->chunks >= pool->room) {
+    pool->room = (pool->room == 0) ? 64 : pool->room*2;
+    pool->chunk = (char **) realloc(pool->chunk, pool->room * sizeof(char *));
+  }
+  if ((chunk == NULL) || (pool->chunk == NULL)) {
+    fprintf(stderr, "Unable to allocate another chunk for a pool.\n");
+    exit(-1);
+  }
+  pool->chunk[pool->chunks] = chunk;
+  pool->chunks++;
+
+  if (size > POOL_CHUNK/4)
+    return chunk;
+  pool->next = chunk + size;
+  pool->end = chunk + POOL_CHUNK;
+  return chunk;
+}
+
+
+void PoolReset(TPool *pool)
+{
+  int i;
+
+  for (i = 0; i < pool->chunks; i++)
+    free(pool->chunk[i]);
+  pool->chunks = 0;
+  for (i = 0; i < POOL_CLASSES; i++)
+    pool->freeList[i] = NULL;
+  pool->next = NULL;
+  pool->end = NULL;
+}
+
+
+int InitObservationCache(TObservationCache *cache, int ids)
+{
+  cache->limit = GRID_LIMIT*GRID_LIMIT;
+  cache->observationArray = (short int **) calloc(cache->limit/OBS_BLOCK, sizeof(short int *));
+  if (cache->observationArray == NULL) {
+    fprintf(stderr, "Unable to allocate the observation cache.\n");
+    return -1;
+  }
+  pthread_mutex_init(&(cache->growLock), NULL);
+  pthread_mutex_init(&(cache->deadLock), NULL);
+
+  cache->keep = 0;
+  cache->birth = NULL;
+  cache->births = 0;
+  cache->birthRoom = 0;
+  cache->lineageID = NULL;
+  cache->lineageParent = NULL;
+  cache->lineages = 0;
+  cache->lineageRoom = 0;
+  cache->lineageEpoch = 0;
+
+  // Start the cache off at the requested size.
+  cache->width = ids;
+  cache->area = 0;
+  GrowObservationCache(cache, AREA-1);
+  cache->observationID = 1;
+  return 0;
+}
+
+
+void GrowObservationCache(TObservationCache *cache, int here)
+{
+  short int *block;
+
+  pthread_mutex_lock(&(cache->growLock));
+  while (here >= cache->area) {
+    if (cache->area >= cache->limit) {
+      fprintf(stderr, "Roll over! The observation cache can't grow past %d entries.\n", cache->limit);
+      exit(-1);
+    }
+    // The entries, followed by their positions (see ObservationPos)
+    block = (short int *) malloc(OBS_BLOCK * (cache->width + 2) * sizeof(short int));
+    if (block == NULL) {
+      fprintf(stderr, "Unable to grow the observation cache past %d entries.\n", cache->area);
+      exit(-1);
+    }
+    cache->observationArray[cache->area >> OBS_BLOCK_BITS] = block;
+    // Other threads check area without taking the lock, so the new block has to be in place first.
+    __atomic_store_n(&(cache->area), cache->area + OBS_BLOCK, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&(cache->growLock));
+}
+
+
+void TrimObservationCache(TObservationCache *cache, int used)
+{
+  int blocks;
+
+  // Leave room for twice as many entries as were used, so that an iteration which needs a
+  // few more than the last doesn't have to make the blocks all over again.
+  blocks = (MAX(2*used, AREA) + OBS_BLOCK - 1) >> OBS_BLOCK_BITS;
+  while ((cache->area >> OBS_BLOCK_BITS) > blocks) {
+    cache->area = cache->area - OBS_BLOCK;
+    free(cache->observationArray[cache->area >> OBS_BLOCK_BITS]);
+    cache->observationArray[cache->area >> OBS_BLOCK_BITS] = NULL;
+  }
+}
+
+
+void AddObservationBirth(TObservationCache *cache, int child, int parent)
+{
+  if (!cache->keep)
+    return;
+  if (cache->births >= cache->birthRoom) {
+    cache->birthRoom = (cache->birthRoom == 0) ? 64 : cache->birthRoom*2;
+    cache->birth = (short int *) realloc(cache->birth, 2 * cache->birthRoom * sizeof(short int));
+    if (cache->birth == NULL) {
+      fprintf(stderr, "Unable to keep track of the new ancestors for the observation cache.\n");
+      exit(-1);
+    }
+  }
+  cache->birth[2*cache->births] = child;
+  cache->birth[2*cache->births+1] = parent;
+  cache->births++;
+}
+
+
+void WidenObservationCache(TObservationCache *cache, int ids)
+{
+  int i, size;
+
+  if (ids == cache->width)
+    return;
+
+  // None of the entries are in use, so they can be thrown out and made again at the new width.
+  size = cache->area;
+  for (i = 0; i < size/OBS_BLOCK; i++) {
+    free(cache->observationArray[i]);
+    cache->observationArray[i] = NULL;
+  }
+  cache->area = 0;
+  cache->width = ids;
+  GrowObservationCache(cache, size-1);
+}
@@ -18,6 +18,8 @@
 // about particle numbers and the information each one needs to maintain.
 //
 
+#include <stddef.h>
+#include <pthread.h>
 #include "laser.h"
 
 #define UNKNOWN -2
@@ -26,64 +28,88 @@
 // several steps in from the beginning of the file
 #define START_ITERATION 0
 
+// The sizes below used to be fixed when the program was compiled. They are now read at startup
+// (see ReadMapConfig and InitMapSizes in map.c, and the -m, -n and -N options in slam.cpp), 
+// and the values given here are the defaults. Any of the derived sizes (SAMPLE_NUMBER, MIN_SAMPLE_NUMBER,
+// ID_NUMBER and AREA) which are left at 0 are worked out from the others, the same way as they always have been.
+
 // LOW LEVEL DEFINITIONS
 // When using hierarchical slam, these are the values that are used by the low level
 // When not using hierarchical, these are the only values that matter.
 // See low.h for how to turn on and off hierarchical slam
 
-// We need to know, for various purposes, how big our map is allowed to be
-#define MAP_WIDTH  1700
-#define MAP_HEIGHT 1700
+// The size of the area that the low level maps are drawn in to start with. The pictures of the maps
+// only show the area that has been observed, and the area they are drawn in grows along with it (see
+// TMapCanvas below). The robot starts off in the middle of the grid (see TGrid below).
+#define DEFAULT_MAP_WIDTH  1700
+#define DEFAULT_MAP_HEIGHT 1700
+extern int MAP_WIDTH, MAP_HEIGHT;
 
 // This is the number of particles that we are keeping at the low level
-#define PARTICLE_NUMBER 50
+#define DEFAULT_PARTICLE_NUMBER 50
+extern int PARTICLE_NUMBER;
 // This is the number of samples that we will generate each iteration. Notice that we
 // generate more samples than we will keep as actual particles. This is because so many 
 // are "bad" samples, and clearly won't be resampled, thus we don't need to allocate nearly
 // as much memory if we acknowledge that a certain amount will never be considered particles.
 // "Localize" function in low.c can help explain.
-#define SAMPLE_NUMBER (PARTICLE_NUMBER*10)
+// Defaults to PARTICLE_NUMBER*10
+extern int SAMPLE_NUMBER;
+// The fewest samples to generate each iteration. When this is less than SAMPLE_NUMBER, Localize only
+// keeps generating samples until they are spread out enough to represent the robot's uncertainty
+// (KLD-sampling, see KLDBound in low.c), so that SAMPLE_NUMBER becomes the most it will use.
+// Defaults to SAMPLE_NUMBER, which always generates them all.
+extern int MIN_SAMPLE_NUMBER;
 // Number of unique particle ID numbers. Each particle (and ancestry particle) gets its own 
 // ID.  We recycle IDs that are no longer in use, thus this number can be bounded.
-// ID_NUMBER is PARTICLE_NUMBER*2 since the ancestry is a tree; the additional .1 is for 
-// breathing room
-#define ID_NUMBER (int) (PARTICLE_NUMBER*2.25)
+// ID_NUMBER is PARTICLE_NUMBER*2 since the ancestry is a tree; the additional .25 is for 
+// breathing room. Should that still not be enough, the pool of IDs grows as needed (see 
+// GrowIDs in level.h), up to MAX_ID_NUMBER.
+// Defaults to (int) (PARTICLE_NUMBER*2.25)
+extern int ID_NUMBER;
 
 
 // HIGH LEVEL DEFINITIONS
 // These values are for the high level in hierarchical slam. They can be ignored if
 // hierarchical slam is not being used.
 
-// We need to know, for various purposes, how big our map is allowed to be
-#define H_MAP_WIDTH  3000
-#define H_MAP_HEIGHT 3000
+// The same, for the high level map.
+#define DEFAULT_H_MAP_WIDTH  3000
+#define DEFAULT_H_MAP_HEIGHT 3000
+extern int H_MAP_WIDTH, H_MAP_HEIGHT;
 
 // This is the number of particles that we are keeping at the high level
-#define H_PARTICLE_NUMBER 50
+#define DEFAULT_H_PARTICLE_NUMBER 50
+extern int H_PARTICLE_NUMBER;
 // This is the number that we will generate
-#define H_SAMPLE_NUMBER (H_PARTICLE_NUMBER*10)
+// Defaults to H_PARTICLE_NUMBER*10
+extern int H_SAMPLE_NUMBER;
 // Number of unique particle ID numbers. Each particle (and ancestry particle) gets its own ID. 
 // We recycle IDs that are no longer in use, thus this number can be bounded.
 // ID_NUMBER is PARTICLE_NUMBER*2 since the ancestry is a tree; the additional .25 is for breathing room
-#define H_ID_NUMBER (int) (H_PARTICLE_NUMBER*2.25)
-
-
+// Defaults to (int) (H_PARTICLE_NUMBER*2.25), and grows as needed (see GrowIDs in level.h)
+extern int H_ID_NUMBER;
 
-#if (PARTICLE_NUMBER > H_PARTICLE_NUMBER)
-#define TOP_ID_NUMBER ID_NUMBER
-#else
-#define TOP_ID_NUMBER H_ID_NUMBER
-#endif
+// IDs are stored as short ints (in the map entries, among other places), which puts a hard limit
+// of 32767 on how far the pools of IDs can grow. While new particles are being added, the ancestry
+// tree can hold up to about twice the number of particles (a tree with no single-child branches),
+// on top of the new particles themselves. So each level can have at most MAX_PARTICLE_NUMBER
+// particles, and the program refuses to start with more (see InitMapSizes in map.c).
+#define MAX_ID_NUMBER 32767
+#define MAX_PARTICLE_NUMBER (MAX_ID_NUMBER/3)
 
 
-// A bounding box on the semicircle of possible observations.
-// This is useful for creating the observation cache (basically a set of local maps) which
-// allows us to run in linear time. This number will grow with increased laser ranges.
-#define AREA (int) (3.1415 * 55.0 *MAP_SCALE*MAP_SCALE)
+// The starting size of the observation cache (basically a set of local maps) at each level, which
+// allows us to run in linear time. The cache grows as an iteration touches more grid squares, and
+// gives the room back once it is no longer being used (see GrowObservationCache and 
+// TrimObservationCache in map.c), so this is only worth raising to save growing it at the start.
+// Defaults to one block of the cache (OBS_BLOCK)
+extern int AREA;
 
 
 // Used for passing the corrected odometric path from the low level to high level for
-// further evaluation. Only used for hierarchical slam.
+// further evaluation. Only used for hierarchical slam. The ancestors at the low level keep
+// their parts of the path as linked lists of these, taken from the level's pool (see TPool).
 struct TPath_struct {
   // The incremental motion which this robot moved during a single time step.
   // D is the major axis of lateral motion, which is along the average facing angle during this time step
@@ -94,21 +120,28 @@ struct TPath_struct {
 };
 typedef struct TPath_struct TPath;
 
-// Like TPath, this is also used to pass sets of observations from the low level to the
-// high level. Only used for hierarchical slam.
-struct TSenseLog_struct {
-  TSense sense;
-  struct TSenseLog_struct *next;
+// The corrected path and the set of observations of one low level segment, passed from the
+// low level to the high level. Only used for hierarchical slam.
+// sense[0] is what was seen at the start of the segment, and sense[i+1] is what was seen after
+// the motion path[i] (the next pointers of path aren't used). The arrays are kept from one segment
+// to the next, and only grow, so adding to them takes constant time.
+struct TSegmentLog_struct {
+  TPath *path;
+  TSense *sense;
+  int steps, senses;
+  int pathRoom, senseRoom;
 };
-typedef struct TSenseLog_struct TSenseLog;
+typedef struct TSegmentLog_struct TSegmentLog;
 
 
 // The maps are each made up of dynamic arrays of MapNodes. 
 // Each entry maintains the total distance observed through this square (distance), and corresponding number
-// of scans which were observed to stop here (hits). We also keep track of the ancestor particle which made
-// the observation (ID), as well as the generation of the ancestor's observation this is a modification of, 
-// if any (parentGen). We also keep an index into the array of modified grid squares maintained by the ancestor 
-// particle which made the observation which corresponding to this update (source).
+// of scans which were observed to stop here (hits), along with the density that they give (density). We also 
+// keep track of the generation of the ancestor's observation this is a modification of, if any (parentGen). 
+// We also keep an index into the array of modified grid squares maintained by the ancestor particle which 
+// made the observation which corresponding to this update (source).
+// The ID of the ancestor particle which made each observation is kept apart from the rest, in an array of 
+// its own just after the MapNodes (see MapIDs), since the lists are most often searched by ID alone.
 struct MapNode_struct;
 struct MapNode_struct {
   // An index into the array of observations kept by the associated ancestor node. This
@@ -116,11 +149,12 @@ struct MapNode_struct {
   int source;
   // The total distance that laser traces have been observed to pass through this grid square.
   float distance;
+  // hits/distance, worked out whenever either of them changes, so that it doesn't have to be divided out
+  // each time that the density of the grid square is looked up.
+  float density;
   // The number of times that a laser has been observed to stop in this grid square (implying a possible object)
   // Density of the square is hits/distance
   short int hits;
-  // The ID of the ancestor node which made this observation
-  short int ID;
   // If this observation is an update of a previous observation in this grid square, this indicates the generation
   // that the previous observation was made.
   short int parentGen;
@@ -140,6 +174,23 @@ struct MapNodeStarter_struct {
 typedef struct MapNodeStarter_struct TMapStarter;
 typedef struct MapNodeStarter_struct *PMapStarter;
 
+// The array of a grid square holds size MapNodes, followed by the IDs of the ancestors that made them.
+// MapArraySize gives how much room that takes, and MapNodeIDs finds the IDs.
+static inline int MapArraySize(int size)
+{
+  return size * (sizeof(TMapNode) + sizeof(short int));
+}
+
+static inline short int *MapNodeIDs(TMapNode *array, int size)
+{
+  return (short int *) (array + size);
+}
+
+static inline short int *MapIDs(TMapStarter *node)
+{
+  return MapNodeIDs(node->array, node->size);
+}
+
 
 // A dynamic array is stored by each ancestor particle of the map squares it has altered. We note which grid 
 // square was altered (x, y) as well as an index into that square's array, corresponding to this alteration 
@@ -178,18 +229,31 @@ struct TAncestor_struct {
   int size, total;
   short int generation, ID, numChildren;
   TPath *path;  // An addition for hierarchical- maintains the partial robot path represented by this particle
-  char seen;  // Used by various functions for speedy traversal of the tree. 
+  TPath *pathTail;  // The last step of path, so that steps can be added to the end of it at once
+  int seen;  // Used by various functions for speedy traversal of the tree (see OrderLineage in level.h). 
+  int serial;  // Never given to any other ancestor, unlike the ID, so that it can be recognized later (see HighExportTiles in high.c).
 };
 typedef struct TAncestor_struct TAncestor;
 typedef struct TAncestor_struct *PAncestor;
 
+// Where the serial numbers of the ancestors come from, at both levels.
+extern int ancestorSerial;
+
+static inline int NewAncestorSerial()
+{
+  return __atomic_add_fetch(&ancestorSerial, 1, __ATOMIC_RELAXED);
+}
+
 
 // Each particle stores certain information, such as its hypothesized postion (x, y, theta) in the global
 // sense. Also, the motion taken to get to that point from the last iteration (C, D, T) and the current
 // evaluated probability of this particle. For purposes of sorting the correct map for this particle,
 // we also keep a pointer tothe particle's immediate parent (from which it was resampled).
 struct TParticle_struct {
-  float x, y, theta; // The current position of the particle, in terms of grid squares and radians
+  // The current position of the particle, in terms of grid squares and radians. x and y are doubles, since
+  // the robot starts far out in the grid (GRID_START), where a float only keeps about 1/500 of a grid square.
+  double x, y;
+  float theta;
   float C, D, T;  // Minor and major axis of motion, and change of facing, respectively
   double probability; // The proability of the particle
   // Which ancestor node this particle corresponds to. 
@@ -198,21 +262,403 @@ struct TParticle_struct {
 typedef struct TParticle_struct TParticle;
 
 
+// The maps are stored as sparse grids of tiles, each TILE_SIZE grid squares across. A tile is only made 
+// the first time that one of its grid squares is observed, so the map takes up memory only for the area
+// that has actually been seen, and there is no fixed edge to it. Grid coordinates are kept in short ints
+// (in TEntryList, and in the observation cache), which limits them to 0 through GRID_LIMIT-1 in both 
+// directions. The directory of tiles covers all of that, so finding any grid square is two lookups.
+// Both levels start the robot at GRID_START, in the middle, so that the map can grow GRID_LIMIT/2 grid
+// squares in every direction from there. Observations past the edge are dropped, with a warning.
+// Alongside each grid square is its entry in the flagMap, which tells us, for a given position in the 
+// map, where we should look in the observation cache (see below) to find the "expanded" set of information 
+// for that grid square (where map accesses are constant time into an array).
+#define TILE_BITS 6
+#define TILE_SIZE (1 << TILE_BITS)
+#define GRID_BITS 15
+#define GRID_LIMIT (1 << GRID_BITS)
+#define GRID_TILES (GRID_LIMIT >> TILE_BITS)
+#define GRID_START (GRID_LIMIT/2)
+
+struct TGridCell_struct {
+  PMapStarter node;
+  int flag;
+};
+typedef struct TGridCell_struct TGridCell;
+
+struct TGridTile_struct {
+  TGridCell cell[TILE_SIZE*TILE_SIZE];
+  // Where this tile is in the directory
+  int index;
+  // Set whenever the observations in any of its grid squares change, for whoever wants to know what parts 
+  // of the map might look different (see HighExportTiles in high.c), and cleared by them.
+  int changed;
+};
+typedef struct TGridTile_struct TGridTile;
+
+struct TGrid_struct {
+  // The directory of tiles, GRID_TILES x GRID_TILES, with NULL for those which haven't been made yet
+  TGridTile **tile;
+  // Every tile that has been made, so that they can be cleaned up without looking through the whole directory.
+  TGridTile **touched;
+  int tiles, room;
+  // Set the first time that something is dropped off the edge of the grid, so that it is only reported once.
+  int warned;
+};
+typedef struct TGrid_struct TGrid;
+
+// Returns the grid square x,y of the grid, or NULL if it hasn't been made.
+static inline TGridCell *GridCell(TGrid *grid, int x, int y)
+{
+  TGridTile *tile;
+
+  if (((unsigned int) x >= GRID_LIMIT) || ((unsigned int) y >= GRID_LIMIT))
+    return NULL;
+  tile = grid->tile[(x >> TILE_BITS)*GRID_TILES + (y >> TILE_BITS)];
+  if (tile == NULL)
+    return NULL;
+  return &(tile->cell[((x & (TILE_SIZE-1)) << TILE_BITS) + (y & (TILE_SIZE-1))]);
+}
+
+// Returns the observations at grid square x,y, or NULL if there are none.
+static inline PMapStarter GridNode(TGrid *grid, int x, int y)
+{
+  TGridCell *cell = GridCell(grid, x, y);
+
+  if (cell == NULL)
+    return NULL;
+  return cell->node;
+}
+
+
+// Notes that the observations at grid square x,y (which must have been made) have changed. The stripes
+// may be doing this at once.
+static inline void MarkGridChange(TGrid *grid, int x, int y)
+{
+  __atomic_store_n(&(grid->tile[(x >> TILE_BITS)*GRID_TILES + (y >> TILE_BITS)]->changed), 1, __ATOMIC_RELAXED);
+}
+
+
 // These are structures used to speed up the code, and allow for an efficient use of the observation cache.
-// flagMap tells us, for a given position in the map, where we should look in the observation cache to find
-// the "expanded" set of information for that grid square (where map accesses are constant time into an array).
-// obsX/obsY do the opposite, and tell, for each entry of the observation cache, where in the map they 
-// correspond to. This is most useful for cleaning up the observation cache and flagMap after each iteration.
-extern int flagMap[H_MAP_WIDTH][H_MAP_HEIGHT];
-extern short int obsX[AREA], obsY[AREA];
-
-// This is where the actual observation cache is stored. For a given position in the global map, (x,y), 
-// consult i=flagMap[x][y] to get the proper index into the observationArray. Now, observationArray[i][j] 
+// Each level of the hierarchy keeps its own cache (lowCache in lowMap.c and highCache in highMap.c), for 
+// its own grid.
+// For each entry of the observation cache, ObservationPos tells where in the map it corresponds to, as x,y. 
+// This is most useful for cleaning up the observation cache and the flags in the map after each iteration.
+//
+// observationArray is where the actual observation cache is stored. For a given position in the map, (x,y), 
+// consult i, the flag in the grid cell of (x,y), to get the proper index into the observationArray. Now, observationArray[i][j] 
 // will be the entry for the particle whose ID is j at map position (x,y). Rather than copying over all of the 
 // info from the global map, this just gives a reference index into the appropriate grid square, so if 
 // k=observationArray[i][j], then the actual information for particle j at (x,y) is map[x][y]->array[k], 
 // which then contains fields such as hits, distance, etc.
-extern short int observationArray[AREA][TOP_ID_NUMBER];
+// Each entry is width IDs wide, and there are currently area of them. So that the cache can grow while 
+// other threads are reading it, the entries are kept in blocks of OBS_BLOCK, which never move once they 
+// are made. observationArray holds the blocks; use ObservationEntry(cache, i)[j] for what is written 
+// above as observationArray[i][j]. Each block also holds the positions of its entries, after the entries.
+#define OBS_BLOCK_BITS 12
+#define OBS_BLOCK (1 << OBS_BLOCK_BITS)
+
+struct TObservationCache_struct {
+  short int **observationArray;
+  // The number of entries of observationArray currently being used.
+  int observationID;
+  // The number of entries there is currently room for, and the number of IDs in each one.
+  int area, width;
+  // The most entries that the cache could ever need: one for each grid square that a grid could have.
+  // observationArray has room for enough blocks to hold this many.
+  int limit;
+  // growLock is held while adding more entries. Removing dead entries while building the cache touches 
+  // the ancestry nodes and the entries of other grid squares, so deadLock makes sure that only one 
+  // thread at a time is doing that.
+  pthread_mutex_t growLock, deadLock;
+  // Whether the entries are kept from one generation to the next, rather than cleared out each time (see
+  // RefreshObservations in levelMap.h). Entries of grid squares whose observations change are thrown out, 
+  // and the ancestors added since the last refresh are listed in birth, as pairs of IDs: the new ancestor, 
+  // then its parent.
+  int keep;
+  short int *birth;
+  int births, birthRoom;
+  // The ancestors of the current particles (other than the root), listed so that each one comes after its
+  // parent: lineageID[i] is an ancestor, and lineageParent[i] is its parent's ID. There are lineages of them,
+  // with room for lineageRoom. See OrderLineage in level.h, which uses lineageEpoch to mark the ancestors
+  // it has already listed.
+  short int *lineageID, *lineageParent;
+  int lineages, lineageRoom, lineageEpoch;
+};
+typedef struct TObservationCache_struct TObservationCache;
+
+static inline short int *ObservationEntry(TObservationCache *cache, int i)
+{
+  return cache->observationArray[i >> OBS_BLOCK_BITS] + (i & (OBS_BLOCK-1))*cache->width;
+}
+
+static inline short int *ObservationPos(TObservationCache *cache, int i)
+{
+  return cache->observationArray[i >> OBS_BLOCK_BITS] + OBS_BLOCK*cache->width + 2*(i & (OBS_BLOCK-1));
+}
+
+
+// One grid square that a line trace passes through, and what it adds to the observation of the square:
+// the distance travelled through it, and whether the laser stopped there (hit).
+// All of the laser casts of a scan start from the same place, so the grid squares near the robot are
+// passed through by many of them. Once a scan has been traced, the updates to the same grid square are
+// linked together (see CoalesceUpdates), so that the square only has to be looked up once. next is the 
+// next update to the same grid square (-1 for none), and repeat is set for all but the first of them.
+struct TMapUpdate_struct {
+  double distance;
+  int x, y, next;
+  char hit, repeat;
+};
+typedef struct TMapUpdate_struct TMapUpdate;
+
+// An open hash table of grid squares, for CoalesceUpdates. A slot is in use if its stamp is the current
+// epoch, so that the table doesn't have to be cleared out for each scan. last is the index of the latest
+// update to the grid square in key.
+struct TSquareTable_struct {
+  long long *key;
+  int *stamp, *last;
+  int mask, epoch;
+};
+typedef struct TSquareTable_struct TSquareTable;
+
+// Adding a generation's scans to the map (see InsertScans in levelMap.h) can be spread across several 
+// threads. The grid squares are dealt out among INSERT_STRIPES stripes, in blocks INSERT_BLOCK squares 
+// across, and each stripe is worked on by a single thread, which adds every particle's updates to its 
+// own grid squares, in the order of the particles. Each grid square then ends up exactly as if the 
+// particles had been added one at a time. 
+// The one thing that the stripes would otherwise share is the list of altered squares of each particle's
+// ancestor. While the stripes are running, a new observation is instead listed on its stripe (entry), 
+// and its source is STRIPE_SOURCE of that place. Afterwards, each particle collects its new observations 
+// from all of the stripes, in order, onto its own list.
+// Each level keeps one of these, with room that grows as needed.
+#define INSERT_BLOCK_BITS 4
+#define INSERT_STRIPE_BITS 4
+#define INSERT_STRIPES (1 << INSERT_STRIPE_BITS)
+#define STRIPE_SOURCE(stripe, index) (-1 - (((index) << INSERT_STRIPE_BITS) + (stripe)))
+#define SOURCE_STRIPE(source) ((-1 - (source)) & (INSERT_STRIPES-1))
+#define SOURCE_INDEX(source) ((-1 - (source)) >> INSERT_STRIPE_BITS)
+
+// Whether the scans are added to the map by stripes (the default), rather than one particle at a time. 
+// -i option in slam.cpp.
+extern int PARALLEL_INSERT;
+
+struct TInsertion_struct {
+  // The scan being added, and the number of particles adding it.
+  TSenseSample *sense;
+  int particles, particleRoom;
+  // The grid squares that each particle's scan passes through, as they are traced (trace), and then 
+  // the first update to each of them, sorted by stripe (update). Those of particle p in stripe s are 
+  // update[p][bucket[p][s]] up to update[p][bucket[p][s+1]], and their next updates are in trace[p]. 
+  // fix[p] is set if any of them are in a tile which hasn't been made yet, or have dead observations,
+  // which need to be dealt with before the stripes can start.
+  TMapUpdate **trace, **update;
+  int *traceRoom, *updateRoom;
+  int (*bucket)[INSERT_STRIPES+1];
+  int *fix;
+  // The observations added by each stripe. The first one for particle p is entry[s][first[s][p]].
+  TEntryList *entry[INSERT_STRIPES];
+  int entries[INSERT_STRIPES], entryRoom[INSERT_STRIPES];
+  int *first[INSERT_STRIPES];
+  // A table for CoalesceUpdates for each of the tables threads.
+  TSquareTable *table;
+  int tables;
+};
+typedef struct TInsertion_struct TInsertion;
+
+// The stripe that the grid square x,y belongs to.
+static inline int SquareStripe(int x, int y)
+{
+  return ((x >> INSERT_BLOCK_BITS)*5 + (y >> INSERT_BLOCK_BITS)) & (INSERT_STRIPES-1);
+}
+
+
+// Drawing a particle's map (see RenderMap in levelMap.h) doesn't look up each grid square in turn, climbing
+// the ancestry tree until some ancestor has an observation there. Instead, it runs down the lists of altered
+// squares of the particle and of each of its ancestors, nearest first, and claims each grid square for the 
+// first observation that it finds there. The claims are kept in a grid of their own (claim, in TMapCanvas),
+// as depth*RENDER_NODES + node + 1, where depth is how far up the lineage the observation was made, and node
+// is its index in the grid square. 0 is unclaimed. Nearer ancestors then have smaller claims, which is what 
+// settles which observation shows, and the claims are cleared again as the squares are shaded, so the
+// grid is only ever touched where the map has been seen.
+#define RENDER_NODES 32768
+
+// The map is drawn onto a canvas, which only covers the area that the lineage has observed. Its grids
+// (shade and claim) are indexed [x][y] from the grid square at x,y, the lower left corner of that area,
+// which is width x height grid squares. They have room for roomWidth x roomHeight, and are made larger
+// whenever the observed area outgrows them. The claims are all 0 between drawings.
+struct TMapCanvas_struct {
+  unsigned char **shade;
+  int **claim;
+  int roomWidth, roomHeight;
+  int x, y, width, height;
+};
+typedef struct TMapCanvas_struct TMapCanvas;
+
+struct TMapRender_struct {
+  TMapCanvas *canvas;
+  // The length of trace that the densities are shown for.
+  double distance;
+};
+typedef struct TMapRender_struct TMapRender;
+
+// Whether grid square x,y (of the whole map) is in the area drawn on the canvas.
+static inline int InCanvas(TMapCanvas *canvas, int x, int y)
+{
+  return ((x >= canvas->x) && (x < canvas->x + canvas->width) && (y >= canvas->y) && (y < canvas->y + canvas->height));
+}
+
+
+// The observations in the map (the MapStarters and their arrays of MapNodes) and the lists of altered
+// squares kept by the ancestors (the arrays of TEntryList) are made and thrown away constantly, as the 
+// arrays grow and shrink. Rather than going to malloc for each of these, each level takes them from its 
+// own pool. A pool hands out blocks from large chunks, and keeps the blocks that are given back on a list 
+// for each size class, to be handed out again. The size classes are 8 bytes apart up to 128 bytes, and 
+// then four to each doubling of size. At the end of a low level segment, the whole pool is thrown out at 
+// once with PoolReset, rather than giving back each block.
+// Unlike malloc, the size of a block has to be given when it is freed (any size in the same class will do).
+// Pools are normally only used by the thread updating the map, and aren't locked. While several threads are
+// adding observations to the map at once (see InsertScans in levelMap.h), shared is set, and every block 
+// is taken and given back under lock.
+#define POOL_CHUNK (1 << 20)
+#define POOL_CLASSES 96
+
+struct TPool_struct {
+  // The blocks which have been given back, for each size class. Each free block starts with a pointer to
+  // the next one.
+  void *freeList[POOL_CLASSES];
+  // The part of the current chunk which hasn't been handed out yet
+  char *next, *end;
+  // Every chunk that the pool has, so that they can be given back.
+  char **chunk;
+  int chunks, room;
+  int shared;
+  pthread_mutex_t lock;
+};
+typedef struct TPool_struct TPool;
+
+// The size class for a block of size bytes.
+static inline int PoolClass(size_t size)
+{
+  int bits;
+
+  if (size <= 128)
+    return (size <= 8) ? 0 : (int) ((size-1) >> 3);
+  bits = 63 - __builtin_clzl(size-1);
+  return 16 + (bits-7)*4 + (int) (((size-1) >> (bits-2)) & 3);
+}
+
+// The size of the blocks handed out for the size class.
+static inline size_t PoolClassSize(int c)
+{
+  int bits;
+
+  if (c < 16)
+    return (c+1)*8;
+  bits = 7 + (c-16)/4;
+  return ((size_t) 1 << bits) + ((size_t) ((c-16)%4 + 1) << (bits-2));
+}
+
+// Takes a new chunk for the pool, and returns a block of class c from it. Called by PoolTake.
+void *PoolGrow(TPool *pool, int c);
+
+// Takes a block of class c from the pool, without locking it. Called by PoolAlloc.
+static inline void *PoolTake(TPool *pool, int c)
+{
+  void *block;
+
+  block = pool->freeList[c];
+  if (block != NULL) {
+    pool->freeList[c] = *((void **) block);
+    return block;
+  }
+  if (pool->next + PoolClassSize(c) > pool->end)
+    return PoolGrow(pool, c);
+  block = pool->next;
+  pool->next = pool->next + PoolClassSize(c);
+  return block;
+}
+
+// Returns a block of at least size bytes from the pool.
+static inline void *PoolAlloc(TPool *pool, size_t size)
+{
+  void *block;
+
+  if (!pool->shared)
+    return PoolTake(pool, PoolClass(size));
+  pthread_mutex_lock(&(pool->lock));
+  block = PoolTake(pool, PoolClass(size));
+  pthread_mutex_unlock(&(pool->lock));
+  return block;
+}
+
+// Gives a block of size bytes back to the pool. block may be NULL.
+static inline void PoolFree(TPool *pool, void *block, size_t size)
+{
+  int c;
+
+  if (block == NULL)
+    return;
+  c = PoolClass(size);
+  if (pool->shared)
+    pthread_mutex_lock(&(pool->lock));
+  *((void **) block) = pool->freeList[c];
+  pool->freeList[c] = block;
+  if (pool->shared)
+    pthread_mutex_unlock(&(pool->lock));
+}
+
+
+// Reads sizes from a configuration file. Each line holds the name of one of the sizes above
+// and its value, for example "PARTICLE_NUMBER 100". Blank lines and anything after a '#' 
+// are ignored. Returns -1 if the file can't be read or has a line that isn't understood.
+int ReadMapConfig(char *name);
+// Fills in any derived sizes, and checks that they all make sense. Returns -1 if the sizes can't be used.
+int InitMapSizes();
+// Allocates a width x height array of elements of the given size, all set to zero, which can be 
+// indexed as grid[x][y]. The elements are in one contiguous block, starting at grid[0][0].
+void **AllocateGrid(int width, int height, int size);
+void FreeGrid(void **grid);
+// Sets up a canvas (see TMapCanvas) with room for width x height grid squares to start with.
+void InitMapCanvas(TMapCanvas *canvas, int width, int height);
+// Makes sure that the canvas has room for width x height grid squares.
+void CanvasRoom(TMapCanvas *canvas, int width, int height);
+
+// Sets up an empty grid. Returns -1 if it can't be allocated.
+int InitGrid(TGrid *grid);
+// Returns the grid square x,y of the grid, making its tile if need be. Returns NULL if x,y is outside 
+// of the range that a grid can cover.
+TGridCell *TouchGridCell(TGrid *grid, int x, int y);
+// Frees all of the tiles of the grid, leaving it empty. The observations in them are left alone, and
+// should either be freed first, or go with their pool (see PoolReset).
+void ClearGrid(TGrid *grid);
+
+// Empties the segment log, keeping its arrays.
+void ClearSegmentLog(TSegmentLog *log);
+// Adds an observation to the end of the segment log.
+void AddLogSense(TSegmentLog *log, TSense sense);
+// Makes the segment log hold steps steps of the path, and returns them to be filled in.
+TPath *SizeLogPath(TSegmentLog *log, int steps);
+
+// Links together the updates in the list which are to the same grid square, in the order that they
+// come in the list, filling in next and repeat (see TMapUpdate). The table is made larger if need be.
+void CoalesceUpdates(TSquareTable *table, TMapUpdate update[], int count);
+
+// Sets up an empty pool.
+void InitPool(TPool *pool);
+// Gives back every block of the pool at once, along with the memory that they came from.
+void PoolReset(TPool *pool);
 
-// The number of entries of observationArray currently being used.
-extern int observationID;
+// Sets up an empty observation cache, with entries ids wide, and starting with room for AREA entries.
+// Returns -1 if it can't be allocated.
+int InitObservationCache(TObservationCache *cache, int ids);
+// Makes sure that the observation cache has an entry for index here, adding more entries if need be.
+// Several threads may call this at once.
+void GrowObservationCache(TObservationCache *cache, int here);
+// Gives back the blocks of the observation cache that are well past the used entries which are still needed,
+// keeping at least AREA entries. Must be called while no other thread is using the cache.
+void TrimObservationCache(TObservationCache *cache, int used);
+// Notes that the ancestor child has been added to the tree under parent, if the cache is being kept.
+void AddObservationBirth(TObservationCache *cache, int child, int parent);
+// Should be called whenever the number of IDs at a level has grown, in order to make the entries of
+// its observation cache wide enough for the new IDs. The cache must be empty at the time (that is,
+// InitializeFlags has just been called).
+void WidenObservationCache(TObservationCache *cache, int ids);
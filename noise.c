@@ -0,0 +1,167 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// noise.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// The random number streams and the Gaussian noise. See noise.h for the interface.
+//
+
+#include "basic.h"
+#include "mt-rand.h"
+#include "noise.h"
+
+int NOISE = NOISE_XOSHIRO;
+
+// The seed that every stream's key is worked out from.
+static unsigned long long noiseSeed = 0;
+
+// The increment of the SplitMix64 counter (2^64 divided by the golden ratio).
+#define GOLDEN 0x9E3779B97F4A7C15ULL
+
+
+static inline unsigned long long Rotate(unsigned long long x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+
+//
+// Mix
+//
+// The mixing function of SplitMix64. Every bit of the result depends on every bit of z.
+//
+static inline unsigned long long Mix(unsigned long long z)
+{
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+
+//
+// StreamNext
+//
+// The next 64 random bits from the stream. This is SplitMix64, with the key as its starting point.
+//
+static inline unsigned long long StreamNext(TStream *stream)
+{
+  stream->counter++;
+  return Mix(stream->key + stream->counter*GOLDEN);
+}
+
+
+void InitNoise(int generator, unsigned long long seed)
+{
+  NOISE = generator;
+  noiseSeed = seed;
+}
+
+
+void OpenStream(TStream *stream, int purpose, int generation, int index)
+{
+  stream->key = Mix(Mix(Mix(noiseSeed + GOLDEN + (unsigned long long) purpose) + (unsigned) generation) + (unsigned) index);
+  stream->counter = 0;
+}
+
+
+double StreamDec(TStream *stream)
+{
+  if (NOISE == NOISE_MT)
+    return MTrandDec();
+  return (StreamNext(stream) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+
+//
+// StepLanes
+//
+// Steps every lane of the xoshiro256+ state once, giving a uniform draw in (0, 1] from each. Word w of
+// lane l is at lane[w][l], so that each step is the same operation on NOISE_LANES neighbouring values.
+// The top 53 bits are used, since the lowest bits of xoshiro256+ are weak.
+//
+static inline void StepLanes(unsigned long long lane[4][NOISE_LANES], double u[NOISE_LANES])
+{
+  unsigned long long result, t;
+  int l;
+
+  for (l = 0; l < NOISE_LANES; l++) {
+    result = lane[0][l] + lane[3][l];
+    t = lane[1][l] << 17;
+    lane[2][l] = lane[2][l] ^ lane[0][l];
+    lane[3][l] = lane[3][l] ^ lane[1][l];
+    lane[1][l] = lane[1][l] ^ lane[2][l];
+    lane[0][l] = lane[0][l] ^ lane[3][l];
+    lane[2][l] = lane[2][l] ^ t;
+    lane[3][l] = Rotate(lane[3][l], 45);
+    u[l] = ((result >> 11) + 1) * (1.0 / 9007199254740992.0);
+  }
+}
+
+
+//
+// FillBlock
+//
+// Fills out[0..NOISE_BLOCK-1] with standard normal deviates from the given stream, which seeds the lanes.
+// Each Box-Muller transform gives two deviates from every lane.
+//
+static void FillBlock(double out[NOISE_BLOCK], TStream *stream)
+{
+  unsigned long long lane[4][NOISE_LANES];
+  double u1[NOISE_LANES], u2[NOISE_LANES], radius[NOISE_LANES];
+  int i, w, l;
+
+  for (l = 0; l < NOISE_LANES; l++)
+    for (w = 0; w < 4; w++)
+      lane[w][l] = StreamNext(stream);
+
+  for (i = 0; i < NOISE_BLOCK; i = i + 2*NOISE_LANES) {
+    StepLanes(lane, u1);
+    StepLanes(lane, u2);
+    for (l = 0; l < NOISE_LANES; l++)
+      radius[l] = sqrt(-2.0 * log(u1[l]));
+    for (l = 0; l < NOISE_LANES; l++) {
+      out[i+2*l] = radius[l] * cos(2.0 * M_PI * u2[l]);
+      out[i+2*l+1] = radius[l] * sin(2.0 * M_PI * u2[l]);
+    }
+  }
+}
+
+
+void GaussianBatch(double out[], int n, const double deviation[], int period, int purpose, int generation)
+{
+  GaussianRange(out, 0, n, deviation, period, purpose, generation);
+}
+
+
+
+void GaussianRange(double out[], int first, int n, const double deviation[], int period, int purpose, int generation)
+{
+  double block[NOISE_BLOCK];
+  TStream stream;
+  int i, b;
+
+  if (NOISE == NOISE_MT) {
+    for (i = first; i < first+n; i++)
+      out[i] = GAUSSIAN(deviation[i % period]);
+    return;
+  }
+
+  // Only the blocks which overlap the range are made, but each of those is made in full.
+  for (b = first/NOISE_BLOCK; b*NOISE_BLOCK < first+n; b++) {
+    OpenStream(&stream, purpose, generation, b);
+    FillBlock(block, &stream);
+    for (i = MAX(first, b*NOISE_BLOCK); (i < first+n) && (i < (b+1)*NOISE_BLOCK); i++)
+      out[i] = block[i - b*NOISE_BLOCK] * deviation[i % period];
+  }
+}
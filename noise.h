@@ -0,0 +1,78 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// noise.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// The random numbers used by both levels: the Gaussian noise of the motion models, drawn a whole
+// generation's worth at a time, and the uniform draws for resampling.
+//
+// The original code took every random number from one Mersenne Twister, in whatever order it was
+// asked for, so that no two pieces of work could draw at the same time without changing the results.
+// Instead, every random number is now fixed by where it is used: a purpose (one of the STREAM_
+// values below), the generation, and an index within that generation. Each of these has its own
+// stream, and the numbers in a stream are just a counter run through the SplitMix64 mixing function,
+// so any of them can be worked out without drawing any of the others. Which thread does the work,
+// or in what order, makes no difference.
+//
+// The Gaussian noise is made in blocks of NOISE_BLOCK deviates, each from its own stream. Inside a
+// block, several xoshiro256+ generators run side by side in lanes, so that the compiler can step them
+// all at once with vector instructions, and each pair of uniform draws is turned into a pair of exact
+// normal deviates by the Box-Muller transform. The original approximation (GAUSSIAN in basic.h) took
+// six draws from the Mersenne Twister for every deviate.
+//
+
+// The ways of drawing the random numbers.
+// Everything from the one Mersenne Twister, as it always has been, with the sum of six uniform draws
+// for each Gaussian deviate. Gives exactly the same results as earlier versions, for comparing runs
+// (-g option in slam.cpp).
+#define NOISE_MT 0
+// Counter based streams, with xoshiro256+ and Box-Muller for the Gaussian noise. The default.
+#define NOISE_XOSHIRO 1
+
+// The number of xoshiro256+ generators stepped together.
+#define NOISE_LANES 4
+// The number of Gaussian deviates made from each stream. A multiple of 2*NOISE_LANES.
+#define NOISE_BLOCK 64
+
+// What each stream is used for.
+#define STREAM_LOW_MOTION 0
+#define STREAM_HIGH_MOTION 1
+#define STREAM_LOW_RESAMPLE 2
+#define STREAM_HIGH_RESAMPLE 3
+#define STREAM_LOW_ORDER 4
+
+// Which of the above generators is in use.
+extern int NOISE;
+
+// A stream of uniform random numbers. key identifies it, and counter is how many have been drawn.
+struct TStream_struct {
+  unsigned long long key, counter;
+};
+typedef struct TStream_struct TStream;
+
+// Selects the generator, and the seed that all of the streams are worked out from.
+void InitNoise(int generator, unsigned long long seed);
+// Sets up the stream for the given purpose, generation and index, from its start.
+void OpenStream(TStream *stream, int purpose, int generation, int index);
+// The next uniform draw in [0, 1) from the stream. For NOISE_MT, this is simply MTrandDec().
+double StreamDec(TStream *stream);
+// Fills out[0..n-1] with normal deviates with a mean of 0, where out[i] has a standard deviation of
+// deviation[i % period]. Block b (out[b*NOISE_BLOCK] onwards) comes from the stream for the given
+// purpose and generation, with an index of b. For NOISE_MT, out[i] is exactly GAUSSIAN(deviation[i % period]),
+// drawn in order.
+void GaussianBatch(double out[], int n, const double deviation[], int period, int purpose, int generation);
+// Fills out[first..first+n-1] with the same deviates that GaussianBatch would put there, so that a batch can
+// be drawn a piece at a time. For NOISE_MT, this only holds if the pieces are drawn in order, with nothing
+// else drawn in between.
+void GaussianRange(double out[], int first, int n, const double deviation[], int period, int purpose, int generation);
@@ -0,0 +1,350 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// rays.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Finding the grid squares crossed by a line trace. See rays.h for the interface.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "map.h"
+#include "rays.h"
+
+
+int TraceSquares(double startx, double starty, double theta, double MeasuredDist, float culling,
+			   int *cellX, int *cellY, double *dist, double *error, int stride)
+{
+  double overflow, slope;
+  int x, y, incX, incY, endx, endy, n;
+  double dx, dy, distance;
+  double secant, cosecant;
+  double xblock, yblock;
+  double xMotion, yMotion;
+  double standardDist;
+
+  n = 0;
+  secant = 1.0/fabs(cos(theta));
+  cosecant = 1.0/fabs(sin(theta));
+
+  if (culling)
+    distance = MeasuredDist+culling;
+  else
+    distance = MIN(MeasuredDist+20.0, MAX_SENSE_RANGE);
+
+  dx = (startx + (cos(theta) * distance));
+  dy = (starty + (sin(theta) * distance));
+  endx = (int) (dx);
+  endy = (int) (dy);
+
+  if (startx > dx) {
+    incX = -1;
+    xblock = -startx;
+  }
+  else {
+    incX = 1;
+    xblock = 1.0-startx;
+  }
+  
+  if (starty > dy) {
+    incY = -1;
+    yblock = -starty;
+  }
+  else {
+    incY = 1;
+    yblock = 1.0-starty;
+  }
+
+  // (See the corresponding comments in LineTrace, in levelMap.h)
+  if (fabs(startx - dx) > fabs(starty - dy)) {
+    y = (int) (starty);
+    overflow = starty - y;
+    if (incY == 1) 
+      overflow = 1.0 - overflow;
+
+    slope = fabs(tan(theta));
+    if (slope > 1.0) 
+      slope = fabs((starty - dy) / (startx - dx));
+
+    dx = fabs((int)(startx)+xblock);
+    dy = fabs(tan(theta)*dx);
+    if (overflow - dy < 0.0) {
+      y = y + incY;
+      overflow = overflow - dy + 1.0;
+    }
+    else 
+      overflow = overflow - dy;
+
+    standardDist = slope*cosecant;
+    xMotion = -fabs(fabs(( ((int) (startx)) +xblock) * secant) - MeasuredDist);
+    yMotion = -fabs(fabs((y+yblock) * cosecant) - MeasuredDist);
+
+    for (x = (int) (startx) + incX; x != endx; x = x + incX) {
+      xMotion = xMotion + secant;
+      overflow = overflow - slope;
+
+      cellX[n*stride] = x;
+      cellY[n*stride] = y;
+      if (overflow < 0.0) {
+	dist[n*stride] = (overflow+slope)*cosecant;
+	error[n*stride] = fabs(yMotion);
+      }
+      else {
+	dist[n*stride] = standardDist;
+	error[n*stride] = fabs(xMotion);
+      }
+      n++;
+    
+      if (overflow < 0.0) {
+	y += incY;
+	yMotion = yMotion + cosecant;
+
+	cellX[n*stride] = x;
+	cellY[n*stride] = y;
+	dist[n*stride] = -overflow*cosecant;
+	error[n*stride] = fabs(xMotion);
+	n++;
+	overflow = overflow + 1.0;
+      }
+    }
+  }
+
+  else {
+    x = (int) (startx);
+    overflow = startx - x;
+    if (incX == 1)
+      overflow = 1.0 - overflow;
+    slope = 1.0/fabs(tan(theta));
+
+    dy = fabs((int)(starty)+yblock);
+    dx = fabs(dy/tan(theta));
+    if (overflow - dx < 0) {
+      x = x + incX;
+      overflow = overflow - dx + 1.0;
+    }
+    else 
+      overflow = overflow - dx;
+
+    standardDist = slope*secant;
+    xMotion = -fabs(fabs((x+xblock) * secant) - MeasuredDist);
+    yMotion = -fabs(fabs(( ((int) (starty)) +yblock) * cosecant) - MeasuredDist);
+
+    for (y = (int) (starty) + incY; y != endy; y = y + incY) {
+      yMotion = yMotion + cosecant;
+      overflow = overflow - slope;
+
+      cellX[n*stride] = x;
+      cellY[n*stride] = y;
+      if (overflow < 0.0) {
+	dist[n*stride] = (overflow+slope)*secant;
+	error[n*stride] = fabs(xMotion);
+      }
+      else {
+	dist[n*stride] = standardDist;
+	error[n*stride] = fabs(yMotion);
+      }
+      n++;
+    
+      if (overflow < 0.0) {
+	x += incX;
+	xMotion = xMotion + secant;
+
+	cellX[n*stride] = x;
+	cellY[n*stride] = y;
+	dist[n*stride] = -overflow*secant;
+	error[n*stride] = fabs(yMotion);
+	n++;
+	overflow = overflow + 1.0;
+      }
+    }
+  }
+
+  return n;
+}
+
+
+
+
+//
+// Adds one grid square to the list of updates for TraceUpdates, and returns the new length of the list.
+//
+static inline int NoteUpdate(TMapUpdate update[], int count, int x, int y, double distance, int hit)
+{
+  update[count].x = x;
+  update[count].y = y;
+  update[count].distance = distance;
+  update[count].hit = hit;
+  return count+1;
+}
+
+
+//
+// This is the walk through the grid that AddTrace (in levelMap.h) has always made to add a laser scan 
+// to the map. Rather than updating each grid square as it goes, it lists them in update[].
+//
+int TraceUpdates(double startx, double starty, double MeasuredDist, double theta, int addEnd, TMapUpdate update[])
+{
+  double overflow, slope; // Used for actually tracing the line
+  int x, y, incX, incY, endx, endy;
+  int xedge, yedge;       // Used in computing the midpoint. Recompensates for which edge of the square the line entered from
+  double dx, dy;
+  double distance, error;
+  double secant, cosecant;   // precomputed for speed
+  int count;
+
+  count = 0;
+
+  // Precomute a few numbers for speed.
+  secant = 1.0/fabs(cos(theta));
+  cosecant = 1.0/fabs(sin(theta));
+
+  // This allows the user to limit the effective range of the sensor
+  distance = MIN(MeasuredDist, MAX_SENSE_RANGE);
+
+  // Mark the final endpoint of the line trace, so that we know when to stop.
+  // We keep the endpoint as both float and int.
+  dx = (startx + (cos(theta) * distance));
+  dy = (starty + (sin(theta) * distance));
+  endx = (int) (dx);
+  endy = (int) (dy);
+
+  // Decide which x and y directions the line is travelling.
+  // inc tells us which way to increment x and y. edge indicates whether we are computing
+  // distance from the near or far edge.
+  if (startx > dx) {
+    incX = -1;
+    xedge = 1;
+  }
+  else {
+    incX = 1;
+    xedge = 0;
+  }
+
+  if (starty > dy) {
+    incY = -1;
+    yedge = 1;
+  }
+  else {
+    incY = 1;
+    yedge = 0;
+  }
+
+  // Figure out whether primary motion is in the x or y direction.
+  // The two sections of code look nearly identical, with x and y reversed.
+  if (fabs(startx - dx) > fabs(starty - dy)) {
+    // The given starting point is non-integer. The line therefore starts at some point partially set in to the starting
+    // square. Overflow starts at this offcenter amount, in order to make steps in the y direction at the right places.
+    y = (int) (starty);
+    overflow =  starty - y;
+    // We always use overflow as a decreasing number- therefore positive y motion needs to
+    // adjust the overflow value accordingly.
+    if (incY == 1)
+      overflow = 1.0 - overflow;
+    // Compute the effective slope of the line.
+    slope = fabs(tan(theta));
+    if (slope > 1.0)
+      slope = fabs((starty - dy) / (startx - dx));
+
+    // The first square is a delicate thing, as we aren't doing a full square traversal in
+    // either direction. So we figure out this strange portion of a step so that we can then
+    // work off of the axes later.
+    // NOTE: we aren't computing the probability of this first step. Its a technical issue for
+    // simplicity, and the odds of the sensor sitting on top of a solid object are sufficiently
+    // close to zero to ignore this tiny portion of a step.
+    error = fabs(((int)(startx)+incX+xedge)-startx);
+    overflow = overflow - (slope*error);
+    // The first step is actually in the y direction, due to the proximity of starty to the y axis.
+    if (overflow < 0.0) {
+      y = y + incY;
+      overflow = overflow + 1.0;
+    }
+
+    // Now we can start the actual line trace.
+    for (x = (int) (startx) + incX; x != endx; x = x + incX) {
+      overflow = overflow - slope;
+
+      // Compute the distance travelled in this square
+      if (overflow < 0.0)
+	distance = (overflow+slope)*cosecant;
+      else
+	distance = fabs(slope)*cosecant;
+      // Update every grid square we cross as empty...
+      count = NoteUpdate(update, count, x, y, distance, 0);
+
+      // ...including the overlap in the minor direction
+      if (overflow < 0) {
+	y = y + incY;
+	distance = -overflow*cosecant;
+	overflow = overflow + 1.0;
+	count = NoteUpdate(update, count, x, y, distance, 0);
+      }
+    }
+
+    // Update the last grid square seen as having a hit.
+    if (addEnd) {
+      if (incX < 0)
+	distance = fabs((x+1) - dx)*secant;
+      else
+	distance = fabs(dx - x)*secant;
+      count = NoteUpdate(update, count, endx, endy, distance, 1);
+    }
+
+  }
+
+  // This is the same as the previous block of code, with x and y reversed.
+  else {
+    x = (int) (startx);
+    overflow = startx - x;
+    if (incX == 1)
+      overflow = 1.0 - overflow;
+    slope = 1.0/fabs(tan(theta));
+
+    // (See corresponding comments in the previous half of this function)
+    error = fabs(((int)(starty)+incY+yedge)-starty);
+    overflow = overflow - (error*slope);
+    if (overflow < 0.0) {
+      x = x + incX;
+      overflow = overflow + 1.0;
+    }
+
+    for (y = (int) (starty) + incY; y != endy; y = y + incY) {
+      overflow = overflow - slope;
+      if (overflow < 0)
+	distance = (overflow+slope)*secant;
+      else
+	distance = fabs(slope)*secant;
+
+      count = NoteUpdate(update, count, x, y, distance, 0);
+
+      if (overflow < 0.0) {
+	x = x + incX;
+	distance = -overflow*secant;
+	overflow = overflow + 1.0;
+	count = NoteUpdate(update, count, x, y, distance, 0);
+      }
+    }
+
+    if (addEnd) {
+      if (incY < 0)
+	distance = fabs(((y+1) - dy)/sin(theta));
+      else
+	distance = fabs((dy - y)/sin(theta));
+      count = NoteUpdate(update, count, endx, endy, distance, 1);
+    }
+  }
+
+  return count;
+}
+
@@ -0,0 +1,40 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// rays.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Finding the grid squares crossed by a line trace, without evaluating them.
+//
+
+// The most grid squares that a single line trace can cross: one step in the primary direction
+// for each grid square of range, plus possibly one step in the minor direction for each of those.
+#define MAX_TRACE_STEPS (2*((int) (MAX_SENSE_RANGE) + 4))
+
+// Walks exactly the same path through the grid as LineTrace (see levelMap.h), but instead of evaluating
+// each grid square as it goes, it records the square, the distance that the trace travels through it, 
+// and the error that the laser would have if it had stopped there. Entries are written stride places 
+// apart, so that several traces can be interleaved in the same arrays. The length of the trace is 
+// chosen from MeasuredDist and culling the same way as in LineTrace. Returns the number of grid squares.
+int TraceSquares(double startx, double starty, double theta, double MeasuredDist, float culling,
+		 int *cellX, int *cellY, double *dist, double *error, int stride);
+
+// The most grid squares that TraceUpdates can list for one trace: those along the way, and the one it stopped in.
+#define MAX_TRACE_UPDATES (MAX_TRACE_STEPS+1)
+
+// Lists the grid squares that a laser scan from startx,starty, at angle theta, which measured MeasuredDist, 
+// passes through, in the order that it passes through them, along with the distance travelled through each 
+// one. If addEnd is set, the laser was stopped by an object, and the last one is a hit. These are the updates
+// that the scan makes to the map (see AddTrace in levelMap.h). Returns the number of grid squares.
+int TraceUpdates(double startx, double starty, double MeasuredDist, double theta, int addEnd, TMapUpdate update[]);
+
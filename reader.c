@@ -0,0 +1,275 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// reader.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Parsing the text data logs, and the reader thread. See reader.h for the interface.
+//
+
+#include <pthread.h>
+#include <string.h>
+#include <charconv>
+#include "laser.h"
+#include "binlog.h"
+#include "reader.h"
+
+long long READER_STALLS = 0;
+long long CONSUMER_STALLS = 0;
+
+// The ring of parsed records. Records [taken, parsed) are ready for SLAM to take. The counts only ever go up,
+// and the record for count n is kept in ring[n % READER_RING].
+static TLogRecord ring[READER_RING];
+static long long parsed, taken;
+// Set by the reader once it reaches the end of the log, and by StopLogReader to stop it early.
+static int finished, stopping;
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ringReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t ringRoom = PTHREAD_COND_INITIALIZER;
+static pthread_t reader;
+static FILE *readerFile;
+static int readerFormat;
+
+
+//
+// SkipField
+//
+// Moves past the next field of the line, and the spaces in front of it.
+//
+static inline char *SkipField(char *p)
+{
+  while ((*p == ' ') || (*p == '\t'))
+    p++;
+  while ((*p != '\0') && (*p != ' ') && (*p != '\t') && (*p != '\n') && (*p != '\r'))
+    p++;
+  return p;
+}
+
+
+//
+// ReadNumber
+//
+// Reads the next field of the line as a number, and moves past it. Like atof, any characters after the
+// number in the field are ignored, and a field which doesn't start with a number reads as 0.
+//
+static inline double ReadNumber(char *&p)
+{
+  double value;
+  char *start, *end;
+
+  while ((*p == ' ') || (*p == '\t'))
+    p++;
+  start = p;
+  end = SkipField(p);
+  p = end;
+  // from_chars won't take a leading plus sign, which atof does
+  if (*start == '+')
+    start++;
+  if (std::from_chars(start, end, value).ec != std::errc())
+    return 0.0;
+  return value;
+}
+
+
+int ParseLogLine(char *line, int format, TLogRecord *record)
+{
+  int i, max;
+  char *p;
+
+  record->kind = BINLOG_SKIP;
+  record->count = 0;
+  p = line;
+
+  if (format == REC) {
+    if (!strncmp(line, "POS", 3)) {
+      p = SkipField(p);   // This is to remove the keyword
+      p = SkipField(p);   // Second item is the time of the reading, in seconds. We don't care.
+      p = SkipField(p);   // Third item is the usecs of the time. We still don't care.
+      // Read x and y coordinates, and convert them from cm to m. 
+      record->pose[0] = ReadNumber(p)/100.0;
+      record->pose[1] = ReadNumber(p)/100.0;
+      // Read the facing angle of the robot, and convert from deg to rad
+      record->pose[2] = ReadNumber(p)*M_PI/180.0;
+
+      if (record->pose[2] > M_PI) 
+	record->pose[2] = record->pose[2] - 2*M_PI;
+      else if (record->pose[2] < -M_PI) 
+	record->pose[2] = record->pose[2] + 2*M_PI;
+
+      record->pose[0] = record->pose[0] - (cos(record->pose[2])*TURN_RADIUS/MAP_SCALE);
+      record->pose[1] = record->pose[1] - (sin(record->pose[2])*TURN_RADIUS/MAP_SCALE);
+      // There are still two parameters here, pitch and yaw, as far as i can tell, but we don't use them. 
+      // I don't think we have any maps to use that even let those two change.
+      record->kind = BINLOG_ODOMETRY;
+    }
+    // Apparently this is also sometimes recorded as 'LASER_RANGE'
+    // We accept anything that starts with LASER
+    else if (!strncmp(line, "LASER", 5)) {
+      p = SkipField(p);   // This is to remove the keyword
+      p = SkipField(p);   // Second item is the time of the reading, in seconds. We don't care.
+      p = SkipField(p);   // Third item is the usecs of the time. We still don't care.
+      i = (int) (ReadNumber(p));   // This item is the laser ID.
+      // We only use the first laser. This can be changed in hard code, but it is rare that
+      // we will try to use anything with multiple lasers. It's just in case.
+      if (i != 0)
+	return record->kind;
+
+      // Here we are reading in the total number of laser readings that will follow. This is usually 180 with
+      // SICK lasers.
+      max = (int) (ReadNumber(p));
+      if (max > SENSE_NUMBER)
+	max = SENSE_NUMBER;
+      // In theory, i don't think that this next item is supposed to be here, but in the Wean Hall data,
+      // i noticed this consistent term of "180.0:" which doesn't seem to mean anything pertinent. I hope.
+      p = SkipField(p);
+      
+      // Now read in the whole list of laser readings. Remember that they are in cm, so translating them to
+      // MAP_SCALE takes an extra 1/100
+      for (i = 0; i < max; i++) {
+	record->range[i] = ReadNumber(p)*MAP_SCALE/100.0;
+	if (record->range[i] > MAX_SENSE_RANGE)
+	  record->range[i] = MAX_SENSE_RANGE;
+      }
+      record->kind = BINLOG_LASER;
+      record->count = max;
+    }
+    else 
+      fprintf(stderr, "Uninterpretable Line (.rec) : \n %s\n", line);
+  }
+
+  // Anything not specified is assumed to our native .log files.
+  else {
+    if (!strncmp(line, "Odometry", 8)) {
+      p = SkipField(p);
+      record->pose[0] = ReadNumber(p);
+      record->pose[1] = ReadNumber(p);
+      record->pose[2] = ReadNumber(p);
+
+      if (record->pose[2] > M_PI) 
+	record->pose[2] = record->pose[2] - 2*M_PI;
+      else if (record->pose[2] < -M_PI) 
+	record->pose[2] = record->pose[2] + 2*M_PI;
+      record->kind = BINLOG_ODOMETRY;
+    }
+    else if (!strncmp(line, "Laser", 5)) {
+      p = SkipField(p);
+      max = (int) (ReadNumber(p));
+      if (max > SENSE_NUMBER)
+	max = SENSE_NUMBER;
+      for (i = 0; i < max; i++) 
+	record->range[i] = ReadNumber(p)*MAP_SCALE;
+      record->kind = BINLOG_LASER;
+      record->count = max;
+    }
+    else 
+      fprintf(stderr, "Uninterpretable Line : \n %s\n", line);
+  }
+
+  return record->kind;
+}
+
+
+//
+// ReaderThread
+//
+// Parses the log a line at a time, straight into the next free record of the ring.
+//
+static void *ReaderThread(void *arg)
+{
+  char line[4096];
+  TLogRecord *record;
+
+  while (1) {
+    pthread_mutex_lock(&ringLock);
+    if ((parsed - taken == READER_RING) && !stopping) {
+      READER_STALLS++;
+      while ((parsed - taken == READER_RING) && !stopping)
+	pthread_cond_wait(&ringRoom, &ringLock);
+    }
+    if (stopping) {
+      pthread_mutex_unlock(&ringLock);
+      break;
+    }
+    record = &ring[parsed % READER_RING];
+    pthread_mutex_unlock(&ringLock);
+
+    // Only the reader touches this record until it is counted as parsed.
+    if (fgets(line, 4096, readerFile) == NULL)
+      break;
+    ParseLogLine(line, readerFormat, record);
+
+    pthread_mutex_lock(&ringLock);
+    parsed++;
+    pthread_cond_signal(&ringReady);
+    pthread_mutex_unlock(&ringLock);
+  }
+
+  pthread_mutex_lock(&ringLock);
+  finished = 1;
+  pthread_cond_signal(&ringReady);
+  pthread_mutex_unlock(&ringLock);
+  return NULL;
+}
+
+
+void StartLogReader(FILE *logFile, int format)
+{
+  readerFile = logFile;
+  readerFormat = format;
+  parsed = taken = 0;
+  finished = stopping = 0;
+  if (pthread_create(&reader, NULL, ReaderThread, NULL) != 0) {
+    fprintf(stderr, "Unable to start the log reader thread.\n");
+    exit(-1);
+  }
+}
+
+
+const TLogRecord *TakeLogRecord()
+{
+  const TLogRecord *record;
+
+  pthread_mutex_lock(&ringLock);
+  if ((parsed == taken) && !finished) {
+    CONSUMER_STALLS++;
+    while ((parsed == taken) && !finished)
+      pthread_cond_wait(&ringReady, &ringLock);
+  }
+  if (parsed == taken)
+    record = NULL;
+  else
+    record = &ring[taken % READER_RING];
+  pthread_mutex_unlock(&ringLock);
+  return record;
+}
+
+
+void ReleaseLogRecord()
+{
+  pthread_mutex_lock(&ringLock);
+  taken++;
+  pthread_cond_signal(&ringRoom);
+  pthread_mutex_unlock(&ringLock);
+}
+
+
+void StopLogReader()
+{
+  pthread_mutex_lock(&ringLock);
+  stopping = 1;
+  pthread_cond_signal(&ringRoom);
+  pthread_mutex_unlock(&ringLock);
+  pthread_join(reader, NULL);
+  fprintf(stderr, "Log reader: %lld records, waited for room %lld times, SLAM waited for records %lld times.\n",
+	  parsed, READER_STALLS, CONSUMER_STALLS);
+}
@@ -0,0 +1,57 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// reader.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Reading the text data logs. When a text log is played back, a thread of its own reads and parses
+// the log ahead of SLAM, into a ring of ready records, so that the SLAM thread only ever has to take
+// the next record off of the ring. The numbers are read with std::from_chars, which gives exactly the
+// same values as atof, without its locale handling.
+//
+
+// The formats of the data logs: our native .log files, the .rec files, and binary logs (see binlog.h).
+#define LOG 0
+#define REC 1
+#define BIN 2
+
+// The number of parsed records that the reader can get ahead of SLAM.
+#define READER_RING 64
+
+// One line of a text log, once it has been interpreted. kind is one of the kinds of record in a
+// binary log (see binlog.h). For BINLOG_ODOMETRY, pose holds the x, y and theta of the odometry. For
+// BINLOG_LASER, range holds the first count laser readings, in grid squares.
+struct TLogRecord_struct {
+  int kind, count;
+  double pose[3];
+  double range[SENSE_NUMBER];
+};
+typedef struct TLogRecord_struct TLogRecord;
+
+// How many times the reader found the ring full, and had to wait for SLAM to take a record, and how
+// many times SLAM found the ring empty, and had to wait for the reader.
+extern long long READER_STALLS, CONSUMER_STALLS;
+
+// Interprets a single line of a text data log of the given format (LOG or REC) by its delineator, and
+// fills in record. If the line is not delineated for some reason, this prints out an error message,
+// and the record is a BINLOG_SKIP. Returns the kind of the record.
+int ParseLogLine(char *line, int format, TLogRecord *record);
+
+// Starts the reader thread, which parses the whole of the given text log, of the given format.
+void StartLogReader(FILE *logFile, int format);
+// Returns the next record from the reader, waiting for it if need be, or NULL at the end of the log.
+// The record stays in place on the ring until ReleaseLogRecord is called.
+const TLogRecord *TakeLogRecord();
+void ReleaseLogRecord();
+// Stops the reader thread, even if it hasn't reached the end of the log, and reports the stalls.
+void StopLogReader();
@@ -0,0 +1,309 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// resample.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// The resampling strategies. See resample.h for the interface.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "basic.h"
+#include "resample.h"
+
+int RESAMPLER = RESAMPLE_MULTINOMIAL;
+int H_RESAMPLER = RESAMPLE_MULTINOMIAL;
+double RESAMPLE_ESS = 0.0;
+double H_RESAMPLE_ESS = 0.0;
+
+static const char *strategyName[RESAMPLE_STRATEGIES] = {"multinomial", "systematic", "stratified", "residual", "alias"};
+
+
+int ResamplerStrategy(const char *name)
+{
+  int i;
+
+  for (i = 0; i < RESAMPLE_STRATEGIES; i++)
+    if (!strcmp(name, strategyName[i]))
+      return i;
+  return -1;
+}
+
+
+int InitResampler(TResampler *resampler, int strategy, double ess, int room)
+{
+  resampler->strategy = strategy;
+  resampler->ess = ess;
+  resampler->room = room;
+  resampler->skipped = 0;
+  resampler->stream.key = 0;
+  resampler->stream.counter = 0;
+  resampler->weight = (double *) malloc(room * sizeof(double));
+  resampler->cumulative = (double *) malloc(room * sizeof(double));
+  resampler->keep = (double *) malloc(room * sizeof(double));
+  resampler->alias = (int *) malloc(room * sizeof(int));
+  resampler->work = (int *) malloc(room * sizeof(int));
+  resampler->count = (int *) malloc(room * sizeof(int));
+  if ((resampler->weight == NULL) || (resampler->cumulative == NULL) || (resampler->keep == NULL) ||
+      (resampler->alias == NULL) || (resampler->work == NULL) || (resampler->count == NULL)) {
+    fprintf(stderr, "Unable to allocate room for resampling %d samples.\n", room);
+    return -1;
+  }
+  return 0;
+}
+
+
+double EffectiveSampleSize(const double weight[], int n)
+{
+  double sum, squares;
+  int i;
+
+  sum = squares = 0.0;
+  for (i = 0; i < n; i++) {
+    sum = sum + weight[i];
+    squares = squares + weight[i]*weight[i];
+  }
+  if (squares == 0.0)
+    return 0.0;
+  return sum*sum/squares;
+}
+
+
+//
+// Fills in the running totals of the n values, and returns the total.
+//
+static double Accumulate(const double value[], double cumulative[], int n)
+{
+  double total;
+  int i;
+
+  total = 0.0;
+  for (i = 0; i < n; i++) {
+    total = total + value[i];
+    cumulative[i] = total;
+  }
+  return total;
+}
+
+
+//
+// Finds the first sample whose running total reaches u, by bisection. A sample with no weight
+// has the same running total as the one before it, so it can never be picked this way.
+//
+static int Search(const double cumulative[], int n, double u)
+{
+  int low, high, middle;
+
+  low = 0;
+  high = n-1;
+  while (low < high) {
+    middle = (low + high) / 2;
+    if (cumulative[middle] >= u)
+      high = middle;
+    else
+      low = middle + 1;
+  }
+  return low;
+}
+
+
+//
+// Builds the alias table for the n weights (Vose's method). Each of the n columns has an equal
+// chance of being picked, and then keeps its own sample with chance keep[i], or else gives
+// alias[i]. Samples which need less than a full column are set aside from the front of work,
+// and those which need more from the back.
+//
+static void BuildAlias(TResampler *resampler, int n, double total)
+{
+  double *scaled = resampler->cumulative;
+  int *work = resampler->work;
+  int small, large, i, s, l;
+
+  small = 0;
+  large = n;
+  for (i = 0; i < n; i++) {
+    scaled[i] = resampler->weight[i] * n / total;
+    if (scaled[i] < 1.0)
+      work[small++] = i;
+    else
+      work[--large] = i;
+  }
+
+  while ((small > 0) && (large < n)) {
+    s = work[--small];
+    l = work[large++];
+    resampler->keep[s] = scaled[s];
+    resampler->alias[s] = l;
+    // The large sample gives up what it took to fill out this column
+    scaled[l] = (scaled[l] + scaled[s]) - 1.0;
+    if (scaled[l] < 1.0)
+      work[small++] = l;
+    else
+      work[--large] = l;
+  }
+
+  // Whatever is left over only differs from a full column by rounding.
+  while (small > 0) {
+    s = work[--small];
+    resampler->keep[s] = 1.0;
+    resampler->alias[s] = s;
+  }
+  while (large < n) {
+    l = work[large++];
+    resampler->keep[l] = 1.0;
+    resampler->alias[l] = l;
+  }
+}
+
+
+//
+// Draws the children one at a time, each independently of the others. This is the only way that the
+// original code's stopping rule (once enough different samples have been picked) can be followed exactly.
+//
+static int DrawEach(TResampler *resampler, int n, int draws, int parents, int children[], double total)
+{
+  double u;
+  int i, j, k, picked;
+
+  if (resampler->strategy == RESAMPLE_ALIAS)
+    BuildAlias(resampler, n, total);
+
+  picked = 0;
+  for (i = 0; i < n; i++)
+    if (children[i] > 0)
+      picked++;
+
+  for (j = 0; (j < draws) && ((parents <= 0) || (picked < parents)); j++) {
+    if (resampler->strategy == RESAMPLE_ALIAS) {
+      u = StreamDec(&resampler->stream) * n;
+      k = MIN((int) u, n-1);
+      if (u - k >= resampler->keep[k])
+	k = resampler->alias[k];
+    }
+    else
+      k = Search(resampler->cumulative, n, StreamDec(&resampler->stream)*total);
+
+    if (children[k] == 0)
+      picked++;
+    children[k]++;
+  }
+  return j;
+}
+
+
+//
+// Works out all of the children at once into resampler->count, walking up the running totals
+// alongside the evenly spaced draws. For stratified resampling, each draw has its own random offset
+// within its slice. For systematic resampling, they all share one, and when the resampling is skipped,
+// the draws are simply in the middle of each slice.
+//
+static void DrawSpaced(TResampler *resampler, int n, int draws, double total, int skipped)
+{
+  double step, offset, u;
+  int j, k;
+
+  step = total / draws;
+  offset = skipped ? 0.5 : StreamDec(&resampler->stream);
+  k = 0;
+  for (j = 0; j < draws; j++) {
+    if (resampler->strategy == RESAMPLE_STRATIFIED && !skipped)
+      offset = StreamDec(&resampler->stream);
+    u = (j + offset) * step;
+    while ((k < n-1) && (resampler->cumulative[k] < u))
+      k++;
+    resampler->count[k]++;
+  }
+}
+
+
+//
+// Gives each sample the whole part of the number of children it is expected to have, and then draws
+// the rest independently, in proportion to what was left over.
+//
+static void DrawResidual(TResampler *resampler, int n, int draws, double total)
+{
+  double expected, remainder;
+  int i, j, rest;
+
+  rest = draws;
+  for (i = 0; i < n; i++) {
+    expected = draws * resampler->weight[i] / total;
+    resampler->count[i] = (int) expected;
+    resampler->keep[i] = expected - resampler->count[i];
+    rest = rest - resampler->count[i];
+  }
+
+  remainder = Accumulate(resampler->keep, resampler->cumulative, n);
+  for (j = 0; j < rest; j++)
+    resampler->count[Search(resampler->cumulative, n, StreamDec(&resampler->stream)*remainder)]++;
+}
+
+
+int Resample(TResampler *resampler, int n, int draws, int parents, int children[])
+{
+  double total;
+  int i, c, live, picked, handed;
+
+  total = Accumulate(resampler->weight, resampler->cumulative, n);
+
+  // An uninformative scan is one where the weights are nearly even. Drawing at random would then only
+  // add noise to which samples are kept.
+  resampler->skipped = 0;
+  if (resampler->ess > 0.0) {
+    live = 0;
+    for (i = 0; i < n; i++)
+      if (resampler->weight[i] > 0.0)
+	live++;
+    if (EffectiveSampleSize(resampler->weight, n) >= resampler->ess * live)
+      resampler->skipped = 1;
+  }
+
+  if (!resampler->skipped &&
+      ((resampler->strategy == RESAMPLE_MULTINOMIAL) || (resampler->strategy == RESAMPLE_ALIAS)))
+    return DrawEach(resampler, n, draws, parents, children, total);
+
+  memset(resampler->count, 0, n * sizeof(int));
+  if (!resampler->skipped && (resampler->strategy == RESAMPLE_RESIDUAL))
+    DrawResidual(resampler, n, draws, total);
+  else
+    DrawSpaced(resampler, n, draws, total, resampler->skipped);
+
+  // If too many different samples were picked, only the ones with the most children are kept, and
+  // the children of the rest are left for the caller to hand out again.
+  picked = 0;
+  for (i = 0; i < n; i++)
+    if ((resampler->count[i] > 0) || (children[i] > 0))
+      picked++;
+  if ((parents <= 0) || (picked <= parents)) {
+    for (i = 0; i < n; i++)
+      children[i] = children[i] + resampler->count[i];
+    return draws;
+  }
+
+  picked = 0;
+  for (i = 0; i < n; i++)
+    if (children[i] > 0)
+      picked++;
+  handed = 0;
+  for (c = draws; (c > 0) && (picked < parents); c--)
+    for (i = 0; (i < n) && (picked < parents); i++)
+      if (resampler->count[i] == c) {
+	if (children[i] == 0)
+	  picked++;
+	children[i] = children[i] + c;
+	handed = handed + c;
+      }
+  return handed;
+}
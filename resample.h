@@ -0,0 +1,77 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// resample.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Resampling for the particle filters at both levels: deciding which of the evaluated samples
+// live on as particles, and how many children (samples in the next generation) each of them gets.
+// Every strategy works from the running total of the weights, so that no draw has to walk the
+// whole list of samples, the way that the original code did.
+//
+
+#include "noise.h"
+
+// The different ways of drawing the children.
+// An independent draw for each child. This is how it has always been done, and is the default.
+#define RESAMPLE_MULTINOMIAL 0
+// A single random offset, with the draws evenly spaced after it. The lowest variance, and the cheapest.
+#define RESAMPLE_SYSTEMATIC 1
+// One independent draw inside each of the evenly spaced slices of the weights.
+#define RESAMPLE_STRATIFIED 2
+// Each sample gets the whole part of the number of children that it is expected to have outright,
+// and the rest are drawn independently.
+#define RESAMPLE_RESIDUAL 3
+// Independent draws, like RESAMPLE_MULTINOMIAL, but taken from an alias table in constant time.
+#define RESAMPLE_ALIAS 4
+#define RESAMPLE_STRATEGIES 5
+
+// The strategy used at the low level and at the high level (-e and -E options in slam.cpp).
+extern int RESAMPLER, H_RESAMPLER;
+// If the effective sample size of the weights is at least this fraction of the samples which weren't
+// culled, the scan is taken to say little about which samples are better, and the children are handed
+// out in proportion to the weights without any random draws at all (see Resample). 0 turns this off,
+// which is the default. For the low level and the high level (-k and -K options in slam.cpp).
+extern double RESAMPLE_ESS, H_RESAMPLE_ESS;
+
+// Each level keeps one of these, with room for all of its samples. The weights to draw from are put into
+// weight by the caller. The rest is scratch space for the different strategies.
+struct TResampler_struct {
+  int strategy;
+  double ess;
+  int room;
+  double *weight;
+  double *cumulative;
+  // For the alias table: the chance of keeping each column, and the sample it gives otherwise
+  double *keep;
+  int *alias, *work;
+  // How many children each sample would get, before any are turned away
+  int *count;
+  // Whether the last call to Resample handed out the children without drawing them
+  int skipped;
+  // Where the random draws come from. The caller opens this for each generation.
+  TStream stream;
+};
+typedef struct TResampler_struct TResampler;
+
+// Returns the strategy with the given name (multinomial, systematic, stratified, residual or alias), or -1.
+int ResamplerStrategy(const char *name);
+// Sets up a resampler which can handle up to room samples. Returns -1 if it can't be allocated.
+int InitResampler(TResampler *resampler, int strategy, double ess, int room);
+// The effective sample size of the n weights: (sum w)^2 / sum w^2
+double EffectiveSampleSize(const double weight[], int n);
+// Hands out draws children among the first n weights in resampler->weight, adding them in to children[].
+// No more than parents different samples will get children (0 for no limit). Like the original code, if that many
+// samples have been picked before all of the children are handed out, this stops early, and returns
+// how many children were handed out. The caller then hands out the rest among the samples picked so far.
+int Resample(TResampler *resampler, int n, int draws, int parents, int children[]);
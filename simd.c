@@ -0,0 +1,219 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// simd.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Vectorised line trace kernels. See simd.h for the interface.
+//
+
+#include <math.h>
+#include <immintrin.h>
+#include "simd.h"
+#include "fastMath.h"
+
+int SIMD_LEVEL = SIMD_SCALAR;
+
+// The line traces never need an exponent outside of this range. Anything below is
+// rounded off to zero, which is what the library exp would give for it anyway.
+#define EXP_LOW -708.0
+#define EXP_HIGH 0.0
+
+// ln(2), split in two so that the high part multiplies exactly by any exponent we see.
+#define LN2_HI 6.93147180369123816490e-01
+#define LN2_LO 1.90821492927058770002e-10
+
+// Terms of the Taylor series for exp, used on the remainder after the powers of two are
+// removed. With the remainder at most ln(2)/2, 13 terms are good to within a couple of
+// units in the last place, which is more than the line traces can tell apart.
+#define EXP_TERMS 13
+// With FAST_MATH set, the series is cut short at FAST_EXP_TERMS, for a relative error of at most 3e-10.
+#define FAST_EXP_TERMS 8
+static const double expTerm[EXP_TERMS+1] = {
+  1.0, 1.0, 1.0/2.0, 1.0/6.0, 1.0/24.0, 1.0/120.0, 1.0/720.0, 1.0/5040.0, 1.0/40320.0,
+  1.0/362880.0, 1.0/3628800.0, 1.0/39916800.0, 1.0/479001600.0, 1.0/6227020800.0
+};
+
+
+//
+// The plain version, one lane at a time. This does exactly the same arithmetic as LowLineTrace.
+//
+static void TraceEvaluateScalar(int steps, const double *rate, const double *dist, const double *error, double variance,
+				double eval[TRACE_LANES], double totalProb[TRACE_LANES])
+{
+  int k, l;
+  double prob;
+
+  for (l = 0; l < TRACE_LANES; l++) {
+    eval[l] = 0.0;
+    totalProb[l] = 1.0;
+  }
+
+  for (k = 0; k < steps; k++)
+    for (l = 0; l < TRACE_LANES; l++) {
+      prob = totalProb[l] * (1.0 - ModelExp(-rate[k*TRACE_LANES+l] * dist[k*TRACE_LANES+l]));
+      if ((prob > 0) && (error[k*TRACE_LANES+l] < 20))
+	eval[l] = eval[l] + (prob * ModelExp( -(error[k*TRACE_LANES+l] * error[k*TRACE_LANES+l])/(2*variance) ));
+      totalProb[l] = totalProb[l] - prob;
+    }
+}
+
+
+//
+// exp for two values at a time, using SSE4.1. The powers of two are removed from x,
+// the remainder goes through the Taylor series, and the powers of two are put back by
+// building them directly into the exponent bits.
+//
+__attribute__((target("sse4.1")))
+static inline __m128d ExpSSE4(__m128d x, int terms)
+{
+  __m128d n, r, sum;
+  __m128i bits;
+  int i;
+
+  x = _mm_min_pd(_mm_max_pd(x, _mm_set1_pd(EXP_LOW)), _mm_set1_pd(EXP_HIGH));
+  n = _mm_round_pd(_mm_mul_pd(x, _mm_set1_pd(M_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  r = _mm_sub_pd(x, _mm_mul_pd(n, _mm_set1_pd(LN2_HI)));
+  r = _mm_sub_pd(r, _mm_mul_pd(n, _mm_set1_pd(LN2_LO)));
+
+  sum = _mm_set1_pd(expTerm[terms]);
+  for (i = terms-1; i >= 0; i--)
+    sum = _mm_add_pd(_mm_mul_pd(sum, r), _mm_set1_pd(expTerm[i]));
+
+  // Adding 1.5*2^52 leaves n as an integer in the low bits, which can then be moved up into the exponent.
+  bits = _mm_castpd_si128(_mm_add_pd(n, _mm_set1_pd(6755399441055744.0)));
+  bits = _mm_slli_epi64(_mm_add_epi64(bits, _mm_set1_epi64x(1023)), 52);
+  return _mm_mul_pd(sum, _mm_castsi128_pd(bits));
+}
+
+
+__attribute__((target("sse4.1")))
+static void TraceEvaluateSSE4(int steps, const double *rate, const double *dist, const double *error, double variance,
+			      double eval[TRACE_LANES], double totalProb[TRACE_LANES])
+{
+  int k, half, terms;
+  __m128d r, d, e, prob, gauss, mask;
+  __m128d ev[TRACE_LANES/2], tp[TRACE_LANES/2];
+  __m128d one, zero, limit, scale;
+
+  one = _mm_set1_pd(1.0);
+  zero = _mm_setzero_pd();
+  limit = _mm_set1_pd(20.0);
+  scale = _mm_set1_pd(2*variance);
+  terms = (FAST_MATH ? FAST_EXP_TERMS : EXP_TERMS);
+  for (half = 0; half < TRACE_LANES/2; half++) {
+    ev[half] = zero;
+    tp[half] = one;
+  }
+
+  for (k = 0; k < steps; k++)
+    for (half = 0; half < TRACE_LANES/2; half++) {
+      r = _mm_loadu_pd(rate + k*TRACE_LANES + 2*half);
+      d = _mm_loadu_pd(dist + k*TRACE_LANES + 2*half);
+      e = _mm_loadu_pd(error + k*TRACE_LANES + 2*half);
+
+      prob = _mm_mul_pd(tp[half], _mm_sub_pd(one, ExpSSE4(_mm_mul_pd(_mm_sub_pd(zero, r), d), terms)));
+      gauss = ExpSSE4(_mm_sub_pd(zero, _mm_div_pd(_mm_mul_pd(e, e), scale)), terms);
+      mask = _mm_and_pd(_mm_cmpgt_pd(prob, zero), _mm_cmplt_pd(e, limit));
+      ev[half] = _mm_add_pd(ev[half], _mm_and_pd(mask, _mm_mul_pd(prob, gauss)));
+      tp[half] = _mm_sub_pd(tp[half], prob);
+    }
+
+  for (half = 0; half < TRACE_LANES/2; half++) {
+    _mm_storeu_pd(eval + 2*half, ev[half]);
+    _mm_storeu_pd(totalProb + 2*half, tp[half]);
+  }
+}
+
+
+//
+// The same as ExpSSE4, but for four values at a time with AVX2 and fused multiply-adds.
+//
+__attribute__((target("avx2,fma")))
+static inline __m256d ExpAVX2(__m256d x, int terms)
+{
+  __m256d n, r, sum;
+  __m256i bits;
+  int i;
+
+  x = _mm256_min_pd(_mm256_max_pd(x, _mm256_set1_pd(EXP_LOW)), _mm256_set1_pd(EXP_HIGH));
+  n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(M_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_HI), x);
+  r = _mm256_fnmadd_pd(n, _mm256_set1_pd(LN2_LO), r);
+
+  sum = _mm256_set1_pd(expTerm[terms]);
+  for (i = terms-1; i >= 0; i--)
+    sum = _mm256_fmadd_pd(sum, r, _mm256_set1_pd(expTerm[i]));
+
+  bits = _mm256_castpd_si256(_mm256_add_pd(n, _mm256_set1_pd(6755399441055744.0)));
+  bits = _mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52);
+  return _mm256_mul_pd(sum, _mm256_castsi256_pd(bits));
+}
+
+
+__attribute__((target("avx2,fma")))
+static void TraceEvaluateAVX2(int steps, const double *rate, const double *dist, const double *error, double variance,
+			      double eval[TRACE_LANES], double totalProb[TRACE_LANES])
+{
+  int k, terms;
+  __m256d r, d, e, prob, gauss, mask;
+  __m256d ev, tp, one, zero, limit, scale;
+
+  one = _mm256_set1_pd(1.0);
+  zero = _mm256_setzero_pd();
+  limit = _mm256_set1_pd(20.0);
+  scale = _mm256_set1_pd(2*variance);
+  terms = (FAST_MATH ? FAST_EXP_TERMS : EXP_TERMS);
+  ev = zero;
+  tp = one;
+
+  for (k = 0; k < steps; k++) {
+    r = _mm256_loadu_pd(rate + k*TRACE_LANES);
+    d = _mm256_loadu_pd(dist + k*TRACE_LANES);
+    e = _mm256_loadu_pd(error + k*TRACE_LANES);
+
+    prob = _mm256_mul_pd(tp, _mm256_sub_pd(one, ExpAVX2(_mm256_mul_pd(_mm256_sub_pd(zero, r), d), terms)));
+    gauss = ExpAVX2(_mm256_sub_pd(zero, _mm256_div_pd(_mm256_mul_pd(e, e), scale)), terms);
+    mask = _mm256_and_pd(_mm256_cmp_pd(prob, zero, _CMP_GT_OQ), _mm256_cmp_pd(e, limit, _CMP_LT_OQ));
+    ev = _mm256_add_pd(ev, _mm256_and_pd(mask, _mm256_mul_pd(prob, gauss)));
+    tp = _mm256_sub_pd(tp, prob);
+  }
+
+  _mm256_storeu_pd(eval, ev);
+  _mm256_storeu_pd(totalProb, tp);
+}
+
+
+int InitSimd(int limit)
+{
+  __builtin_cpu_init();
+  if ((limit >= SIMD_AVX2) && (__builtin_cpu_supports("avx2")) && (__builtin_cpu_supports("fma")))
+    SIMD_LEVEL = SIMD_AVX2;
+  else if ((limit >= SIMD_SSE4) && (__builtin_cpu_supports("sse4.1")))
+    SIMD_LEVEL = SIMD_SSE4;
+  else
+    SIMD_LEVEL = SIMD_SCALAR;
+  return SIMD_LEVEL;
+}
+
+
+void TraceEvaluate(int steps, const double *rate, const double *dist, const double *error, double variance,
+		   double eval[TRACE_LANES], double totalProb[TRACE_LANES])
+{
+  if (SIMD_LEVEL == SIMD_AVX2)
+    TraceEvaluateAVX2(steps, rate, dist, error, variance, eval, totalProb);
+  else if (SIMD_LEVEL == SIMD_SSE4)
+    TraceEvaluateSSE4(steps, rate, dist, error, variance, eval, totalProb);
+  else
+    TraceEvaluateScalar(steps, rate, dist, error, variance, eval, totalProb);
+}
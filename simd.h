@@ -0,0 +1,46 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// simd.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Vectorised kernels for evaluating several line traces at once. The cells crossed by
+// each trace are found first (see LowLineTraceBatch in lowMap.c), and then the probability
+// of each trace is accumulated with one trace per vector lane. Which instruction set is used
+// is decided at run time, based on what the processor supports.
+//
+
+// The instruction sets that the kernels are written for.
+#define SIMD_SCALAR 0
+#define SIMD_SSE4 1
+#define SIMD_AVX2 2
+
+// The number of line traces which are evaluated together.
+#define TRACE_LANES 4
+
+// The instruction set currently in use by the kernels.
+extern int SIMD_LEVEL;
+
+// Checks the processor for the best instruction set that it supports, up to the given limit,
+// and selects the kernels for it. Returns the level chosen.
+int InitSimd(int limit);
+
+// Accumulates the probability of TRACE_LANES line traces at once. The inputs are interleaved
+// by lane, so that the values for step k of lane l are at [k*TRACE_LANES + l]. For each step,
+// rate is the density of the grid square (so that the chance of being stopped there is
+// 1-exp(-rate*dist)), dist is the length of the trace through that square, and error is how far
+// the end of that square is from the measured distance. Lanes which have run out of steps are
+// padded with a rate of 0. On return, eval and totalProb hold the unnormalized evaluation of
+// each trace, and the probability that the trace was never stopped.
+void TraceEvaluate(int steps, const double *rate, const double *dist, const double *error, double variance,
+		   double eval[TRACE_LANES], double totalProb[TRACE_LANES]);
@@ -26,9 +26,15 @@
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #include "high.h"
 #include "mt-rand.h"
+#include "threads.h"
+#include "simd.h"
+#include "fastMath.h"
+#include "resample.h"
+#include "image.h"
 
 // The initial seed used for the random number generated can be set here.
 #define SEED 1
@@ -54,6 +60,115 @@ double RotationSpeed, TranslationSpeed;
 int continueSlam;
 int PLAYBACK_COMPLETE = 0;
 
+// The number of segments that the low level can get ahead of the high level.
+#define PIPELINE_DEPTH 2
+
+// Whether the two levels are run at the same time, with the low level mapping the next segment while the high
+// level works on the last one. Otherwise, they take turns, as they used to.
+int PIPELINE = 1;
+
+// The segments that the low level has finished, waiting for the high level. Segments [segmentsUsed, segmentsMade)
+// are ready. The counts only ever go up, and segment n is kept in segment[n % PIPELINE_DEPTH].
+TSegmentLog segment[PIPELINE_DEPTH];
+int segmentsMade, segmentsUsed, lowFinished;
+pthread_mutex_t segmentLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t segmentReady = PTHREAD_COND_INITIALIZER;
+pthread_cond_t segmentRoom = PTHREAD_COND_INITIALIZER;
+
+
+//
+// CompareRuns
+//
+// Reads the best poses recorded by two runs of SLAM (see POSE_LOG in low.h), and reports how 
+// far apart they are, both at worst and at the end of the runs.
+//
+int CompareRuns(FILE *record[2], double seconds[2])
+{
+  int generation[2], count, worstGeneration;
+  double x[2], y[2], theta[2];
+  double distance, angle, worstDistance, worstAngle;
+
+  rewind(record[0]);
+  rewind(record[1]);
+  count = 0;
+  worstGeneration = 0;
+  worstDistance = 0.0;
+  worstAngle = 0.0;
+  distance = 0.0;
+  angle = 0.0;
+  while ((fscanf(record[0], "%d %lf %lf %lf", &generation[0], &x[0], &y[0], &theta[0]) == 4) &&
+	 (fscanf(record[1], "%d %lf %lf %lf", &generation[1], &x[1], &y[1], &theta[1]) == 4)) {
+    distance = sqrt((x[0]-x[1])*(x[0]-x[1]) + (y[0]-y[1])*(y[0]-y[1]));
+    angle = fabs(atan2(sin(theta[0]-theta[1]), cos(theta[0]-theta[1])));
+    if (distance > worstDistance) {
+      worstDistance = distance;
+      worstGeneration = count;
+    }
+    worstAngle = MAX(worstAngle, angle);
+    count++;
+  }
+
+  fprintf(stderr, "\n********** Fast Math Validation **********\n");
+  if (count == 0) {
+    fprintf(stderr, "No poses were recorded. Did both runs complete?\n");
+    return -1;
+  }
+  fprintf(stderr, "Compared %d generations. The exact run took %.1f seconds, the fast run %.1f seconds.\n", 
+	  count, seconds[0], seconds[1]);
+  fprintf(stderr, "Largest difference in position: %.4f grid squares (%.4f m), at generation %d.\n",
+	  worstDistance, worstDistance/MAP_SCALE, worstGeneration);
+  fprintf(stderr, "Largest difference in facing angle: %.5f radians.\n", worstAngle);
+  fprintf(stderr, "Final poses differ by %.4f grid squares (%.4f m) and %.5f radians.\n", 
+	  distance, distance/MAP_SCALE, angle);
+  return 0;
+}
+
+
+
+//
+// ValidateFastMath
+//
+// Runs SLAM twice, in separate processes: once with the standard math library, and once with the fast math of 
+// fastMath.h. Both runs record the best pose of each generation, and when they are done, the poses are compared
+// to see how far apart the runs have drifted. This only returns in the child processes, giving the setting of 
+// FAST_MATH that the child should run with. The parent reports the results and exits.
+//
+int ValidateFastMath()
+{
+  FILE *record[2];
+  double seconds[2];
+  struct timeval start, end;
+  pid_t pid;
+  int fast, status;
+
+  for (fast = 0; fast < 2; fast++) {
+    record[fast] = tmpfile();
+    if (record[fast] == NULL) {
+      fprintf(stderr, "Unable to create a file to record the poses in.\n");
+      exit(-1);
+    }
+
+    // Anything still buffered would otherwise be written out by both processes.
+    fflush(NULL);
+    gettimeofday(&start, NULL);
+    pid = fork();
+    if (pid == 0) {
+      POSE_LOG = record[fast];
+      return fast;
+    }
+    if (pid < 0) {
+      fprintf(stderr, "Unable to start a run for validation.\n");
+      exit(-1);
+    }
+    waitpid(pid, &status, 0);
+    gettimeofday(&end, NULL);
+    seconds[fast] = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec)/1000000.0;
+  }
+
+  exit(CompareRuns(record, seconds));
+}
+
+
 
 //
 //
@@ -112,36 +227,95 @@ void WriteLog(FILE *logFile, TSense sense)
  
 
 
+//
+// LowStage
+//
+// The low level half of the pipeline. Maps each segment at the low level, as soon as there is room
+// for it, and passes it on to the high level.
+//
+void *LowStage(void *a)
+{
+  TSegmentLog *log;
+
+  while (continueSlam) {
+    pthread_mutex_lock(&segmentLock);
+    while (segmentsMade - segmentsUsed == PIPELINE_DEPTH)
+      pthread_cond_wait(&segmentRoom, &segmentLock);
+    log = &segment[segmentsMade % PIPELINE_DEPTH];
+    pthread_mutex_unlock(&segmentLock);
+
+    LowSlam(continueSlam, log);
+
+    pthread_mutex_lock(&segmentLock);
+    segmentsMade++;
+    pthread_cond_signal(&segmentReady);
+    pthread_mutex_unlock(&segmentLock);
+  }
+
+  pthread_mutex_lock(&segmentLock);
+  lowFinished = 1;
+  pthread_cond_signal(&segmentReady);
+  pthread_mutex_unlock(&segmentLock);
+  return NULL;
+}
+
+
+
 //
 // This calls the procedures in the other files which do all the real work. 
 // If you wanted to not use hierarchical SLAM, you could remove all references here to High*, and make
 // certain to set LOW_DURATION in low.h to some incredibly high number.
+// When PIPELINE is set, the low level runs in a thread of its own (LowStage), and this thread takes
+// each segment from it in turn for the high level. The two levels share nothing but the segments.
 //
 void *Slam(void *a)
 {
-  TPath *path, *trashPath;
-  TSenseLog *obs, *trashObs;
+  pthread_t lowThread;
+  TSegmentLog *log;
+  int i;
 
   InitHighSlam();
   InitLowSlam();
+  memset(segment, 0, PIPELINE_DEPTH * sizeof(TSegmentLog));
+  segmentsMade = segmentsUsed = lowFinished = 0;
 
-  while (continueSlam) {
-    LowSlam(continueSlam, &path, &obs);
-    HighSlam(path, obs);
-
-    // Get rid of the path and log of observations
-    while (path != NULL) {
-      trashPath = path;
-      path = path->next;
-      free(trashPath);
+  if (!PIPELINE) 
+    while (continueSlam) {
+      LowSlam(continueSlam, &segment[0]);
+      HighSlam(&segment[0]);
+    }
+  else {
+    if (pthread_create(&lowThread, NULL, LowStage, NULL) != 0) {
+      fprintf(stderr, "Unable to start the low level thread.\n");
+      exit(-1);
     }
-    while (obs != NULL) {
-      trashObs = obs;
-      obs = obs->next;
-      free(trashObs);
+
+    while (1) {
+      pthread_mutex_lock(&segmentLock);
+      while ((segmentsMade == segmentsUsed) && !lowFinished)
+	pthread_cond_wait(&segmentReady, &segmentLock);
+      if (segmentsMade == segmentsUsed) {
+	pthread_mutex_unlock(&segmentLock);
+	break;
+      }
+      log = &segment[segmentsUsed % PIPELINE_DEPTH];
+      pthread_mutex_unlock(&segmentLock);
+
+      HighSlam(log);
+
+      pthread_mutex_lock(&segmentLock);
+      segmentsUsed++;
+      pthread_cond_signal(&segmentRoom);
+      pthread_mutex_unlock(&segmentLock);
     }
+    pthread_join(lowThread, NULL);
   }
 
+  // Get rid of the paths and logs of observations
+  for (i = 0; i < PIPELINE_DEPTH; i++) {
+    free(segment[i].path);
+    free(segment[i].sense);
+  }
   CloseLowSlam();
   return NULL;
 }
@@ -157,7 +331,8 @@ void *Slam(void *a)
 int main (int argc, char *argv[])
 {
   //char command[256], tempString[20];
-  int x;
+  int x, threads, simd, fast, validate, particles, highParticles, minSamples, noise;
+  char *config, *binary;
   //int y;
   //double maxDist, tempDist, tempAngle;
   int WANDER, EXPLORE, DIRECT_COMMAND;
@@ -165,6 +340,16 @@ int main (int argc, char *argv[])
     
   RECORDING = "";
   PLAYBACK = "";
+  threads = 1;
+  simd = SIMD_AVX2;
+  fast = 0;
+  validate = 0;
+  config = NULL;
+  binary = NULL;
+  particles = 0;
+  highParticles = 0;
+  minSamples = 0;
+  noise = NOISE_XOSHIRO;
   for (x = 1; x < argc; x++) {
     if (!strncmp(argv[x], "-R", 2))
       RECORDING = "current.log";
@@ -178,8 +363,112 @@ int main (int argc, char *argv[])
     }
     else if (!strncmp(argv[x], "-P", 2))
       PLAYBACK = "current.log";
+    // The number of threads to use for evaluating samples.
+    else if (!strncmp(argv[x], "-t", 2)) {
+      x++;
+      threads = atoi(argv[x]);
+    }
+    // The most advanced vector instructions to use for line traces (0 = none, 1 = SSE4.1, 2 = AVX2).
+    else if (!strncmp(argv[x], "-s", 2)) {
+      x++;
+      simd = atoi(argv[x]);
+    }
+    // Use the faster, less accurate exp and log in the observation model.
+    else if (!strncmp(argv[x], "-f", 2))
+      fast = 1;
+    // Run both with and without the fast math, and report how far apart the results are.
+    else if (!strncmp(argv[x], "-V", 2))
+      validate = 1;
+    // Read the sizes of the maps and the numbers of particles from a configuration file (see map.h).
+    else if (!strncmp(argv[x], "-m", 2)) {
+      x++;
+      config = argv[x];
+    }
+    // The number of particles at the low level, and at the high level. These take precedence over the configuration file.
+    else if (!strncmp(argv[x], "-n", 2)) {
+      x++;
+      particles = atoi(argv[x]);
+    }
+    else if (!strncmp(argv[x], "-N", 2)) {
+      x++;
+      highParticles = atoi(argv[x]);
+    }
+    // Adapt the number of samples at the low level to how spread out they are, generating no fewer than this many
+    // (see MIN_SAMPLE_NUMBER in map.h). This takes precedence over the configuration file.
+    else if (!strncmp(argv[x], "-a", 2)) {
+      x++;
+      minSamples = atoi(argv[x]);
+    }
+    // Wipe the low level observation cache and build it again for every generation, rather than keeping it.
+    else if (!strncmp(argv[x], "-w", 2))
+      KEEP_OBSERVATIONS = 0;
+    // Draw the motion noise from the Mersenne Twister, the way earlier versions did, so that runs can be compared with them.
+    else if (!strncmp(argv[x], "-g", 2))
+      noise = NOISE_MT;
+    // Run the low level and the high level in turn, rather than at the same time.
+    else if (!strncmp(argv[x], "-S", 2))
+      PIPELINE = 0;
+    // Add the scans to the maps one particle at a time, rather than by stripes (see InsertScans in levelMap.h).
+    else if (!strncmp(argv[x], "-i", 2))
+      PARALLEL_INSERT = 0;
+    // The format to write the pictures of the maps in (png or ppm).
+    else if (!strncmp(argv[x], "-F", 2)) {
+      x++;
+      if ((x < argc) && !strcmp(argv[x], "png"))
+	IMAGE_FORMAT = IMAGE_PNG;
+      else if ((x < argc) && !strcmp(argv[x], "ppm"))
+	IMAGE_FORMAT = IMAGE_PPM;
+      else {
+	fprintf(stderr, "Unknown image format for -F.\n");
+	return -1;
+      }
+    }
+    // Write the high level maps out in tiles, only rewriting the tiles that change, rather than as whole images.
+    else if (!strncmp(argv[x], "-T", 2))
+      TILED_MAPS = 1;
+    // Convert the data log given with -p into a binary log with this name, and then quit (see binlog.h).
+    else if (!strncmp(argv[x], "-b", 2)) {
+      x++;
+      binary = argv[x];
+    }
+    // How to resample at the low level, and at the high level (multinomial, systematic, stratified, residual or alias).
+    else if (!strncmp(argv[x], "-e", 2) || !strncmp(argv[x], "-E", 2)) {
+      x++;
+      if ((x >= argc) || (ResamplerStrategy(argv[x]) == -1)) {
+	fprintf(stderr, "Unknown resampling strategy for %s.\n", argv[x-1]);
+	return -1;
+      }
+      if (argv[x-1][1] == 'e')
+	RESAMPLER = ResamplerStrategy(argv[x]);
+      else
+	H_RESAMPLER = ResamplerStrategy(argv[x]);
+    }
+    // Hand out the children without drawing them when the effective sample size is at least this fraction of the samples,
+    // at the low level and at the high level.
+    else if (!strncmp(argv[x], "-k", 2)) {
+      x++;
+      RESAMPLE_ESS = atof(argv[x]);
+    }
+    else if (!strncmp(argv[x], "-K", 2)) {
+      x++;
+      H_RESAMPLE_ESS = atof(argv[x]);
+    }
   }
 
+  if (binary != NULL)
+    return ConvertLog(PLAYBACK, binary);
+
+  if ((config != NULL) && (ReadMapConfig(config) == -1))
+    return -1;
+  if (particles > 0)
+    PARTICLE_NUMBER = particles;
+  if (highParticles > 0)
+    H_PARTICLE_NUMBER = highParticles;
+  if (minSamples > 0)
+    MIN_SAMPLE_NUMBER = minSamples;
+  if (InitMapSizes() == -1)
+    return -1;
+
   fprintf(stderr, "********** Localization Example *************\n");
   if (PLAYBACK == "")
     if (InitializeRobot(argc, argv) == -1)
@@ -188,6 +477,16 @@ int main (int argc, char *argv[])
   fprintf(stderr, "********** World Initialization ***********\n");
 
   seedMT(SEED);
+  InitNoise(noise, SEED);
+  // Both levels draw from the one Mersenne Twister when the old noise is asked for, so the order
+  // of the draws (and so the results) would depend on how the two threads happened to interleave.
+  if (noise == NOISE_MT)
+    PIPELINE = 0;
+  if (validate)
+    fast = ValidateFastMath();
+  InitFastMath(fast);
+  InitThreads(threads);
+  InitSimd(simd);
   // Spawn off a seperate thread to do SLAM
   //
   // Should use semaphores or similar to prevent reading of the map
@@ -314,6 +613,8 @@ int main (int argc, char *argv[])
   */
 
   pthread_join(slam_thread, NULL);
+  CloseImages();
+  CloseThreads();
   return 0;
 }
 
@@ -0,0 +1,219 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// threads.c
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// Worker pool with work stealing. See threads.h for the interface.
+//
+
+#include <pthread.h>
+#include "basic.h"
+#include "threads.h"
+
+int THREADS = 1;
+
+// Each worker owns a range of indices [next, last) that it works through from the front.
+// Other workers, when they run out of their own work, take half of what remains from the back.
+struct TWorkQueue_struct {
+  pthread_mutex_t lock;
+  int next, last;
+};
+typedef struct TWorkQueue_struct TWorkQueue;
+
+static TWorkQueue queue[MAX_THREADS];
+static pthread_t worker[MAX_THREADS];
+
+// The job currently being run by the pool. jobNumber is incremented each time a new
+// job is posted, which is how the sleeping workers know that there is something to do.
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t jobDone = PTHREAD_COND_INITIALIZER;
+static int jobNumber, active, stopping;
+static int jobGrain;
+static TWorkFunction jobFunction;
+static void *jobArg;
+// Held for the whole of each job, since there is only the one pool. Another thread which wants to
+// use it waits its turn.
+static pthread_mutex_t jobLock = PTHREAD_MUTEX_INITIALIZER;
+
+
+//
+// Finds the next range of indices for worker w to process. First looks at its own queue,
+// and then tries to steal half of the remaining work from the worker with the most left.
+// Returns 0 when there is no work left anywhere.
+//
+static int TakeWork(int w, int *start, int *end)
+{
+  int v, victim, most, remaining, half;
+
+  while (1) {
+    pthread_mutex_lock(&queue[w].lock);
+    if (queue[w].next < queue[w].last) {
+      *start = queue[w].next;
+      *end = MIN(queue[w].next + jobGrain, queue[w].last);
+      queue[w].next = *end;
+      pthread_mutex_unlock(&queue[w].lock);
+      return 1;
+    }
+    pthread_mutex_unlock(&queue[w].lock);
+
+    // Our own queue is empty. Look for the worker with the most left to do. This peek is
+    // not locked, and is only a hint- the actual steal is checked under the victim's lock.
+    victim = -1;
+    most = 0;
+    for (v = 0; v < THREADS; v++) {
+      remaining = __atomic_load_n(&queue[v].last, __ATOMIC_RELAXED) - __atomic_load_n(&queue[v].next, __ATOMIC_RELAXED);
+      if ((v != w) && (remaining > most)) {
+	most = remaining;
+	victim = v;
+      }
+    }
+    if (victim == -1)
+      return 0;
+
+    pthread_mutex_lock(&queue[victim].lock);
+    remaining = queue[victim].last - queue[victim].next;
+    if (remaining <= 0) {
+      pthread_mutex_unlock(&queue[victim].lock);
+      continue;
+    }
+    half = (remaining+1)/2;
+    queue[victim].last = queue[victim].last - half;
+    *start = queue[victim].last;
+    pthread_mutex_unlock(&queue[victim].lock);
+
+    // Place the stolen range in our own queue, so that it too can be stolen from.
+    pthread_mutex_lock(&queue[w].lock);
+    queue[w].next = *start;
+    queue[w].last = *start + half;
+    pthread_mutex_unlock(&queue[w].lock);
+  }
+}
+
+
+//
+// Process work until there is none left, for the current job.
+//
+static void RunWork(int w)
+{
+  int i, start, end;
+
+  while (TakeWork(w, &start, &end))
+    for (i = start; i < end; i++)
+      jobFunction(i, w, jobArg);
+}
+
+
+//
+// The main loop of each worker thread. Sleep until a new job is posted, help out with
+// it, and then report back that we are done.
+//
+static void *WorkerLoop(void *arg)
+{
+  int w, seen;
+
+  w = (int) (long) arg;
+  seen = 0;
+  while (1) {
+    pthread_mutex_lock(&poolLock);
+    while ((jobNumber == seen) && (!stopping))
+      pthread_cond_wait(&jobReady, &poolLock);
+    if (stopping) {
+      pthread_mutex_unlock(&poolLock);
+      return NULL;
+    }
+    seen = jobNumber;
+    pthread_mutex_unlock(&poolLock);
+
+    RunWork(w);
+
+    pthread_mutex_lock(&poolLock);
+    active--;
+    if (active == 0)
+      pthread_cond_signal(&jobDone);
+    pthread_mutex_unlock(&poolLock);
+  }
+}
+
+
+void InitThreads(int count)
+{
+  long i;
+
+  THREADS = MAX(1, MIN(count, MAX_THREADS));
+  for (i = 0; i < THREADS; i++)
+    pthread_mutex_init(&queue[i].lock, NULL);
+
+  // Worker 0 is always the thread which calls ParallelFor, so we only spawn the rest.
+  stopping = 0;
+  for (i = 1; i < THREADS; i++)
+    if (pthread_create(&worker[i], (pthread_attr_t *) NULL, WorkerLoop, (void *) i) != 0) {
+      fprintf(stderr, "Unable to create worker thread %ld. Using %ld threads.\n", i, i);
+      THREADS = i;
+      break;
+    }
+}
+
+
+void CloseThreads()
+{
+  int i;
+
+  pthread_mutex_lock(&poolLock);
+  stopping = 1;
+  pthread_cond_broadcast(&jobReady);
+  pthread_mutex_unlock(&poolLock);
+
+  for (i = 1; i < THREADS; i++)
+    pthread_join(worker[i], NULL);
+  THREADS = 1;
+}
+
+
+void ParallelFor(int count, int grain, TWorkFunction func, void *arg)
+{
+  int i;
+
+  // Nothing to gain from the overhead of the pool.
+  if ((THREADS == 1) || (count <= grain)) {
+    for (i = 0; i < count; i++)
+      func(i, 0, arg);
+    return;
+  }
+
+  pthread_mutex_lock(&jobLock);
+
+  // Deal out the indices evenly to start with. Stealing will balance things out from there.
+  jobFunction = func;
+  jobArg = arg;
+  jobGrain = MAX(1, grain);
+  for (i = 0; i < THREADS; i++) {
+    queue[i].next = (int) (((long) count * i) / THREADS);
+    queue[i].last = (int) (((long) count * (i+1)) / THREADS);
+  }
+
+  pthread_mutex_lock(&poolLock);
+  active = THREADS-1;
+  jobNumber++;
+  pthread_cond_broadcast(&jobReady);
+  pthread_mutex_unlock(&poolLock);
+
+  RunWork(0);
+
+  pthread_mutex_lock(&poolLock);
+  while (active > 0)
+    pthread_cond_wait(&jobDone, &poolLock);
+  pthread_mutex_unlock(&poolLock);
+  pthread_mutex_unlock(&jobLock);
+}
@@ -0,0 +1,42 @@
+//
+// This Program is provided by Duke University and the authors as a service to the
+// research community. It is provided without cost or restrictions, except for the
+// User's acknowledgement that the Program is provided on an "As Is" basis and User
+// understands that Duke University and the authors make no express or implied
+// warranty of any kind.  Duke University and the authors specifically disclaim any
+// implied warranty or merchantability or fitness for a particular purpose, and make
+// no representations or warranties that the Program will not infringe the
+// intellectual property rights of others. The User agrees to indemnify and hold
+// harmless Duke University and the authors from and against any and all liability
+// arising out of User's use of the Program.
+//
+// threads.h
+//
+// Copyright 2005, Austin Eliazar, Ronald Parr, Duke University
+//
+// A small pool of worker threads, used to spread independent pieces of work (such
+// as the evaluation of each sample in Localize) across several processors. Work is
+// handed out in ranges of indices, and idle workers steal from the busiest ones, since
+// some indices (culled samples) are far cheaper than others (surviving samples).
+//
+
+// The most workers that we will ever spawn, regardless of what is asked for.
+#define MAX_THREADS 64
+
+// The number of workers (including the calling thread) used for parallel work.
+// A value of 1 runs everything serially on the calling thread.
+extern int THREADS;
+
+// A piece of parallel work. index is the item to work on, and worker is the number
+// (0 to THREADS-1) of the worker doing it, which can be used for per-worker scratch space.
+typedef void (*TWorkFunction)(int index, int worker, void *arg);
+
+// Spawns the worker threads. Should be called once, before any call to ParallelFor.
+void InitThreads(int count);
+// Stops and joins all of the worker threads.
+void CloseThreads();
+// Calls func for every index in [0, count), spread across all of the workers. Indices
+// are handed out grain at a time. Returns only once every index has been completed.
+// Both levels of the hierarchy may call this at once, from their own threads, in which
+// case one waits for the other's job to finish. func must not call it itself.
+void ParallelFor(int count, int grain, TWorkFunction func, void *arg);